@@ -22,51 +22,198 @@ SOFTWARE.
 
 */
 
+#define _GNU_SOURCE			// dl_iterate_phdr
 #include "selftest.h"
-#ifdef LINUX_SELFTEST_H
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
 #include <stddef.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fnmatch.h>
+#include "linux_selftest_internal.h"
 
 /*
 
 There are three primary sections created under the GNU tool chain:
 
-    .slftst.ini = arrays of function pointers to self tests
-	.slftst.txt = executable code for all self tests
-	.slftxst.str = constant strings used to report self test errors
+	slftst_ini0 ... slftst_ini9 = arrays of pointers to self-test descriptors
+	slftst_txt = executable code for all self tests
+	slftst_str = constant strings used to report self test errors
 
-The .slftst.ini section is further subdivided into twelve other sections,
-ten of which contain arrays of function pointers and the remaining two are
-"bookend" sections that bound the area of memory to be searched for
-function pointers.
+Each test level has a section of its own that holds a dense array of
+pointers to objects of type struct self_test, one for each test of that
+level.  All section names are valid C identifiers, so the linker defines
+a __start_ and a __stop_ symbol bounding each of them.  Running the self
+tests walks those exact arrays in level order and executes each test
+after printing its name.  No bookends are needed, so the tests are found
+whatever the order in which the objects are passed to the linker.
 
-Running the self tests involves scanning the memory between the bookend
-sections to search for non-NULL pointers to objects of type struct
-self_test.  When such a pointer is found, the self-test name is printed and
-the test is executed.
+The bounds are declared weak: a level without any test has no section, and
+its bounds then resolve to NULL.  The parallel runner uses the per-level
+arrays to treat each level as a dependency layer.
 
-IMPORTANT: It is critical that linux_selftest.o be the first object module
-passed to the linker for this to work.
+Benchmarks declared with SELF_BENCH() are kept apart from the tests in the
+slftst_bench section, which holds pointers to objects of type struct
+self_bench.  It is walked through its bounds in the same way.
+
+The bounds of the code and constant sections let sys_self_test_release()
+drop the pages of the self-test sections once the self tests have run.
+
+The bounds only cover the object the runner is linked into.  The same
+sections in shared objects are found from the section headers of their
+files, and their tests are gathered with those of the program before a
+run; see "Shared objects" below.
 
 */
 
-void __attribute__((__section__(".slftst.inis"))) *self_test_list_start = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_1))) *self_test_list_1 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_2))) *self_test_list_2 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_3))) *self_test_list_3 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_4))) *self_test_list_4 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_5))) *self_test_list_5 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_6))) *self_test_list_6 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_7))) *self_test_list_7 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_8))) *self_test_list_8 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_9))) *self_test_list_9 = NULL;
-void __attribute__((__section__(SELF_TEST_LEVEL_10))) *self_test_list_10 = NULL;
-void __attribute__((__section__(".slftst.inie"))) *self_test_list_end = NULL;
+#define SELF_TEST_LEVEL_BOUNDS(n) \
+	extern const struct self_test *__start_slftst_ini##n[] \
+		__attribute__((__weak__)); \
+	extern const struct self_test *__stop_slftst_ini##n[] \
+		__attribute__((__weak__))
+
+SELF_TEST_LEVEL_BOUNDS(0);
+SELF_TEST_LEVEL_BOUNDS(1);
+SELF_TEST_LEVEL_BOUNDS(2);
+SELF_TEST_LEVEL_BOUNDS(3);
+SELF_TEST_LEVEL_BOUNDS(4);
+SELF_TEST_LEVEL_BOUNDS(5);
+SELF_TEST_LEVEL_BOUNDS(6);
+SELF_TEST_LEVEL_BOUNDS(7);
+SELF_TEST_LEVEL_BOUNDS(8);
+SELF_TEST_LEVEL_BOUNDS(9);
+
+#define SELF_TEST_LEVEL_BOUNDS_LIST(b) \
+	{ b##0, b##1, b##2, b##3, b##4, b##5, b##6, b##7, b##8, b##9 }
+
+// The level sections of the program occupy [program_start[n],
+// program_stop[n])
+
+static const struct self_test **const program_start[SELF_TEST_LEVEL_COUNT] =
+	SELF_TEST_LEVEL_BOUNDS_LIST(__start_slftst_ini);
+
+static const struct self_test **const program_stop[SELF_TEST_LEVEL_COUNT] =
+	SELF_TEST_LEVEL_BOUNDS_LIST(__stop_slftst_ini);
+
+// Tests of level n occupy [level_start[n], level_stop[n]), which are the
+// sections of the program until shared objects add tests of their own
+
+static const struct self_test **level_start[SELF_TEST_LEVEL_COUNT] =
+	SELF_TEST_LEVEL_BOUNDS_LIST(__start_slftst_ini);
+
+static const struct self_test **level_stop[SELF_TEST_LEVEL_COUNT] =
+	SELF_TEST_LEVEL_BOUNDS_LIST(__stop_slftst_ini);
+
+size_t sys_self_test_level_count(size_t level)
+{
+	if (level_start[level] == NULL)
+		return 0;
+
+	return level_stop[level] - level_start[level];
+}
+
+const struct self_test *sys_self_test_level_test(size_t level, size_t slot)
+{
+	return level_start[level][slot];
+}
+
+// Number the tests from one, level after level, so that the buffered
+// reporting channel and the result cache can refer to them
+
+size_t sys_self_test_ordinal(size_t level, size_t slot)
+{
+	size_t i, ordinal = slot + 1;
+
+	for (i = 0; i < level; ++i)
+		ordinal += sys_self_test_level_count(i);
+
+	return ordinal;
+}
+
+static size_t test_total(void)
+{
+	return sys_self_test_ordinal(SELF_TEST_LEVEL_COUNT - 1,
+		sys_self_test_level_count(SELF_TEST_LEVEL_COUNT - 1));
+}
+
+// Set once the self-test pages have been released
+
+static int s_released = 0;
+
+static const char SELF_TEST_RO msg_released[] =
+	"self-test: error: self tests cannot run after their pages were released";
+
+// Dependency section bounds; weak so that a program that declares no
+// dependency still links
+
+extern const struct self_test_depends *__start_slftst_deps[]
+	__attribute__((__weak__));
+extern const struct self_test_depends *__stop_slftst_deps[]
+	__attribute__((__weak__));
+
+// Fixture section bounds; weak so that a program without any fixture
+// still links
+
+extern const struct self_test_fixture *__start_slftst_fix[]
+	__attribute__((__weak__));
+extern const struct self_test_fixture *__stop_slftst_fix[]
+	__attribute__((__weak__));
+
+// Memory budget section bounds; weak so that a program without any
+// budget still links
+
+extern const struct self_test_budget *__start_slftst_mem[]
+	__attribute__((__weak__));
+extern const struct self_test_budget *__stop_slftst_mem[]
+	__attribute__((__weak__));
+
+// Dependencies, fixtures and budgets of the program and of the shared
+// objects, gathered like the tests of a level
+
+const struct self_test_depends **sys_self_test_depends_start =
+	__start_slftst_deps;
+const struct self_test_depends **sys_self_test_depends_stop =
+	__stop_slftst_deps;
+static const struct self_test_fixture **fixture_start = __start_slftst_fix;
+static const struct self_test_fixture **fixture_stop = __stop_slftst_fix;
+static const struct self_test_budget **budget_start = __start_slftst_mem;
+static const struct self_test_budget **budget_stop = __stop_slftst_mem;
+
+// Constant section bounds
+
+extern const char __start_slftst_str[] __attribute__((__weak__));
+extern const char __stop_slftst_str[] __attribute__((__weak__));
 
 static const char SELF_TEST_RO msg_naked[] = "%s\n";
 static const char SELF_TEST_RO msg_decorated[] = "%s:%zu: %s\n";
 static const char SELF_TEST_RO msg_linker_warning[]  =
-	"self-test: warning: no self tests executed; is linux_selftest.o the first file passed to the linker?";
+	"self-test: warning: no self tests executed; none were linked";
+static const char SELF_TEST_RO msg_selection_warning[] =
+	"self-test: warning: no self tests executed; none were selected";
 
 void sys_self_test_report(const char *msg, const char *file, size_t line)
 {
@@ -76,38 +223,2862 @@ void sys_self_test_report(const char *msg, const char *file, size_t line)
 		fprintf(stderr, msg_decorated, file, line, msg);
 }
 
-int sys_self_test_run(self_test_report_pf report, unsigned flags)
+static const char SELF_TEST_RO msg_name_prefix[] =
+	"self-test: info: test ";
+
+// The descriptor only carries the announcement message; strip the
+// announcement to get back the name given to SELF_TEST().
+
+const char *sys_self_test_name(const struct self_test *test)
 {
-	const struct self_test **test;
-	size_t test_count;
-	int rc;
+	size_t length = sizeof(msg_name_prefix) - 1;
+
+	if (test->name == NULL)
+		return "?";
+	if (strncmp(test->name, msg_name_prefix, length) == 0)
+		return test->name + length;
+	return test->name;
+}
+
+//
+// Shared objects.
+//
+// The linker only bounds the sections of the object it links, so the
+// tests of a shared object loaded with dlopen() are out of reach of the
+// __start_ and __stop_ symbols of the program.  The loaded objects are
+// walked with dl_iterate_phdr() instead, and the section headers in the
+// file of each object locate its self-test sections in memory.  The tests
+// of each level are then gathered from the program and from the objects,
+// in load order, and so are the dependencies, fixtures and memory budgets.
+//
+// The objects are walked again whenever the dynamic linker reports that
+// one was loaded or unloaded since the last walk, so every run sees the
+// objects loaded at the time.  self_test_run_modules() only runs the tests
+// of the objects that have not been run yet, to be called after loading a
+// plugin.  Once a run involving shared objects completes, the results and
+// the time of each object are reported.
+//
+// The program is module 0.  A shared object whose file cannot be read, or
+// whose sections do not lie in its loaded segments, is left out.  Once the
+// self-test pages of the program have been released, its sections are left
+// out as well, so that the objects loaded afterwards can still be tested.
+//
+
+enum
+{
+	SECTION_DEPS = SELF_TEST_LEVEL_COUNT,	// After the level sections
+	SECTION_FIX,
+	SECTION_MEM,
+	SECTION_COUNT
+};
+
+struct module
+{
+	char				*path;		// File of the object
+	uintptr_t			base;		// Load address of the object
+	const void			**start[SECTION_COUNT];
+	const void			**stop[SECTION_COUNT];
+	int					ran;		// Tests run by an earlier run
+	size_t				tests;		// Results of the run in progress
+	size_t				failed;
+	uint64_t			wall_ns;
+};
+
+struct modules
+{
+	struct module		*module;	// The program, then the shared objects
+	size_t				count;
+	int					walked;
+	unsigned long long	adds;		// Loads and unloads seen by the walk
+	unsigned long long	subs;
+	const void			**merged[SECTION_COUNT];	// NULL with no object
+	size_t				merged_count[SECTION_COUNT];
+	size_t				*owner[SELF_TEST_LEVEL_COUNT];	// Module of a test
+};
+
+static struct modules s_modules;
+static int s_modules_fresh = 0;		// Only run the modules not run yet
+
+static const char *const section_name[SECTION_COUNT] =
+{
+	"slftst_ini0", "slftst_ini1", "slftst_ini2", "slftst_ini3",
+	"slftst_ini4", "slftst_ini5", "slftst_ini6", "slftst_ini7",
+	"slftst_ini8", "slftst_ini9", "slftst_deps", "slftst_fix", "slftst_mem"
+};
+
+static const char SELF_TEST_RO msg_module[] =
+	"self-test: info: module %s: %zu tests, %zu failed, wall %.3f ms";
+static const char SELF_TEST_RO msg_module_memory[] =
+	"self-test: warning: out of memory; running the tests of the program only";
+
+static int module_counts(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long long *counts = (unsigned long long *)data;
+
+	// Without the counters, every walk is taken as a change
+
+	if (size < offsetof(struct dl_phdr_info, dlpi_subs) +
+		sizeof(info->dlpi_subs))
+		return 1;
 
-	rc = 1;
-	test_count = 0;
-	test = (const struct self_test **)&self_test_list_start;
+	counts[0] = info->dlpi_adds;
+	counts[1] = info->dlpi_subs;
+	return 1;
+}
+
+static int module_mapped(const struct dl_phdr_info *info, uintptr_t address,
+	size_t size)
+{
+	const ElfW(Phdr) *phdr;
+	uintptr_t start;
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum; ++i)
+	{
+		phdr = &info->dlpi_phdr[i];
+		start = info->dlpi_addr + phdr->p_vaddr;
+		if (phdr->p_type == PT_LOAD && address >= start &&
+			address + size <= start + phdr->p_memsz)
+			return 1;
+	}
+
+	return 0;
+}
 
-	while (++test < (const struct self_test **)&self_test_list_end)
+// Locate the self-test sections of an object from the section headers of
+// its file; return zero when it has none
+
+static int module_read(const struct dl_phdr_info *info,
+	struct module *module)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Shdr) *shdr = NULL;
+	char *names = NULL;
+	const char *name;
+	uintptr_t address;
+	size_t size, i, j;
+	int fd, found = 0;
+
+	fd = open(info->dlpi_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != (ssize_t)sizeof(ehdr) ||
+		memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+		ehdr.e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 :
+		ELFCLASS32) || ehdr.e_shentsize != sizeof(*shdr) ||
+		ehdr.e_shnum == 0 || ehdr.e_shstrndx >= ehdr.e_shnum)
+		goto done;
+
+	size = (size_t)ehdr.e_shnum * sizeof(*shdr);
+	shdr = (ElfW(Shdr) *)malloc(size);
+	if (shdr == NULL ||
+		pread(fd, shdr, size, (off_t)ehdr.e_shoff) != (ssize_t)size)
+		goto done;
+
+	size = shdr[ehdr.e_shstrndx].sh_size;
+	names = (char *)malloc(size + 1);
+	if (names == NULL || pread(fd, names, size,
+		(off_t)shdr[ehdr.e_shstrndx].sh_offset) != (ssize_t)size)
+		goto done;
+	names[size] = '\0';
+
+	for (i = 0; i < ehdr.e_shnum; ++i)
 	{
-		if ((*test) != NULL)
+		if (shdr[i].sh_name >= size || shdr[i].sh_type == SHT_NOBITS)
+			continue;
+
+		name = names + shdr[i].sh_name;
+		address = info->dlpi_addr + shdr[i].sh_addr;
+
+		for (j = 0; j < SECTION_COUNT; ++j)
 		{
-			++test_count;
+			if (strcmp(name, section_name[j]) != 0 ||
+				!module_mapped(info, address, shdr[i].sh_size))
+				continue;
 
-			if ((*test)->name != NULL) 
-				report((*test)->name, NULL, 0);
-			
-			if (!(*test)->func(report)) 
-			{
-				if (flags & SELF_TEST_FLAG_STOP_ON_FAILURE) 
-					return 0;
-				rc = 0;
-			}
+			module->start[j] = (const void **)address;
+			module->stop[j] = module->start[j] +
+				shdr[i].sh_size / sizeof(void *);
+			found = 1;
 		}
 	}
 
-	if (test_count == 0)
-		report(msg_linker_warning, NULL, 0);
+done:
+	free(names);
+	free(shdr);
+	close(fd);
+	return found;
+}
 
-	return rc;
+static int module_find(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct modules *modules = (struct modules *)data;
+	struct module module = { NULL }, *grown;
+	uintptr_t self = (uintptr_t)&module_find;
+
+	(void)size;
+
+	// The program, and the object holding the runner, are bounded by the
+	// linker already
+
+	if (info->dlpi_name == NULL || info->dlpi_name[0] == '\0' ||
+		module_mapped(info, self, 1))
+		return 0;
+
+	if (!module_read(info, &module))
+		return 0;
+
+	module.base = info->dlpi_addr;
+	module.path = strdup(info->dlpi_name);
+	grown = (struct module *)realloc(modules->module,
+		(modules->count + 1) * sizeof(*grown));
+	if (module.path == NULL || grown == NULL)
+	{
+		free(module.path);
+		if (grown != NULL)
+			modules->module = grown;
+		modules->walked = 0;	// Out of memory
+		return 1;
+	}
+
+	modules->module = grown;
+	modules->module[modules->count++] = module;
+	return 0;
+}
+
+// Free the shared objects and the gathered sections, keeping the program
+
+static void module_drop(struct modules *modules)
+{
+	size_t i;
+
+	for (i = 1; i < modules->count; ++i)
+		free(modules->module[i].path);
+	for (i = 0; i < SECTION_COUNT; ++i)
+	{
+		free(modules->merged[i]);
+		modules->merged[i] = NULL;
+		modules->merged_count[i] = 0;
+	}
+	for (i = 0; i < SELF_TEST_LEVEL_COUNT; ++i)
+	{
+		free(modules->owner[i]);
+		modules->owner[i] = NULL;
+	}
+
+	if (modules->count > 1)
+		modules->count = 1;
+}
+
+// Gather the sections of every module; return zero when out of memory
+
+static int module_gather(struct modules *modules)
+{
+	const void **merged;
+	size_t section, count, used, i, n;
+
+	if (modules->count == 1)
+		return 1;
+
+	for (section = 0; section < SECTION_COUNT; ++section)
+	{
+		for (count = 0, i = 0; i < modules->count; ++i)
+			if (modules->module[i].start[section] != NULL)
+				count += modules->module[i].stop[section] -
+					modules->module[i].start[section];
+
+		if (count == 0)
+			continue;
+
+		merged = (const void **)malloc(count * sizeof(*merged));
+		modules->merged[section] = merged;
+		modules->merged_count[section] = count;
+		if (merged == NULL)
+			return 0;
+
+		if (section < SELF_TEST_LEVEL_COUNT)
+		{
+			modules->owner[section] = (size_t *)malloc(count * sizeof(size_t));
+			if (modules->owner[section] == NULL)
+				return 0;
+		}
+
+		for (used = 0, i = 0; i < modules->count; ++i)
+		{
+			if (modules->module[i].start[section] == NULL)
+				continue;
+
+			n = modules->module[i].stop[section] -
+				modules->module[i].start[section];
+			memcpy(merged + used, modules->module[i].start[section],
+				n * sizeof(*merged));
+			if (section < SELF_TEST_LEVEL_COUNT)
+				while (n-- > 0)
+					modules->owner[section][used++] = i;
+			else
+				used += n;
+		}
+	}
+
+	return 1;
+}
+
+// Point the section bounds used by the runner at the gathered sections
+
+static void module_bind(const struct modules *modules)
+{
+	const void **start, **stop;
+	size_t section;
+
+	for (section = 0; section < SECTION_COUNT; ++section)
+	{
+		start = modules->module[0].start[section];
+		stop = modules->module[0].stop[section];
+
+		if (modules->merged[section] != NULL)
+		{
+			start = modules->merged[section];
+			stop = start + modules->merged_count[section];
+		}
+
+		switch (section)
+		{
+		case SECTION_DEPS:
+			sys_self_test_depends_start =
+				(const struct self_test_depends **)start;
+			sys_self_test_depends_stop =
+				(const struct self_test_depends **)stop;
+			break;
+		case SECTION_FIX:
+			fixture_start = (const struct self_test_fixture **)start;
+			fixture_stop = (const struct self_test_fixture **)stop;
+			break;
+		case SECTION_MEM:
+			budget_start = (const struct self_test_budget **)start;
+			budget_stop = (const struct self_test_budget **)stop;
+			break;
+		default:
+			level_start[section] = (const struct self_test **)start;
+			level_stop[section] = (const struct self_test **)stop;
+			break;
+		}
+	}
+}
+
+// Walk the loaded objects again when one was loaded or unloaded since the
+// last walk; return non-zero when the tests may have changed
+
+static int module_scan(self_test_report_pf report)
+{
+	unsigned long long counts[2] = { ~0ull, ~0ull };
+	struct modules modules = { NULL };
+	struct module *program, *old;
+	size_t i, j;
+
+	dl_iterate_phdr(module_counts, counts);
+	if (s_modules.walked && counts[0] != ~0ull &&
+		counts[0] == s_modules.adds && counts[1] == s_modules.subs)
+		return 0;
+
+	program = (struct module *)calloc(1, sizeof(*program));
+	if (program == NULL)
+		return 0;
+
+	program->path = (char *)"program";
+	for (i = 0; i < SELF_TEST_LEVEL_COUNT && !s_released; ++i)
+	{
+		program->start[i] = (const void **)program_start[i];
+		program->stop[i] = (const void **)program_stop[i];
+	}
+	if (!s_released)
+	{
+		program->start[SECTION_DEPS] = (const void **)__start_slftst_deps;
+		program->stop[SECTION_DEPS] = (const void **)__stop_slftst_deps;
+		program->start[SECTION_FIX] = (const void **)__start_slftst_fix;
+		program->stop[SECTION_FIX] = (const void **)__stop_slftst_fix;
+		program->start[SECTION_MEM] = (const void **)__start_slftst_mem;
+		program->stop[SECTION_MEM] = (const void **)__stop_slftst_mem;
+	}
+
+	modules.module = program;
+	modules.count = 1;
+	modules.walked = 1;
+	modules.adds = counts[0];
+	modules.subs = counts[1];
+
+	dl_iterate_phdr(module_find, &modules);
+	if (!modules.walked || !module_gather(&modules))
+	{
+		if (report != NULL)
+			report(msg_module_memory, NULL, 0);
+		module_drop(&modules);
+		modules.walked = 1;
+	}
+
+	// A module keeps having run as long as it stays loaded
+
+	for (i = 0; i < modules.count && s_modules.module != NULL; ++i)
+	{
+		for (j = 0; j < s_modules.count; ++j)
+		{
+			old = &s_modules.module[j];
+			if (old->base == modules.module[i].base &&
+				strcmp(old->path, modules.module[i].path) == 0)
+				modules.module[i].ran = old->ran;
+		}
+	}
+
+	module_drop(&s_modules);
+	free(s_modules.module);
+	s_modules = modules;
+	module_bind(&s_modules);
+	return 1;
+}
+
+// Report the results of each module once a run involving shared objects
+// completes, and remember that they ran
+
+static void module_report(self_test_report_pf report)
+{
+	struct module *module;
+	char buffer[512];
+	size_t i;
+
+	for (i = 0; i < s_modules.count; ++i)
+	{
+		module = &s_modules.module[i];
+		if (s_modules.count > 1 && module->tests != 0)
+		{
+			snprintf(buffer, sizeof(buffer), msg_module, module->path,
+				module->tests, module->failed, ms(module->wall_ns));
+			report(buffer, NULL, 0);
+		}
+
+		module->ran = 1;
+		module->tests = 0;
+		module->failed = 0;
+		module->wall_ns = 0;
+	}
+}
+
+// Count the outcome of a test toward the results of its module
+
+void sys_self_test_module_record(const char *name,
+	const struct outcome *outcome)
+{
+	const struct catalog_entry *entry;
+	struct module *module;
+
+	if (s_modules.count <= 1 ||
+		(entry = sys_self_test_catalog_find(name)) == NULL)
+		return;
+
+	module = &s_modules.module[entry->module];
+	__atomic_fetch_add(&module->tests, 1, __ATOMIC_RELAXED);
+	if (outcome->status == STATUS_FAIL)
+		__atomic_fetch_add(&module->failed, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&module->wall_ns, outcome->wall_ns, __ATOMIC_RELAXED);
+}
+
+//
+// Test catalog.
+//
+// The descriptors of the linked tests are indexed on first use, and again
+// when the loaded shared objects change.  An entry holds the name of a
+// test, a hash of the name, the level and slot of its descriptor, its
+// ordinal and its module.  The entries are sorted by name for listing,
+// and an open-addressed table at most half full finds a test by name in
+// about one probe.  Selection, sharding and the dependency graph go through
+// the catalog rather than through the level sections.
+//
+// Tests are selected by the glob patterns of self_test_options.include and
+// self_test_options.exclude, then by shard.  A pattern list holds patterns
+// separated by commas, matched with fnmatch() against the whole name.
+//
+
+struct catalog
+{
+	struct catalog_entry	*entry;		// Sorted by name
+	size_t				count;
+	struct catalog_entry	**ordinal;	// Entry of each test, by ordinal - 1
+	struct catalog_entry	**table;	// By hash of the name; NULL when free
+	size_t				mask;		// Slots in the table minus one
 };
 
+static struct catalog s_catalog;
+static pthread_mutex_t s_catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char SELF_TEST_RO msg_catalog_memory[] =
+	"self-test: warning: out of memory; running every test";
+
+static int compare_catalog_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct catalog_entry *)a)->name,
+		((const struct catalog_entry *)b)->name);
+}
+
+const struct catalog_entry *sys_self_test_catalog_find(const char *name)
+{
+	uint64_t hash = hash_bytes(HASH_INIT, name, strlen(name));
+	size_t i;
+
+	if (s_catalog.table == NULL)
+		return NULL;
+
+	for (i = hash & s_catalog.mask; s_catalog.table[i] != NULL;
+		i = (i + 1) & s_catalog.mask)
+		if (s_catalog.table[i]->hash == hash &&
+			strcmp(s_catalog.table[i]->name, name) == 0)
+			return s_catalog.table[i];
+
+	return NULL;
+}
+
+static void catalog_build(void)
+{
+	const struct self_test_budget **budget;
+	struct catalog_entry *entry, **ordinal, **table;
+	size_t count = 0, size, level, slot, i, j;
+
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		count += sys_self_test_level_count(level);
+	if (count == 0)
+		return;
+
+	for (size = 16; size < 2 * count; size *= 2)
+		;
+
+	entry = (struct catalog_entry *)calloc(count, sizeof(*entry));
+	ordinal = (struct catalog_entry **)calloc(count, sizeof(*ordinal));
+	table = (struct catalog_entry **)calloc(size, sizeof(*table));
+	if (entry == NULL || ordinal == NULL || table == NULL)
+	{
+		free(entry);
+		free(ordinal);
+		free(table);
+		return;
+	}
+
+	for (i = 0, level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		for (slot = 0; slot < sys_self_test_level_count(level); ++slot, ++i)
+		{
+			entry[i].name = sys_self_test_name(
+				sys_self_test_level_test(level, slot));
+			entry[i].hash = hash_bytes(HASH_INIT, entry[i].name,
+				strlen(entry[i].name));
+			entry[i].level = level;
+			entry[i].slot = slot;
+			entry[i].ordinal = i + 1;
+			if (s_modules.owner[level] != NULL)
+				entry[i].module = s_modules.owner[level][slot];
+		}
+	}
+
+	qsort(entry, count, sizeof(*entry), compare_catalog_entry);
+
+	for (i = 0; i < count; ++i)
+	{
+		ordinal[entry[i].ordinal - 1] = &entry[i];
+
+		for (j = entry[i].hash & (size - 1); table[j] != NULL;
+			j = (j + 1) & (size - 1))
+			;
+		table[j] = &entry[i];
+	}
+
+	s_catalog.entry = entry;
+	s_catalog.count = count;
+	s_catalog.ordinal = ordinal;
+	s_catalog.table = table;
+	s_catalog.mask = size - 1;
+
+	if (budget_start == NULL)
+		return;
+
+	for (budget = budget_start; budget < budget_stop; ++budget)
+	{
+		entry = (struct catalog_entry *)sys_self_test_catalog_find(
+			(*budget)->name);
+		if (entry != NULL)
+			entry->budget = (*budget)->bytes;
+	}
+}
+
+static void catalog_free(void)
+{
+	free(s_catalog.entry);
+	free(s_catalog.ordinal);
+	free(s_catalog.table);
+	memset(&s_catalog, 0, sizeof(s_catalog));
+}
+
+// Build the catalog once, indexing the tests of the modules loaded now;
+// return zero if it could not be built.  The report function is optional.
+
+static int catalog_open(self_test_report_pf report)
+{
+	int ok;
+
+	pthread_mutex_lock(&s_catalog_lock);
+
+	if (module_scan(report) || s_catalog.entry == NULL)
+	{
+		catalog_free();
+		catalog_build();
+	}
+
+	ok = s_catalog.entry != NULL || test_total() == 0;
+	pthread_mutex_unlock(&s_catalog_lock);
+	return ok;
+}
+
+const struct catalog_entry *sys_self_test_catalog_at(size_t ordinal)
+{
+	if (s_catalog.ordinal == NULL)
+		return NULL;
+
+	return s_catalog.ordinal[ordinal - 1];
+}
+
+// Whether a name matches one of the patterns of a list
+
+static int catalog_match(const char *patterns, const char *name)
+{
+	char pattern[128];
+	const char *end;
+
+	for (; *patterns != '\0'; patterns = end)
+	{
+		while (*patterns == ',' || *patterns == ' ')
+			++patterns;
+		for (end = patterns; *end != '\0' && *end != ','; ++end)
+			;
+		if (end == patterns)
+			continue;
+
+		snprintf(pattern, sizeof(pattern), "%.*s",
+			(int)(end - patterns), patterns);
+		if (fnmatch(pattern, name, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Whether a test is selected by self_test_options.  The shard of a test
+// only depends on its name, so every process of a sharded run agrees on
+// it, whatever the build or the order of the objects.
+
+int sys_self_test_selected(const struct catalog_entry *entry)
+{
+	const char *include = self_test_options.include;
+	const char *exclude = self_test_options.exclude;
+	unsigned count = self_test_options.shard_count;
+
+	if (s_modules_fresh && s_modules.module[entry->module].ran)
+		return 0;
+	if (include != NULL && *include != '\0' &&
+		!catalog_match(include, entry->name))
+		return 0;
+	if (exclude != NULL && catalog_match(exclude, entry->name))
+		return 0;
+
+	return count <= 1 || entry->hash % count == self_test_options.shard_index;
+}
+
+size_t sys_self_test_catalog(self_test_catalog_pf visit, void *data)
+{
+	const struct catalog_entry *entry;
+	size_t count = 0, i;
+
+	// The names of the tests went with their pages
+
+	if (s_released)
+		return 0;
+
+	catalog_open(NULL);
+
+	for (i = 0; i < s_catalog.count; ++i)
+	{
+		entry = &s_catalog.entry[i];
+		if (sys_self_test_selected(entry))
+		{
+			visit(entry->name, (unsigned)entry->level + 1, data);
+			++count;
+		}
+	}
+
+	return count;
+}
+
+//
+// Performance counters.
+//
+// With SELF_TEST_FLAG_COUNTERS, a group of counters is opened on the
+// calling thread around each test: instructions, cycles, cache misses and
+// branch misses from the hardware, and page faults from the kernel.  The
+// group is read in one go so the counts cover the same span.  Only user
+// space is counted, which unprivileged processes are usually allowed to do.
+//
+// When the group cannot be opened, as in many containers and virtual
+// machines, the page faults and context switches of the thread are taken
+// from getrusage() instead and the hardware counts are left out.
+//
+
+#define COUNTER_EVENTS 5
+
+struct counter_group
+{
+	int					fd[COUNTER_EVENTS];	// Leader first; -1 without
+	struct rusage		usage;		// Thread usage at the start
+};
+
+static const struct
+{
+	uint32_t			type;
+	uint64_t			config;
+} counter_event[COUNTER_EVENTS] =
+{
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+
+static const char SELF_TEST_RO msg_counters[] =
+	"self-test: info: counters %s: instructions %llu, cycles %llu, "
+	"cache misses %llu, branch misses %llu, page faults %llu";
+static const char SELF_TEST_RO msg_counters_usage[] =
+	"self-test: info: counters %s: page faults %llu, context switches %llu "
+	"(hardware counters unavailable)";
+
+static void counters_begin(struct counter_group *group)
+{
+	struct perf_event_attr attr;
+	int i, j;
+
+	for (i = 0; i < COUNTER_EVENTS; ++i)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counter_event[i].type;
+		attr.config = counter_event[i].config;
+		attr.disabled = i == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		group->fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1,
+			i == 0 ? -1 : group->fd[0], PERF_FLAG_FD_CLOEXEC);
+
+		if (group->fd[i] < 0)
+		{
+			// All or nothing, so that the counts are comparable
+
+			for (j = 0; j < i; ++j)
+				close(group->fd[j]);
+			group->fd[0] = -1;
+			break;
+		}
+	}
+
+	if (group->fd[0] >= 0)
+	{
+		ioctl(group->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(group->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	else
+	{
+		getrusage(RUSAGE_THREAD, &group->usage);
+	}
+}
+
+static void counters_end(struct counter_group *group,
+	struct counters *counters)
+{
+	struct { uint64_t nr; uint64_t value[COUNTER_EVENTS]; } values;
+	struct rusage usage;
+	int i;
+
+	memset(counters, 0, sizeof(*counters));
+
+	if (group->fd[0] >= 0)
+	{
+		ioctl(group->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+		if (read(group->fd[0], &values, sizeof(values)) ==
+			(ssize_t)sizeof(values) && values.nr == COUNTER_EVENTS)
+		{
+			counters->hardware = 1;
+			counters->instructions = values.value[0];
+			counters->cycles = values.value[1];
+			counters->cache_misses = values.value[2];
+			counters->branch_misses = values.value[3];
+			counters->page_faults = values.value[4];
+		}
+
+		for (i = 0; i < COUNTER_EVENTS; ++i)
+			close(group->fd[i]);
+	}
+	else if (getrusage(RUSAGE_THREAD, &usage) == 0)
+	{
+		counters->page_faults = (uint64_t)(
+			(usage.ru_minflt - group->usage.ru_minflt) +
+			(usage.ru_majflt - group->usage.ru_majflt));
+		counters->switches = (uint64_t)(
+			(usage.ru_nvcsw - group->usage.ru_nvcsw) +
+			(usage.ru_nivcsw - group->usage.ru_nivcsw));
+	}
+}
+
+static void counters_report(self_test_report_pf report,
+	const char *name, const struct counters *counters)
+{
+	char buffer[256];
+
+	if (counters->hardware)
+		snprintf(buffer, sizeof(buffer), msg_counters, name,
+			(unsigned long long)counters->instructions,
+			(unsigned long long)counters->cycles,
+			(unsigned long long)counters->cache_misses,
+			(unsigned long long)counters->branch_misses,
+			(unsigned long long)counters->page_faults);
+	else
+		snprintf(buffer, sizeof(buffer), msg_counters_usage, name,
+			(unsigned long long)counters->page_faults,
+			(unsigned long long)counters->switches);
+
+	report(buffer, NULL, 0);
+}
+
+//
+// Heap accounting.
+//
+// When self_test_options.heap is set, the heap statistics are taken
+// before and after each test: the allocations and bytes the test made,
+// the peak of the live bytes over those it started with, and the
+// allocations it left behind.  A test that leaves allocations behind, or
+// peaks over the budget declared by SELF_TEST_MEMORY_BUDGET(), fails.
+// With self_test_options.blocks, each allocation left behind is reported
+// at the site that made it; without it, only their number is known.
+//
+// A fixture set up while a test runs belongs to its level rather than to
+// the test, so the allocations of its setup are not counted as leaks.
+// They still count toward the peak of the test.
+//
+// The statistics of the whole heap only tell about a test while no other
+// test runs in the process.  A pool of threads takes those of each thread
+// from self_test_options.thread_heap and thread_blocks instead, and runs
+// the tests one at a time when they are not set.  Isolated tests keep the
+// statistics of the whole heap, since each worker process runs one test
+// at a time.
+//
+
+#define SELF_TEST_FIXTURE_RANGES 8
+
+struct heap_check
+{
+	struct self_test_heap	start;
+	self_test_heap_pf		heap;		// Statistics taken; NULL when off
+	self_test_blocks_pf		blocks;
+};
+
+struct heap_walk
+{
+	self_test_report_pf	report;
+	size_t				leaks;
+};
+
+// Allocations made by the setup of the fixtures asked for by the running
+// test, numbered from first to last excluded
+
+struct heap_range
+{
+	size_t				first;
+	size_t				last;
+	size_t				allocations;	// Number of allocations in the range
+};
+
+static __thread struct heap_range s_fixture_range[SELF_TEST_FIXTURE_RANGES];
+static __thread size_t s_fixture_ranges = 0;
+static __thread self_test_heap_pf s_fixture_heap = NULL;
+
+static const char SELF_TEST_RO msg_heap[] =
+	"self-test: info: heap %s: %zu allocations, %zu bytes, peak %zu bytes";
+static const char SELF_TEST_RO msg_heap_block[] =
+	"error: self-test leaked %zu bytes allocated here";
+static const char SELF_TEST_RO msg_heap_leaks[] =
+	"self-test: error: test %s leaked %zu allocations";
+static const char SELF_TEST_RO msg_heap_budget[] =
+	"self-test: error: test %s peaked at %zu bytes, over its budget of %zu";
+static const char SELF_TEST_RO msg_heap_threads[] =
+	"self-test: info: tests run one at a time to check the heap; set "
+	"self_test_options.thread_heap to run them on several threads";
+
+static void heap_leak(const char *file, int line, size_t size,
+	size_t serial, void *data)
+{
+	struct heap_walk *walk = (struct heap_walk *)data;
+	char buffer[128];
+	size_t i;
+
+	for (i = 0; i < s_fixture_ranges; ++i)
+		if (serial >= s_fixture_range[i].first &&
+			serial < s_fixture_range[i].last)
+			return;
+
+	snprintf(buffer, sizeof(buffer), msg_heap_block, size);
+	walk->report(buffer, file, line > 0 ? (size_t)line : 1);
+	++walk->leaks;
+}
+
+// Take the statistics at the start of a test with the given functions;
+// the checks are off when heap is NULL
+
+static void heap_begin(struct heap_check *check, self_test_heap_pf heap,
+	self_test_blocks_pf blocks)
+{
+	s_fixture_ranges = 0;
+	s_fixture_heap = heap;
+	check->heap = heap;
+	check->blocks = blocks;
+	if (heap != NULL)
+		heap(&check->start, 1);
+}
+
+// Measure the test that just returned against the statistics taken when
+// it started and report what is wrong; return zero when it leaked or
+// went over its budget
+
+static int heap_end(const struct heap_check *check, const char *name,
+	size_t budget, self_test_report_pf report, struct heap_usage *usage)
+{
+	struct heap_walk walk = { report, 0 };
+	const struct self_test_heap *start = &check->start;
+	struct self_test_heap end;
+	char buffer[256];
+	size_t fixtures = 0, i;
+	int passed = 1;
+
+	if (check->heap == NULL)
+		return 1;
+
+	check->heap(&end, 0);
+
+	usage->allocations = end.allocations - start->allocations;
+	usage->bytes = end.bytes - start->bytes;
+	usage->peak_bytes = end.peak_bytes > start->live_bytes ?
+		end.peak_bytes - start->live_bytes : 0;
+
+	if (check->blocks != NULL)
+	{
+		check->blocks(start->serial, heap_leak, &walk);
+		usage->leaks = walk.leaks;
+	}
+	else
+	{
+		for (i = 0; i < s_fixture_ranges; ++i)
+			fixtures += s_fixture_range[i].allocations;
+		usage->leaks = end.blocks > start->blocks + fixtures ?
+			end.blocks - start->blocks - fixtures : 0;
+	}
+
+	if (usage->leaks != 0)
+	{
+		snprintf(buffer, sizeof(buffer), msg_heap_leaks, name, usage->leaks);
+		report(buffer, NULL, 0);
+		passed = 0;
+	}
+
+	if (budget != 0 && usage->peak_bytes > budget)
+	{
+		snprintf(buffer, sizeof(buffer), msg_heap_budget, name,
+			usage->peak_bytes, budget);
+		report(buffer, NULL, 0);
+		passed = 0;
+	}
+
+	return passed;
+}
+
+//
+// Fixtures.
+//
+// SELF_TEST_FIXTURE() names the setup and teardown functions of a state
+// shared by the tests of a level.  The state is set up the first time a
+// test asks for it with SELF_TEST_FIXTURE_STATE(), so a fixture that no
+// selected test uses costs nothing, and the other tests of the level get
+// the same state.  The fixtures are torn down once their level has run;
+// a fixture asked for by a test of a higher level is set up again and
+// torn down with that level.  Tests run as a dependency graph interleave
+// the levels, so their fixtures are kept until the end of the run.
+//
+// An isolated test tears down the fixtures it used in its worker as soon
+// as it completes, so that no state outlives the test.
+//
+// A setup that fails is reported, and the tests that ask for the fixture
+// get NULL until it would have been torn down.  A teardown that fails
+// fails the run.
+//
+
+struct fixture
+{
+	void				*state;
+	int					ready;		// Set up and not torn down yet
+	int					failed;		// Setup failed
+};
+
+static struct fixture *s_fixture = NULL;	// By position in the section
+static size_t s_fixtures = 0;				// Slots in s_fixture
+static pthread_mutex_t s_fixture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const level_name[SELF_TEST_LEVEL_COUNT] =
+{
+	SELF_TEST_LEVEL_1, SELF_TEST_LEVEL_2, SELF_TEST_LEVEL_3,
+	SELF_TEST_LEVEL_4, SELF_TEST_LEVEL_5, SELF_TEST_LEVEL_6,
+	SELF_TEST_LEVEL_7, SELF_TEST_LEVEL_8, SELF_TEST_LEVEL_9,
+	SELF_TEST_LEVEL_10
+};
+
+static const char SELF_TEST_RO msg_fixture_setup[] =
+	"self-test: error: fixture %s failed to set up";
+static const char SELF_TEST_RO msg_fixture_teardown[] =
+	"self-test: error: fixture %s failed to tear down";
+static const char SELF_TEST_RO msg_fixture_memory[] =
+	"self-test: error: out of memory for fixture %s";
+
+static size_t fixture_count(void)
+{
+	if (fixture_start == NULL)
+		return 0;
+
+	return fixture_stop - fixture_start;
+}
+
+static size_t fixture_level(const struct self_test_fixture *fixture)
+{
+	size_t level;
+
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		if (strcmp(fixture->level, level_name[level]) == 0)
+			return level;
+
+	return SELF_TEST_LEVEL_COUNT - 1;
+}
+
+void *sys_self_test_fixture(const struct self_test_fixture *fixture,
+	self_test_report_pf report)
+{
+	struct fixture *slot = NULL;
+	struct self_test_heap heap = { 0 };
+	struct heap_range *range;
+	char buffer[256];
+	size_t count = fixture_count(), i;
+	void *state = NULL;
+
+	pthread_mutex_lock(&s_fixture_lock);
+
+	// The fixtures are all torn down between runs, when shared objects
+	// may have changed them
+
+	if (s_fixtures != count)
+	{
+		free(s_fixture);
+		s_fixture = (struct fixture *)calloc(count, sizeof(*s_fixture));
+		s_fixtures = s_fixture != NULL ? count : 0;
+	}
+
+	for (i = 0; i < s_fixtures; ++i)
+		if (fixture_start[i] == fixture)
+			slot = &s_fixture[i];
+
+	if (slot == NULL)
+	{
+		snprintf(buffer, sizeof(buffer), msg_fixture_memory, fixture->name);
+		report(buffer, NULL, 0);
+	}
+	else if (!slot->ready && !slot->failed)
+	{
+		if (s_fixture_heap != NULL)
+			s_fixture_heap(&heap, 0);
+
+		slot->ready = fixture->setup(report, &slot->state) != 0;
+		slot->failed = !slot->ready;
+
+		if (s_fixture_heap != NULL &&
+			s_fixture_ranges < SELF_TEST_FIXTURE_RANGES)
+		{
+			range = &s_fixture_range[s_fixture_ranges++];
+			range->first = heap.serial;
+			range->allocations = heap.allocations;
+			s_fixture_heap(&heap, 0);
+			range->last = heap.serial;
+			range->allocations = heap.allocations - range->allocations;
+		}
+
+		if (slot->failed)
+		{
+			snprintf(buffer, sizeof(buffer), msg_fixture_setup, fixture->name);
+			report(buffer, NULL, 0);
+		}
+	}
+
+	if (slot != NULL && slot->ready)
+		state = slot->state;
+
+	pthread_mutex_unlock(&s_fixture_lock);
+	return state;
+}
+
+// Tear down the fixtures of the levels up to the given one; return zero if
+// a teardown failed
+
+static int fixture_leave(self_test_report_pf report, size_t level)
+{
+	const struct self_test_fixture *fixture;
+	struct fixture *slot;
+	char buffer[256];
+	size_t count = fixture_count(), i;
+	int rc = 1;
+
+	pthread_mutex_lock(&s_fixture_lock);
+
+	// The slots are only sized for the fixtures once one is set up; until
+	// then the sections may hold fewer fixtures than there are slots
+
+	for (i = 0; i < s_fixtures && i < count; ++i)
+	{
+		fixture = fixture_start[i];
+		slot = &s_fixture[i];
+
+		if ((!slot->ready && !slot->failed) || fixture_level(fixture) > level)
+			continue;
+
+		if (slot->ready && !fixture->teardown(report, slot->state))
+		{
+			snprintf(buffer, sizeof(buffer), msg_fixture_teardown,
+				fixture->name);
+			report(buffer, NULL, 0);
+			rc = 0;
+		}
+
+		slot->state = NULL;
+		slot->ready = 0;
+		slot->failed = 0;
+	}
+
+	pthread_mutex_unlock(&s_fixture_lock);
+	return rc;
+}
+
+//
+// Test runner.
+//
+// Each level is a dependency layer: every test of a level may run at the
+// same time as the other tests of that level, but no test of the next
+// level starts until the whole level has finished.  A pool of threads
+// claims tests from the current level with an atomic counter and then
+// meets at a barrier before moving on.  The calling thread is a member of
+// the pool, so a single-threaded pool is simply the serial runner.
+//
+// When SELF_TEST_FLAG_STOP_ON_FAILURE is set, the first failure raises the
+// stop flag; workers stop claiming tests, pass the remaining barriers
+// without doing any work and the run returns as soon as the tests already
+// in flight have finished.
+//
+// When SELF_TEST_FLAG_TIMING is set, the wall time and the CPU time of the
+// calling thread are sampled around each test function and kept in a
+// result table.  The table is used for the level totals and the list of
+// the slowest tests reported once the run is over.
+//
+
+#define SELF_TEST_SLOWEST_COUNT 10
+
+static const char SELF_TEST_RO msg_time[] =
+	"self-test: info: time %s: wall %.3f ms, cpu %.3f ms";
+static const char SELF_TEST_RO msg_time_level[] =
+	"self-test: info: time level %zu: %zu tests, wall %.3f ms, cpu %.3f ms";
+static const char SELF_TEST_RO msg_time_total[] =
+	"self-test: info: time total: %zu tests, wall %.3f ms, cpu %.3f ms";
+static const char SELF_TEST_RO msg_time_slowest[] =
+	"self-test: info: slowest tests:";
+static const char SELF_TEST_RO msg_time_rank[] =
+	"self-test: info: %3zu. %s: wall %.3f ms, cpu %.3f ms";
+
+// In the process running the levels deferred by a time budget: the first
+// of those levels, the pipe on which failed tests are named and, when the
+// tests ran as a graph, the tests that finished before the deferral
+
+static size_t s_first_level = 0;
+static int s_defer_fd = -1;
+static unsigned char *s_defer_done;		// By ordinal - 1; NULL for none
+static size_t s_defer_tests;
+
+// Name a failed test to the parent of a deferred run; names are short
+// enough for the write to be atomic
+
+static void defer_notify(const struct self_test *test)
+{
+	const char *name = sys_self_test_name(test);
+	size_t length = strlen(name) + 1;
+
+	if (length <= PIPE_BUF)
+		write(s_defer_fd, name, length);
+}
+
+// The report function handed to a test when its outcome is written out;
+// it keeps the location of the last message reported with a file
+
+struct capture
+{
+	self_test_report_pf		report;		// Report function of the run
+	const char				*file;
+	size_t					line;
+};
+
+static __thread struct capture *s_capture = NULL;
+
+static void capture_report(const char *msg, const char *file, size_t line)
+{
+	struct capture *capture = s_capture;
+
+	if (file != NULL)
+	{
+		capture->file = file;
+		capture->line = line;
+	}
+
+	capture->report(msg, file, line);
+}
+
+static struct result *pool_claim(struct pool *pool)
+{
+	size_t slot;
+
+	slot = __atomic_fetch_add(&pool->test_count, 1, __ATOMIC_RELAXED);
+	if (pool->result == NULL)
+		return NULL;
+
+	return &pool->result[slot];
+}
+
+// Record the outcome of a test; the times of the result have already been
+// filled in when there is a result.
+
+static void pool_complete(struct pool *pool, struct result *result,
+	size_t level, const struct self_test *test, const struct outcome *outcome)
+{
+	int passed = outcome->status != STATUS_FAIL;
+	const char *name = sys_self_test_name(test);
+	char buffer[256];
+
+	if (outcome->counters != NULL)
+	{
+		if (result != NULL)
+			result->counters = *outcome->counters;
+		counters_report(pool->report, name, outcome->counters);
+	}
+
+	if (outcome->heap != NULL && (pool->flags & SELF_TEST_FLAG_TIMING))
+	{
+		snprintf(buffer, sizeof(buffer), msg_heap, name,
+			outcome->heap->allocations, outcome->heap->bytes,
+			outcome->heap->peak_bytes);
+		pool->report(buffer, NULL, 0);
+	}
+
+	if (result != NULL)
+	{
+		result->test = test;
+		result->level = level;
+		result->passed = passed;
+
+		snprintf(buffer, sizeof(buffer), msg_time, name,
+			ms(result->wall_ns), ms(result->cpu_ns));
+		pool->report(buffer, NULL, 0);
+	}
+
+	sys_self_test_output_test(name, level, outcome);
+	sys_self_test_module_record(name, outcome);
+
+	if (!passed)
+	{
+		if (s_defer_fd >= 0)
+			defer_notify(test);
+
+		__atomic_store_n(&pool->rc, 0, __ATOMIC_RELAXED);
+		if (pool->flags & SELF_TEST_FLAG_STOP_ON_FAILURE)
+			__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	}
+}
+
+int sys_self_test_pool_run(struct pool *pool, size_t level,
+	size_t ordinal, const struct self_test *test)
+{
+	int counting = (pool->flags & SELF_TEST_FLAG_COUNTERS) != 0;
+	struct capture capture = { pool->report, NULL, 0 };
+	self_test_report_pf report = pool->report;
+	struct outcome outcome = { 0 };
+	const struct catalog_entry *entry = sys_self_test_catalog_at(ordinal);
+	struct counter_group group;
+	struct counters counters;
+	struct heap_check check;
+	struct heap_usage usage;
+	struct result *result;
+	uint64_t wall, cpu = 0;
+	int passed;
+
+	result = pool_claim(pool);
+	sys_self_test_begin(ordinal);
+
+	if (test->name != NULL)
+		pool->report(test->name, NULL, 0);
+
+	if (sys_self_test_output_active())
+	{
+		s_capture = &capture;
+		report = capture_report;
+	}
+
+	heap_begin(&check, pool->heap, pool->blocks);
+	wall = clock_ns(CLOCK_MONOTONIC);
+	if (result != NULL)
+		cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (counting)
+		counters_begin(&group);
+
+	passed = test->func(report);
+
+	if (counting)
+		counters_end(&group, &counters);
+	if (result != NULL)
+	{
+		result->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		result->wall_ns = clock_ns(CLOCK_MONOTONIC) - wall;
+		result->start_ns = wall;
+		outcome.wall_ns = result->wall_ns;
+	}
+	else
+	{
+		outcome.wall_ns = clock_ns(CLOCK_MONOTONIC) - wall;
+	}
+
+	if (!heap_end(&check, sys_self_test_name(test),
+		entry != NULL ? entry->budget : 0, report, &usage))
+		passed = 0;
+
+	outcome.status = passed ? STATUS_PASS : STATUS_FAIL;
+	outcome.heap = check.heap != NULL ? &usage : NULL;
+	outcome.counters = counting ? &counters : NULL;
+	if (!passed)
+	{
+		outcome.file = capture.file;
+		outcome.line = capture.line;
+	}
+
+	s_capture = NULL;
+
+	pool_complete(pool, result, level, test, &outcome);
+	sys_self_test_cache_record(ordinal, passed);
+	sys_self_test_end(ordinal);
+
+	return passed;
+}
+
+static const char SELF_TEST_RO msg_cached[] =
+	"self-test: info: test %s (cached)";
+
+// Leave out a test that is not selected, or report a test that passed on
+// an earlier run of this program in place of running it; return zero when
+// the test has to run
+
+int sys_self_test_pool_skip(struct pool *pool, size_t level, size_t slot)
+{
+	const char *name = sys_self_test_name(sys_self_test_level_test(level,
+		slot));
+	size_t ordinal = sys_self_test_ordinal(level, slot);
+	const struct catalog_entry *entry = sys_self_test_catalog_at(ordinal);
+	struct outcome outcome = { .status = STATUS_CACHED };
+	char buffer[256];
+
+	if (entry != NULL && !sys_self_test_selected(entry))
+	{
+		__atomic_fetch_add(&pool->skipped, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	if ((pool->flags & SELF_TEST_FLAG_FORCE) ||
+		!sys_self_test_cache_passed(ordinal))
+		return 0;
+
+	sys_self_test_begin(ordinal);
+	snprintf(buffer, sizeof(buffer), msg_cached, name);
+	pool->report(buffer, NULL, 0);
+	sys_self_test_output_test(name, level, &outcome);
+	sys_self_test_module_record(name, &outcome);
+	sys_self_test_end(ordinal);
+
+	__atomic_fetch_add(&pool->cached, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void pool_run_level(struct pool *pool, size_t level)
+{
+	size_t slots, slot;
+
+	slots = sys_self_test_level_count(level);
+
+	while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+	{
+		slot = __atomic_fetch_add(&pool->next[level], 1, __ATOMIC_RELAXED);
+		if (slot >= slots)
+			break;
+
+		if (!sys_self_test_pool_skip(pool, level, slot))
+			sys_self_test_pool_run(pool, level,
+				sys_self_test_ordinal(level, slot),
+				sys_self_test_level_test(level, slot));
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool *pool = (struct pool *)arg;
+	size_t level;
+	int serial;
+
+	pthread_mutex_lock(&pool->gate);
+	pthread_mutex_unlock(&pool->gate);
+
+	if (pool->abort)
+		return NULL;
+
+	if (pool->dag != NULL)
+	{
+		sys_self_test_dag_run(pool);
+		return NULL;
+	}
+
+	for (level = pool->first_level; level < pool->last_level; ++level)
+	{
+		pool_run_level(pool, level);
+
+		serial = pool->threads == 1 || pthread_barrier_wait(&pool->barrier)
+			== PTHREAD_BARRIER_SERIAL_THREAD;
+
+		// One thread tears down the fixtures of the level and, once the
+		// time budget is spent, leaves the remaining levels to the
+		// deferred run.  The others wait for it.
+
+		if (serial && !fixture_leave(pool->report, level))
+			__atomic_store_n(&pool->rc, 0, __ATOMIC_RELAXED);
+		if (serial && pool->deadline_ns != 0 &&
+			clock_ns(CLOCK_MONOTONIC) >= pool->deadline_ns)
+			pool->deferred = level + 1;
+
+		if (pool->threads > 1 &&
+			(pool->deadline_ns != 0 || fixture_count() != 0))
+			pthread_barrier_wait(&pool->barrier);
+		if (pool->deferred != 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static size_t pool_size(const struct pool *pool)
+{
+	size_t level, count, widest;
+	long cpus;
+
+	// No point in starting more threads than the widest level can use,
+	// or than there are tests when the levels do not hold the tests back
+
+	widest = 0;
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		count = sys_self_test_level_count(level);
+		if (pool->dag != NULL)
+			widest += count;
+		else if (count > widest)
+			widest = count;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+
+	return (widest < (size_t)cpus) ? widest : (size_t)cpus;
+}
+
+static int pool_start(struct pool *pool, pthread_t *thread, size_t threads)
+{
+	// Hold the gate while the pool is created so the barrier can be sized
+	// for the threads that actually started.  The calling thread is
+	// worker zero.
+
+	pthread_mutex_lock(&pool->gate);
+
+	for (pool->threads = 1; pool->threads < threads; ++pool->threads)
+		if (pthread_create(&thread[pool->threads], NULL, pool_worker, pool))
+			break;
+
+	if (pthread_barrier_init(&pool->barrier, NULL, (unsigned)pool->threads))
+		pool->abort = 1;
+
+	pthread_mutex_unlock(&pool->gate);
+
+	return !pool->abort;
+}
+
+static void pool_join(struct pool *pool, pthread_t *thread)
+{
+	size_t i;
+
+	for (i = 1; i < pool->threads; ++i)
+		pthread_join(thread[i], NULL);
+
+	if (!pool->abort)
+		pthread_barrier_destroy(&pool->barrier);
+}
+
+static int compare_slowest(const void *a, const void *b)
+{
+	const struct result *ra = (const struct result *)a;
+	const struct result *rb = (const struct result *)b;
+
+	if (ra->wall_ns != rb->wall_ns)
+		return (ra->wall_ns < rb->wall_ns) ? 1 : -1;
+	return strcmp(sys_self_test_name(ra->test), sys_self_test_name(rb->test));
+}
+
+//
+// Report the startup cost of the run.  The wall time of a level is the
+// span from its first test start to its last test end, which is the cost
+// of the level to startup whether its tests ran serially or in parallel.
+//
+static void report_timing(struct pool *pool)
+{
+	struct result *result;
+	uint64_t first, last, cpu, total_first, total_last, total_cpu;
+	size_t level, count, i;
+	char buffer[256];
+
+	total_first = UINT64_MAX;
+	total_last = 0;
+	total_cpu = 0;
+
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		first = UINT64_MAX;
+		last = 0;
+		cpu = 0;
+		count = 0;
+
+		for (i = 0; i < pool->test_count; ++i)
+		{
+			result = &pool->result[i];
+			if (result->level != level)
+				continue;
+
+			++count;
+			cpu += result->cpu_ns;
+			if (result->start_ns < first)
+				first = result->start_ns;
+			if (result->start_ns + result->wall_ns > last)
+				last = result->start_ns + result->wall_ns;
+		}
+
+		if (count == 0)
+			continue;
+
+		snprintf(buffer, sizeof(buffer), msg_time_level, level + 1, count,
+			ms(last - first), ms(cpu));
+		pool->report(buffer, NULL, 0);
+
+		total_cpu += cpu;
+		if (first < total_first)
+			total_first = first;
+		if (last > total_last)
+			total_last = last;
+	}
+
+	if (pool->test_count == 0)
+		return;
+
+	snprintf(buffer, sizeof(buffer), msg_time_total, pool->test_count,
+		ms(total_last - total_first), ms(total_cpu));
+	pool->report(buffer, NULL, 0);
+
+	qsort(pool->result, pool->test_count, sizeof(*pool->result),
+		compare_slowest);
+
+	pool->report(msg_time_slowest, NULL, 0);
+
+	for (i = 0; i < pool->test_count && i < SELF_TEST_SLOWEST_COUNT; ++i)
+	{
+		result = &pool->result[i];
+		snprintf(buffer, sizeof(buffer), msg_time_rank, i + 1,
+			sys_self_test_name(result->test), ms(result->wall_ns),
+			ms(result->cpu_ns));
+		pool->report(buffer, NULL, 0);
+	}
+}
+
+//
+// Isolated runner.
+//
+// With SELF_TEST_FLAG_ISOLATE, each test runs in a worker process so that
+// a test that crashes or hangs only fails itself.  The workers are forked
+// once and reused for many tests to avoid paying a fork for every small
+// test; a worker is only replaced when it dies or is killed.  The pool has
+// a single worker unless SELF_TEST_FLAG_PARALLEL is also set, in which case
+// it is sized like the thread pool.  Levels are still run one after the
+// other.
+//
+// The parent talks to each worker over a sequenced-packet socket pair, a
+// bidirectional pipe that preserves message boundaries: the parent sends
+// the level and slot of the next test, and the worker sends back a record
+// for each message its test reports followed by a record holding the
+// verdict and the times of the test.  The parent is the only process that
+// writes the report: the messages of a test are held until it completes
+// and are then reported together, so concurrent tests never interleave
+// their output and the workers never contend for standard error.
+//
+// A test that runs longer than self_test_options.timeout_ms is killed and
+// fails, as does a test whose worker terminates.
+//
+
+#define SELF_TEST_TIMEOUT_MS 10000u		// Default time limit of a test
+
+enum { RECORD_MESSAGE, RECORD_DONE };
+
+struct record
+{
+	uint32_t		kind;		// RECORD_MESSAGE or RECORD_DONE
+	uint32_t		passed;		// Verdict of the test when done
+	uint64_t		line;		// Line of the message; 0 without a file
+	uint64_t		start_ns;	// Times of the test when done
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;
+	uint64_t		allocations;	// Heap figures when done
+	uint64_t		bytes;
+	uint64_t		peak_bytes;
+	uint64_t		leaks;
+	struct counters	counters;	// With SELF_TEST_FLAG_COUNTERS when done
+	char			file[96];
+	char			msg[288];
+};
+
+struct command
+{
+	uint32_t		level;
+	uint32_t		slot;
+	uint32_t		flags;		// Flags of the run
+};
+
+struct worker
+{
+	pid_t					pid;		// Zero when there is no process
+	int						fd;			// Parent end of the socket pair
+	const struct self_test	*test;		// Test in flight; NULL when idle
+	size_t					level;
+	size_t					ordinal;	// Ordinal of the test in flight
+	uint64_t				deadline_ns;
+	struct record			*record;	// Messages of the test in flight
+	size_t					records;
+	size_t					capacity;
+};
+
+static const char SELF_TEST_RO msg_isolate_timeout[] =
+	"self-test: error: test %s timed out after %u ms";
+static const char SELF_TEST_RO msg_isolate_signal[] =
+	"self-test: error: test %s terminated by signal %d";
+static const char SELF_TEST_RO msg_isolate_exit[] =
+	"self-test: error: test %s terminated unexpectedly";
+static const char SELF_TEST_RO msg_isolate_fork[] =
+	"self-test: error: cannot start self test worker";
+
+// Socket of the worker process back to the parent
+
+static int s_worker_fd = -1;
+
+static void copy_string(char *buffer, size_t size, const char *string)
+{
+	size_t length = strlen(string);
+
+	if (length >= size)
+		length = size - 1;
+	memcpy(buffer, string, length);
+	buffer[length] = '\0';
+}
+
+static void worker_report(const char *msg, const char *file, size_t line)
+{
+	struct record record = { .kind = RECORD_MESSAGE };
+
+	copy_string(record.msg, sizeof(record.msg), msg);
+	if (file != NULL)
+	{
+		copy_string(record.file, sizeof(record.file), file);
+		record.line = line != 0 ? line : 1;
+	}
+
+	send(s_worker_fd, &record, sizeof(record), MSG_NOSIGNAL);
+}
+
+static void worker_main(int fd)
+{
+	struct record record = { .kind = RECORD_DONE };
+	struct command command;
+	const struct catalog_entry *entry;
+	const struct self_test *test;
+	struct counter_group group;
+	struct heap_check check;
+	struct heap_usage usage = { 0 };
+	uint64_t wall, cpu;
+
+	s_worker_fd = fd;
+
+	while (recv(fd, &command, sizeof(command), 0) == sizeof(command))
+	{
+		if (command.level >= SELF_TEST_LEVEL_COUNT ||
+			command.slot >= sys_self_test_level_count(command.level))
+			break;
+
+		test = sys_self_test_level_test(command.level, command.slot);
+		entry = sys_self_test_catalog_at(sys_self_test_ordinal(command.level,
+			command.slot));
+
+		heap_begin(&check, self_test_options.heap, self_test_options.blocks);
+		wall = clock_ns(CLOCK_MONOTONIC);
+		cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		if (command.flags & SELF_TEST_FLAG_COUNTERS)
+			counters_begin(&group);
+
+		record.passed = test->func(worker_report) ? 1 : 0;
+
+		if (command.flags & SELF_TEST_FLAG_COUNTERS)
+			counters_end(&group, &record.counters);
+		record.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		record.wall_ns = clock_ns(CLOCK_MONOTONIC) - wall;
+		record.start_ns = wall;
+		if (!heap_end(&check, sys_self_test_name(test),
+			entry != NULL ? entry->budget : 0, worker_report, &usage))
+			record.passed = 0;
+		record.allocations = usage.allocations;
+		record.bytes = usage.bytes;
+		record.peak_bytes = usage.peak_bytes;
+		record.leaks = usage.leaks;
+
+		if (!fixture_leave(worker_report, SIZE_MAX))
+			record.passed = 0;
+
+		if (send(fd, &record, sizeof(record), MSG_NOSIGNAL) < 0)
+			break;
+	}
+
+	_exit(0);
+}
+
+static int worker_start(struct worker *worker,
+	struct worker *workers, size_t count)
+{
+	int fd[2];
+	size_t i;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd) != 0)
+		return 0;
+
+	sys_self_test_flush();
+	fflush(NULL);
+	pid = fork();
+
+	if (pid == 0)
+	{
+		// Close the parent's ends so that each worker only keeps its own
+		// socket and sees the end of file when the parent goes away
+
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		close(fd[0]);
+		for (i = 0; i < count; ++i)
+			if (workers[i].pid > 0)
+				close(workers[i].fd);
+		worker_main(fd[1]);
+	}
+
+	close(fd[1]);
+
+	if (pid < 0)
+	{
+		close(fd[0]);
+		return 0;
+	}
+
+	worker->pid = pid;
+	worker->fd = fd[0];
+	worker->test = NULL;
+	return 1;
+}
+
+static void worker_stop(struct worker *worker, int kill_it)
+{
+	int status;
+
+	if (worker->pid <= 0)
+		return;
+
+	if (kill_it)
+		kill(worker->pid, SIGKILL);
+
+	close(worker->fd);
+	while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	worker->pid = 0;
+	worker->fd = -1;
+}
+
+static void worker_keep(struct worker *worker, const struct record *record)
+{
+	struct record *grown;
+	size_t capacity;
+
+	if (worker->records == worker->capacity)
+	{
+		capacity = worker->capacity ? worker->capacity * 2 : 8;
+		grown = (struct record *)realloc(worker->record,
+			capacity * sizeof(*grown));
+		if (grown == NULL)
+			return;
+		worker->record = grown;
+		worker->capacity = capacity;
+	}
+
+	worker->record[worker->records++] = *record;
+}
+
+// Report the test in flight on a worker in one block: its name, the
+// messages it reported and the reason of its failure if it did not
+// complete.
+
+static void worker_finish(struct pool *pool, struct worker *worker,
+	const struct record *done, const char *failure)
+{
+	struct outcome outcome = { .status = STATUS_FAIL };
+	struct heap_usage usage;
+	struct result *result;
+	size_t i;
+
+	result = pool_claim(pool);
+	sys_self_test_begin(worker->ordinal);
+
+	if (worker->test->name != NULL)
+		pool->report(worker->test->name, NULL, 0);
+
+	for (i = 0; i < worker->records; ++i)
+	{
+		if (worker->record[i].line != 0)
+			pool->report(worker->record[i].msg, worker->record[i].file,
+				(size_t)worker->record[i].line);
+		else
+			pool->report(worker->record[i].msg, NULL, 0);
+	}
+
+	if (failure != NULL)
+		pool->report(failure, NULL, 0);
+
+	if (result != NULL)
+	{
+		result->start_ns = done->start_ns;
+		result->wall_ns = done->wall_ns;
+		result->cpu_ns = done->cpu_ns;
+	}
+
+	if (failure == NULL && done->passed)
+		outcome.status = STATUS_PASS;
+	outcome.wall_ns = done->wall_ns;
+	if (self_test_options.heap != NULL)
+	{
+		usage.allocations = (size_t)done->allocations;
+		usage.bytes = (size_t)done->bytes;
+		usage.peak_bytes = (size_t)done->peak_bytes;
+		usage.leaks = (size_t)done->leaks;
+		outcome.heap = &usage;
+	}
+	if (failure == NULL && (pool->flags & SELF_TEST_FLAG_COUNTERS))
+		outcome.counters = &done->counters;
+
+	for (i = worker->records; outcome.status == STATUS_FAIL && i > 0; --i)
+	{
+		if (worker->record[i - 1].line != 0)
+		{
+			outcome.file = worker->record[i - 1].file;
+			outcome.line = (size_t)worker->record[i - 1].line;
+			break;
+		}
+	}
+
+	pool_complete(pool, result, worker->level, worker->test, &outcome);
+	sys_self_test_cache_record(worker->ordinal, outcome.status == STATUS_PASS);
+	if (pool->dag != NULL)
+		sys_self_test_dag_finish(pool, worker->ordinal - 1,
+			outcome.status == STATUS_PASS);
+	sys_self_test_end(worker->ordinal);
+
+	worker->test = NULL;
+	worker->records = 0;
+}
+
+// Fail the test in flight on a worker that died or was killed.
+
+static void worker_lost(struct pool *pool, struct worker *worker,
+	int timed_out, unsigned timeout_ms)
+{
+	struct record done = { .kind = RECORD_DONE };
+	char buffer[256];
+	int status = 0;
+	pid_t pid;
+
+	if (timed_out)
+		kill(worker->pid, SIGKILL);
+
+	close(worker->fd);
+	do
+		pid = waitpid(worker->pid, &status, 0);
+	while (pid < 0 && errno == EINTR);
+
+	if (timed_out)
+		snprintf(buffer, sizeof(buffer), msg_isolate_timeout,
+			sys_self_test_name(worker->test), timeout_ms);
+	else if (pid > 0 && WIFSIGNALED(status))
+		snprintf(buffer, sizeof(buffer), msg_isolate_signal,
+			sys_self_test_name(worker->test), WTERMSIG(status));
+	else
+		snprintf(buffer, sizeof(buffer), msg_isolate_exit,
+			sys_self_test_name(worker->test));
+
+	worker->pid = 0;
+	worker->fd = -1;
+
+	done.start_ns = worker->deadline_ns - (uint64_t)timeout_ms * 1000000u;
+	done.wall_ns = clock_ns(CLOCK_MONOTONIC) - done.start_ns;
+
+	worker_finish(pool, worker, &done, buffer);
+}
+
+static void worker_receive(struct pool *pool, struct worker *worker,
+	unsigned timeout_ms)
+{
+	struct record record;
+	ssize_t length;
+
+	length = recv(worker->fd, &record, sizeof(record), MSG_DONTWAIT);
+
+	if (length < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (length != (ssize_t)sizeof(record))
+	{
+		worker_lost(pool, worker, 0, timeout_ms);
+		return;
+	}
+
+	if (record.kind == RECORD_DONE)
+		worker_finish(pool, worker, &record, NULL);
+	else
+		worker_keep(worker, &record);
+}
+
+static int isolate_dispatch(struct pool *pool, struct worker *workers,
+	size_t count, struct worker *worker, size_t level, size_t slot,
+	unsigned timeout_ms)
+{
+	struct command command;
+
+	if (worker->pid <= 0 && !worker_start(worker, workers, count))
+		return 0;
+
+	command.level = (uint32_t)level;
+	command.slot = (uint32_t)slot;
+	command.flags = pool->flags;
+
+	worker->test = sys_self_test_level_test(level, slot);
+	worker->level = level;
+	worker->ordinal = sys_self_test_ordinal(level, slot);
+	worker->records = 0;
+	worker->deadline_ns = clock_ns(CLOCK_MONOTONIC) +
+		(uint64_t)timeout_ms * 1000000u;
+
+	if (send(worker->fd, &command, sizeof(command), MSG_NOSIGNAL) < 0)
+		worker_lost(pool, worker, 0, timeout_ms);
+
+	return 1;
+}
+
+// Wait for messages from the busy workers until the earliest deadline,
+// and handle them; return zero if the workers cannot be polled
+
+static int isolate_wait(struct pool *pool, struct worker *workers,
+	struct pollfd *polls, size_t count, unsigned timeout_ms)
+{
+	uint64_t now, next;
+	int wait_ms;
+	size_t i;
+
+	now = clock_ns(CLOCK_MONOTONIC);
+	next = UINT64_MAX;
+	for (i = 0; i < count; ++i)
+	{
+		polls[i].fd = workers[i].test != NULL ? workers[i].fd : -1;
+		polls[i].events = POLLIN;
+		polls[i].revents = 0;
+		if (workers[i].test != NULL && workers[i].deadline_ns < next)
+			next = workers[i].deadline_ns;
+	}
+
+	wait_ms = next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+
+	if (poll(polls, count, wait_ms) < 0 && errno != EINTR)
+		return 0;
+
+	now = clock_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < count; ++i)
+	{
+		if (workers[i].test == NULL)
+			continue;
+		if (polls[i].revents != 0)
+			worker_receive(pool, &workers[i], timeout_ms);
+		else if (workers[i].deadline_ns <= now)
+			worker_lost(pool, &workers[i], 1, timeout_ms);
+	}
+
+	return 1;
+}
+
+// Hand out the tests of the dependency graph to the idle workers as they
+// become ready
+
+static void isolate_run_dag(struct pool *pool, struct worker *workers,
+	struct pollfd *polls, size_t count, unsigned timeout_ms)
+{
+	const struct node *node;
+	size_t busy, i, n;
+
+	for (;;)
+	{
+		busy = 0;
+		for (i = 0; i < count; ++i)
+		{
+			if (workers[i].test == NULL && !pool->stop &&
+				(n = sys_self_test_dag_next(pool, 0)) != SIZE_MAX)
+			{
+				node = &pool->dag->node[n];
+				if (!isolate_dispatch(pool, workers, count, &workers[i],
+					node->level, node->slot, timeout_ms))
+				{
+					pool->report(msg_isolate_fork, NULL, 0);
+					pool->rc = 0;
+					pool->stop = 1;
+					break;
+				}
+			}
+			if (workers[i].test != NULL)
+				++busy;
+		}
+
+		if (busy == 0 ||
+			!isolate_wait(pool, workers, polls, count, timeout_ms))
+			break;
+	}
+}
+
+static void isolate_run(struct pool *pool, size_t count)
+{
+	struct worker *workers;
+	struct pollfd *polls;
+	size_t level, slot, slots, busy, i;
+	unsigned timeout_ms;
+
+	timeout_ms = self_test_options.timeout_ms;
+	if (timeout_ms == 0)
+		timeout_ms = SELF_TEST_TIMEOUT_MS;
+
+	workers = (struct worker *)calloc(count, sizeof(*workers));
+	polls = (struct pollfd *)calloc(count, sizeof(*polls));
+
+	if (workers == NULL || polls == NULL)
+	{
+		free(workers);
+		free(polls);
+		pool->report(msg_isolate_fork, NULL, 0);
+		pool->rc = 0;
+		return;
+	}
+
+	if (pool->dag != NULL)
+		isolate_run_dag(pool, workers, polls, count, timeout_ms);
+
+	for (level = pool->first_level; level < pool->last_level &&
+		pool->dag == NULL; ++level)
+	{
+		if (pool->deadline_ns != 0 && level > pool->first_level &&
+			clock_ns(CLOCK_MONOTONIC) >= pool->deadline_ns)
+		{
+			pool->deferred = level;
+			break;
+		}
+
+		slots = sys_self_test_level_count(level);
+		slot = 0;
+
+		for (;;)
+		{
+			// Hand out tests to the idle workers
+
+			busy = 0;
+			for (i = 0; i < count; ++i)
+			{
+				while (workers[i].test == NULL && slot < slots &&
+					!pool->stop && sys_self_test_pool_skip(pool, level, slot))
+					++slot;
+
+				if (workers[i].test == NULL && slot < slots && !pool->stop)
+				{
+					if (!isolate_dispatch(pool, workers, count, &workers[i],
+						level, slot, timeout_ms))
+					{
+						pool->report(msg_isolate_fork, NULL, 0);
+						pool->rc = 0;
+						pool->stop = 1;
+						break;
+					}
+					++slot;
+				}
+				if (workers[i].test != NULL)
+					++busy;
+			}
+
+			if (busy == 0 ||
+				!isolate_wait(pool, workers, polls, count, timeout_ms))
+				break;
+		}
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		worker_stop(&workers[i], 0);
+		free(workers[i].record);
+	}
+
+	free(workers);
+	free(polls);
+}
+
+//
+// Deferred runner.
+//
+// With a time budget, the levels are run in order until the budget is
+// spent; the level in progress always completes.  The levels left over
+// are run in a forked child at the lowest scheduling priority, so that
+// tests that reset global state do not disturb the program, which goes on
+// with its startup.  The child names each failed test on a pipe, and a
+// background thread of the parent passes the names to the deferred failure
+// function of self_test_options.  The child is killed if the parent dies
+// first.
+//
+
+struct defer
+{
+	pid_t					pid;
+	int						fd;			// Read end of the pipe
+	self_test_report_pf		report;
+};
+
+static const char SELF_TEST_RO msg_defer[] =
+	"self-test: info: time budget spent; deferring levels %zu to %d";
+static const char SELF_TEST_RO msg_defer_failed[] =
+	"self-test: error: cannot defer self tests; running them now";
+static const char SELF_TEST_RO msg_defer_test[] =
+	"self-test: error: deferred test %s failed";
+static const char SELF_TEST_RO msg_defer_signal[] =
+	"self-test: error: deferred self tests terminated by signal %d";
+
+static void defer_fail(struct defer *defer, const char *name)
+{
+	char buffer[256];
+
+	if (self_test_options.deferred_failure != NULL)
+	{
+		self_test_options.deferred_failure(name);
+	}
+	else if (name != NULL)
+	{
+		snprintf(buffer, sizeof(buffer), msg_defer_test, name);
+		defer->report(buffer, NULL, 0);
+	}
+}
+
+static void *defer_main(void *arg)
+{
+	struct defer *defer = (struct defer *)arg;
+	char buffer[4096];
+	size_t used = 0, start, i;
+	int status = 0, failed = 0;
+	ssize_t length;
+	pid_t pid;
+
+	for (;;)
+	{
+		length = read(defer->fd, buffer + used, sizeof(buffer) - used);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length <= 0)
+			break;
+
+		// Hand over each complete name; keep a partial one for later
+
+		used += (size_t)length;
+		for (start = 0, i = 0; i < used; ++i)
+		{
+			if (buffer[i] == '\0')
+			{
+				defer_fail(defer, buffer + start);
+				failed = 1;
+				start = i + 1;
+			}
+		}
+
+		memmove(buffer, buffer + start, used - start);
+		used -= start;
+		if (used == sizeof(buffer))
+			used = 0;
+	}
+
+	close(defer->fd);
+
+	do
+		pid = waitpid(defer->pid, &status, 0);
+	while (pid < 0 && errno == EINTR);
+
+	if (pid > 0 && WIFSIGNALED(status))
+	{
+		snprintf(buffer, sizeof(buffer), msg_defer_signal, WTERMSIG(status));
+		defer->report(buffer, NULL, 0);
+		defer_fail(defer, NULL);
+	}
+	else if (!failed && pid > 0 && WIFEXITED(status) &&
+		WEXITSTATUS(status) != 0)
+	{
+		defer_fail(defer, NULL);
+	}
+
+	free(defer);
+	return NULL;
+}
+
+static int defer_start(self_test_report_pf report, unsigned flags,
+	size_t level)
+{
+	struct sched_param param = { 0 };
+	pthread_attr_t attr;
+	struct defer *defer;
+	pthread_t thread;
+	pid_t parent, pid;
+	int fd[2], verdict;
+
+	defer = (struct defer *)calloc(1, sizeof(*defer));
+	if (defer == NULL)
+		return 0;
+
+	if (pipe(fd) != 0)
+	{
+		free(defer);
+		return 0;
+	}
+
+	sys_self_test_flush();
+	fflush(NULL);
+
+	parent = getpid();
+	pid = fork();
+
+	if (pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if (getppid() != parent)
+			_exit(1);
+
+		sched_setscheduler(0, SCHED_IDLE, &param);
+		setpriority(PRIO_PROCESS, 0, 19);
+
+		close(fd[0]);
+		s_defer_fd = fd[1];
+		s_first_level = level;
+		self_test_options.budget_us = 0;
+
+		verdict = self_test_run(report, flags);
+
+		fflush(NULL);
+		_exit(verdict ? 0 : 1);
+	}
+
+	close(fd[1]);
+
+	if (pid < 0)
+	{
+		close(fd[0]);
+		free(defer);
+		return 0;
+	}
+
+	defer->pid = pid;
+	defer->fd = fd[0];
+	defer->report = report;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, defer_main, defer) != 0)
+	{
+		// Without a thread to watch it, the child cannot be trusted
+
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(fd[0]);
+		free(defer);
+		pthread_attr_destroy(&attr);
+		return 0;
+	}
+
+	pthread_attr_destroy(&attr);
+	return 1;
+}
+
+int sys_self_test_run(self_test_report_pf report, unsigned flags)
+{
+	struct pool pool = { .gate = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t *thread = NULL;
+	size_t threads, level, count;
+	unsigned budget_us;
+	char buffer[128];
+
+	// Only the shared objects keep their tests once the pages of the
+	// program have been released
+
+	if (s_released && !s_modules_fresh)
+	{
+		report(msg_released, NULL, 0);
+		return 0;
+	}
+
+	// Recording baselines runs every test, whatever the cache holds
+
+	if (flags & SELF_TEST_FLAG_RECORD_BASELINE)
+		flags |= SELF_TEST_FLAG_FORCE;
+
+	pool.report = report;
+	pool.flags = flags;
+	pool.rc = 1;
+	pool.threads = 1;
+	pool.heap = self_test_options.heap;
+	pool.blocks = self_test_options.blocks;
+	pool.first_level = s_first_level;
+	pool.done = s_defer_done;
+	pool.done_tests = s_defer_tests;
+	pool.last_level = SELF_TEST_LEVEL_COUNT;
+
+	if (self_test_options.budget_us != 0 && !s_modules_fresh)
+		pool.deadline_ns = clock_ns(CLOCK_MONOTONIC) +
+			(uint64_t)self_test_options.budget_us * 1000u;
+
+	if (!catalog_open(report))
+		report(msg_catalog_memory, NULL, 0);
+
+	sys_self_test_cache_open(report);
+	sys_self_test_baseline_open(report, flags);
+	sys_self_test_output_open(report);
+
+	pool.dag = sys_self_test_dag_build(&pool);
+
+	if (flags & SELF_TEST_FLAG_TIMING)
+	{
+		for (count = 0, level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+			count += sys_self_test_level_count(level);
+
+		// Timing is best effort; run the tests anyway when out of memory
+
+		if (count > 0)
+			pool.result = (struct result *)calloc(count, sizeof(*pool.result));
+	}
+
+	if (flags & SELF_TEST_FLAG_ISOLATE)
+	{
+		threads = (flags & SELF_TEST_FLAG_PARALLEL) ? pool_size(&pool) : 1;
+		isolate_run(&pool, threads > 1 ? threads : 1);
+	}
+	else if (flags & SELF_TEST_FLAG_PARALLEL)
+	{
+		threads = pool_size(&pool);
+
+		// The threads share the heap, so each checks its tests against
+		// the statistics of its own allocations, or the figures of a test
+		// would hold the allocations of the tests running next to it
+
+		if (threads > 1 && pool.heap != NULL &&
+			self_test_options.thread_heap == NULL)
+		{
+			report(msg_heap_threads, NULL, 0);
+			threads = 1;
+		}
+
+		if (threads > 1)
+			thread = (pthread_t *)calloc(threads, sizeof(*thread));
+
+		if (thread != NULL && pool.heap != NULL)
+		{
+			pool.heap = self_test_options.thread_heap;
+			pool.blocks = self_test_options.thread_blocks;
+		}
+
+		// Fall back to the serial runner if the pool cannot be set up
+
+		if (thread != NULL && !pool_start(&pool, thread, threads))
+		{
+			pool_join(&pool, thread);
+			free(thread);
+			thread = NULL;
+			pool.abort = 0;
+			pool.threads = 1;
+			pool.heap = self_test_options.heap;
+			pool.blocks = self_test_options.blocks;
+		}
+	}
+
+	if (!(flags & SELF_TEST_FLAG_ISOLATE))
+		pool_worker(&pool);
+
+	if (thread != NULL)
+	{
+		pool_join(&pool, thread);
+		free(thread);
+	}
+
+	if (pool.test_count == 0 && pool.cached == 0 && pool.skipped == 0 &&
+		!s_released)
+		report(msg_linker_warning, NULL, 0);
+	else if (pool.test_count == 0 && pool.cached == 0 && !pool.stop &&
+		!s_modules_fresh)
+		report(msg_selection_warning, NULL, 0);
+
+	if (!fixture_leave(report, SIZE_MAX))
+		pool.rc = 0;
+
+	module_report(report);
+
+	sys_self_test_cache_close();
+	sys_self_test_baseline_close();
+
+	if (pool.result != NULL)
+	{
+		report_timing(&pool);
+		free(pool.result);
+	}
+
+	// Leave the levels beyond the budget to the deferred runner, unless
+	// there is nothing left to run or the run has already failed.  A graph
+	// leaves the tests that did not start; should the tests that finished
+	// not be noted, those of the levels left over run again.
+
+	count = 0;
+	if (pool.dag != NULL && pool.deadline_ns != 0 && pool.rc &&
+		pool.dag->remaining != 0)
+	{
+		s_defer_tests = pool.dag->tests;
+		s_defer_done = (unsigned char *)calloc(s_defer_tests, 1);
+		count = sys_self_test_dag_defer(&pool, s_defer_done);
+	}
+	else if (pool.dag == NULL)
+	{
+		for (level = pool.deferred; level != 0 &&
+			level < SELF_TEST_LEVEL_COUNT; ++level)
+			count += sys_self_test_level_count(level);
+	}
+
+	sys_self_test_dag_free(pool.dag);
+
+	if (count != 0 && pool.rc)
+	{
+		snprintf(buffer, sizeof(buffer), msg_defer, pool.deferred + 1,
+			SELF_TEST_LEVEL_COUNT);
+		report(buffer, NULL, 0);
+
+		if (!defer_start(report, flags, pool.deferred))
+		{
+			// Run the left-over levels now rather than not at all
+
+			report(msg_defer_failed, NULL, 0);
+			budget_us = self_test_options.budget_us;
+			self_test_options.budget_us = 0;
+			s_first_level = pool.deferred;
+			pool.rc = sys_self_test_run(report, flags);
+			s_first_level = 0;
+			self_test_options.budget_us = budget_us;
+		}
+	}
+
+	free(s_defer_done);
+	s_defer_done = NULL;
+
+	return pool.rc;
+}
+
+int sys_self_test_run_modules(self_test_report_pf report, unsigned flags)
+{
+	int rc;
+
+	s_modules_fresh = 1;
+	rc = sys_self_test_run(report, flags);
+	s_modules_fresh = 0;
+
+	return rc;
+}
+
+//
+// Asynchronous runner.
+//
+// The self tests run in a forked child while the parent goes on with its
+// initialization.  The child reports through the same report function,
+// since it shares the parent's image and standard error, and its exit
+// status carries the verdict back to the parent.  The child is killed if
+// the parent dies first.
+//
+
+static pid_t s_async_pid = 0;
+static self_test_report_pf s_async_report = NULL;
+
+static const char SELF_TEST_RO msg_async_signal[] =
+	"self-test: error: self test process terminated by signal %d";
+static const char SELF_TEST_RO msg_async_failed[] =
+	"self-test: error: cannot start self test process";
+
+int sys_self_test_start_async(self_test_report_pf report, unsigned flags)
+{
+	pid_t parent, pid;
+	int verdict;
+
+	if (s_async_pid > 0)
+		return 0;
+
+	// Flush the parent's buffered output so the child cannot repeat it,
+	// and open the record stream for the parent to own and end
+
+	sys_self_test_flush();
+	fflush(NULL);
+	sys_self_test_output_open(report);
+
+	parent = getpid();
+	pid = fork();
+
+	if (pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if (getppid() != parent)
+			_exit(1);
+
+		// The verdict of every level is awaited; nothing is deferred
+
+		self_test_options.budget_us = 0;
+		verdict = self_test_run(report, flags);
+
+		sys_self_test_output_end();
+		fflush(NULL);
+		_exit(verdict ? 0 : 1);
+	}
+
+	if (pid < 0)
+	{
+		report(msg_async_failed, NULL, 0);
+		return 0;
+	}
+
+	s_async_pid = pid;
+	s_async_report = report;
+	return 1;
+}
+
+int sys_self_test_wait(void)
+{
+	char buffer[80];
+	int status;
+	pid_t pid;
+
+	if (s_async_pid <= 0)
+		return 0;
+
+	do
+		pid = waitpid(s_async_pid, &status, 0);
+	while (pid < 0 && errno == EINTR);
+
+	s_async_pid = 0;
+
+	if (pid < 0)
+		return 0;
+
+	if (WIFSIGNALED(status))
+	{
+		snprintf(buffer, sizeof(buffer), msg_async_signal, WTERMSIG(status));
+		s_async_report(buffer, NULL, 0);
+		return 0;
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//
+// Release of the self-test pages.
+//
+// Once the self tests have run, their code, constants, descriptors and
+// test tables are dead weight that still counts toward the resident set.
+// The pages that lie entirely within those sections are handed back to
+// the kernel with MADV_DONTNEED.  Pages shared with other sections are
+// kept, so nothing outside the self-test sections is ever touched.
+//
+// The mappings stay in place; the code and string pages would simply be
+// read back from the executable if touched again.  The descriptor and
+// table pages hold relocated pointers, though, and would come back with
+// their unrelocated file contents, so self tests can no longer run once
+// the pages are released.
+//
+// Building linux_selftest.c with SELF_TEST_PAGE_ALIGN page-aligns the start
+// of the code and constant sections, at the cost of some padding, so that
+// small sections still free whole pages.
+//
+
+
+#if defined(SELF_TEST_PAGE_ALIGN)
+#define SELF_TEST_PAGE_SIZE 4096
+static void SELF_TEST_FUNC __attribute__((__used__,
+	__aligned__(SELF_TEST_PAGE_SIZE))) page_align_txt(void) {}
+static const char SELF_TEST_RO __attribute__((
+	__aligned__(SELF_TEST_PAGE_SIZE))) page_align_str[1];
+#endif
+
+static size_t release_range(const void *start, const void *stop, size_t page)
+{
+	uintptr_t first, last;
+	unsigned char *resident;
+	size_t pages, bytes, i;
+
+	if (start == NULL || stop == NULL)
+		return 0;
+
+	// Round inward so that only whole pages of the section are released
+
+	first = ((uintptr_t)start + page - 1) & ~(uintptr_t)(page - 1);
+	last = (uintptr_t)stop & ~(uintptr_t)(page - 1);
+	if (last <= first)
+		return 0;
+
+	// Count the resident pages to report what was actually reclaimed;
+	// assume all of them are resident when that cannot be determined
+
+	pages = (last - first) / page;
+	bytes = pages * page;
+	resident = (unsigned char *)malloc(pages);
+	if (resident != NULL && mincore((void *)first, last - first, resident) == 0)
+	{
+		bytes = 0;
+		for (i = 0; i < pages; ++i)
+			if (resident[i] & 1)
+				bytes += page;
+	}
+	free(resident);
+
+	if (madvise((void *)first, last - first, MADV_DONTNEED) != 0)
+		return 0;
+
+	return bytes;
+}
+
+size_t sys_self_test_release(void)
+{
+	size_t page, bytes, level;
+
+	if (s_released)
+		return 0;
+
+	// Walk the objects again before the next run, leaving the program out
+
+	pthread_mutex_lock(&s_catalog_lock);
+	s_released = 1;
+	s_modules.walked = 0;
+	pthread_mutex_unlock(&s_catalog_lock);
+	page = (size_t)sysconf(_SC_PAGESIZE);
+
+	bytes = release_range(__start_slftst_txt, __stop_slftst_txt, page);
+	bytes += release_range(__start_slftst_str, __stop_slftst_str, page);
+	bytes += release_range(__start_slftst_bench, __stop_slftst_bench, page);
+	bytes += release_range(__start_slftst_deps, __stop_slftst_deps, page);
+	bytes += release_range(__start_slftst_fix, __stop_slftst_fix, page);
+	bytes += release_range(__start_slftst_mem, __stop_slftst_mem, page);
+	bytes += release_range(__start_slftst_perf, __stop_slftst_perf, page);
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		bytes += release_range(program_start[level], program_stop[level],
+			page);
+
+	return bytes;
+}
+
+//
+// Benchmark runner.
+//
+// The iteration count of a benchmark is calibrated by doubling it, then
+// scaling it, until a single call of the benchmark function takes at
+// least the target sample time.  A few warm-up samples are run and
+// discarded to settle caches, branch predictors and the allocator, and the
+// remaining samples are sorted to report the minimum, median and 99th
+// percentile time per iteration along with the overall mean.
+//
+
+#define SELF_BENCH_TARGET_NS	5000000u	// Duration of one sample
+#define SELF_BENCH_WARMUP		3			// Samples discarded
+#define SELF_BENCH_SAMPLES		31			// Samples measured
+
+static const char SELF_TEST_RO msg_bench[] =
+	"self-bench: info: %s: %zu iterations x %d samples, min %.2f ns/op, "
+	"median %.2f ns/op, p99 %.2f ns/op, mean %.2f ns/op";
+static const char SELF_TEST_RO msg_bench_prefix[] =
+	"self-bench: info: bench ";
+static const char SELF_TEST_RO msg_bench_none[] =
+	"self-bench: info: no benchmarks linked";
+
+static int compare_level(const void *a, const void *b)
+{
+	const struct self_bench *ba = *(const struct self_bench *const *)a;
+	const struct self_bench *bb = *(const struct self_bench *const *)b;
+	int order;
+
+	// Level section names sort in level order
+
+	order = strcmp(ba->level, bb->level);
+	if (order == 0)
+		order = strcmp(ba->name, bb->name);
+	return order;
+}
+
+static int bench_sample(self_test_report_pf report,
+	const struct self_bench *bench, size_t iterations, uint64_t *elapsed)
+{
+	uint64_t start;
+	int passed;
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	passed = bench->func(report, iterations);
+	*elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+
+	return passed;
+}
+
+static int bench_run(self_test_report_pf report, const struct self_bench *bench)
+{
+	double sample[SELF_BENCH_SAMPLES], total;
+	uint64_t elapsed, sum;
+	size_t iterations;
+	char buffer[320];
+	const char *name;
+	int i;
+
+	if (bench->name != NULL)
+		report(bench->name, NULL, 0);
+
+	// Calibrate the number of iterations in one sample
+
+	iterations = 1;
+	for (;;)
+	{
+		if (!bench_sample(report, bench, iterations, &elapsed))
+			return 0;
+		if (elapsed >= SELF_BENCH_TARGET_NS)
+			break;
+
+		iterations = sample_scale(iterations, elapsed, SELF_BENCH_TARGET_NS);
+	}
+
+	for (i = 0; i < SELF_BENCH_WARMUP; ++i)
+		if (!bench_sample(report, bench, iterations, &elapsed))
+			return 0;
+
+	sum = 0;
+	for (i = 0; i < SELF_BENCH_SAMPLES; ++i)
+	{
+		if (!bench_sample(report, bench, iterations, &elapsed))
+			return 0;
+		sample[i] = (double)elapsed / (double)iterations;
+		sum += elapsed;
+	}
+
+	qsort(sample, SELF_BENCH_SAMPLES, sizeof(sample[0]), compare_double);
+	total = (double)iterations * SELF_BENCH_SAMPLES;
+
+	name = bench->name;
+	if (name == NULL)
+		name = "?";
+	else if (!strncmp(name, msg_bench_prefix, sizeof(msg_bench_prefix) - 1))
+		name += sizeof(msg_bench_prefix) - 1;
+
+	// Nearest-rank percentiles
+
+	snprintf(buffer, sizeof(buffer), msg_bench, name, iterations,
+		SELF_BENCH_SAMPLES, sample[0], sample[SELF_BENCH_SAMPLES / 2],
+		sample[(99 * SELF_BENCH_SAMPLES + 99) / 100 - 1], (double)sum / total);
+	report(buffer, NULL, 0);
+
+	return 1;
+}
+
+int sys_self_bench_run(self_test_report_pf report, unsigned flags)
+{
+	const struct self_bench **bench;
+	size_t count, i;
+	int rc = 1;
+
+	if (s_released)
+	{
+		report(msg_released, NULL, 0);
+		return 0;
+	}
+
+	count = __stop_slftst_bench - __start_slftst_bench;
+	if (count == 0)
+	{
+		report(msg_bench_none, NULL, 0);
+		return 1;
+	}
+
+	bench = (const struct self_bench **)malloc(count * sizeof(*bench));
+	if (bench == NULL)
+		return 0;
+
+	memcpy(bench, __start_slftst_bench, count * sizeof(*bench));
+	qsort(bench, count, sizeof(*bench), compare_level);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (!bench_run(report, bench[i]))
+		{
+			rc = 0;
+			if (flags & SELF_TEST_FLAG_STOP_ON_FAILURE)
+				break;
+		}
+	}
+
+	free(bench);
+	return rc;
+}
+
 #endif /* LINUX_SELFTEST_H */
@@ -28,44 +28,33 @@ SOFTWARE.
 
 #define SELF_TEST_DECL
 
-// Setup the names of the required sections for each test level
-
-#define SELF_TEST_LEVEL_1 ".slftst.ini0"
-#define SELF_TEST_LEVEL_2 ".slftst.ini1"
-#define SELF_TEST_LEVEL_3 ".slftst.ini2"
-#define SELF_TEST_LEVEL_4 ".slftst.ini3"
-#define SELF_TEST_LEVEL_5 ".slftst.ini4"
-#define SELF_TEST_LEVEL_6 ".slftst.ini5"
-#define SELF_TEST_LEVEL_7 ".slftst.ini6"
-#define SELF_TEST_LEVEL_8 ".slftst.ini7"
-#define SELF_TEST_LEVEL_9 ".slftst.ini8"
-#define SELF_TEST_LEVEL_10 ".slftst.ini9"
+// Setup the names of the required sections for each test level.  The names
+// are C identifiers so that the linker bounds each section with __start_
+// and __stop_ symbols.
+
+#define SELF_TEST_LEVEL_1 "slftst_ini0"
+#define SELF_TEST_LEVEL_2 "slftst_ini1"
+#define SELF_TEST_LEVEL_3 "slftst_ini2"
+#define SELF_TEST_LEVEL_4 "slftst_ini3"
+#define SELF_TEST_LEVEL_5 "slftst_ini4"
+#define SELF_TEST_LEVEL_6 "slftst_ini5"
+#define SELF_TEST_LEVEL_7 "slftst_ini6"
+#define SELF_TEST_LEVEL_8 "slftst_ini7"
+#define SELF_TEST_LEVEL_9 "slftst_ini8"
+#define SELF_TEST_LEVEL_10 "slftst_ini9"
 
 // Set the default test level
 
 #define SELF_TEST_LEVEL_DEFAULT SELF_TEST_LEVEL_5
 
-// Forward declare all sections; unused sections are removed by the linker
-
-extern void __attribute__((__section__(".slftst.inis"))) *self_test_list_start;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_1))) *self_test_list_1;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_2))) *self_test_list_2;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_3))) *self_test_list_3;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_4))) *self_test_list_4;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_5))) *self_test_list_5;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_6))) *self_test_list_6;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_7))) *self_test_list_7;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_8))) *self_test_list_8;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_9))) *self_test_list_9;
-extern void __attribute__((__section__(SELF_TEST_LEVEL_10))) *self_test_list_10;
-extern void __attribute__((__section__(".slftst.inie"))) *self_test_list_end;
+#if !defined(SELF_TEST_STRIP)
 
 // Define platform-specific macros 
 
 #define SELF_TEST_FUNC \
-	__attribute__((__section__(".slftst.txt"))) SELF_TEST_DECL
+	__attribute__((__section__("slftst_txt"))) SELF_TEST_DECL
 #define SELF_TEST_RO \
-	__attribute__((__used__,__section__(".slftst.str")))
+	__attribute__((__used__,__section__("slftst_str")))
 #define SELF_TEST_LEVEL(l) \
 	__attribute__((__used__,__section__(l))) 
 
@@ -79,6 +68,99 @@ extern void __attribute__((__section__(".slftst.inie"))) *self_test_list_end;
 		&self_test_desc_##n;\
 	int SELF_TEST_FUNC self_test_##n(self_test_report_pf self_test_report)
 
+// Benchmark descriptors are collected in a section of their own.  Its
+// name is a valid C identifier so the linker defines the symbols
+// __start_slftst_bench and __stop_slftst_bench that bound it.
+
+#define SELF_BENCH_SECTION \
+	__attribute__((__used__,__section__("slftst_bench")))
+
+#define SELF_BENCH(n,l) \
+	extern int SELF_TEST_FUNC self_bench_##n(self_test_report_pf, size_t);\
+	static const char SELF_TEST_RO self_bench_msg_##n[] = \
+		"self-bench: info: bench " # n; \
+	static const char SELF_TEST_RO self_bench_level_##n[] = l; \
+	static const struct self_bench SELF_TEST_RO self_bench_desc_##n = \
+		{ self_bench_##n, self_bench_msg_##n, self_bench_level_##n };\
+	static const struct self_bench SELF_BENCH_SECTION *self_bench_ptr_##n = \
+		&self_bench_desc_##n;\
+	int SELF_TEST_FUNC self_bench_##n( \
+		self_test_report_pf self_test_report __attribute__((__unused__)), \
+		size_t self_bench_iterations)
+
+#define SELF_BENCH_KEEP(x) \
+	__asm__ __volatile__("" : : "g"(x) : "memory")
+
+// Dependencies are collected in a section of their own, bounded by
+// __start_slftst_deps and __stop_slftst_deps.  A program that declares any
+// runs its tests in dependency order instead of level by level.
+
+#define SELF_TEST_DEPENDS_SECTION \
+	__attribute__((__used__,__section__("slftst_deps")))
+
+#define SELF_TEST_DEPENDS(n,...) \
+	static const char SELF_TEST_RO self_test_dep_name_##n[] = # n; \
+	static const char SELF_TEST_RO self_test_dep_list_##n[] = # __VA_ARGS__; \
+	static const struct self_test_depends SELF_TEST_RO \
+		self_test_dep_desc_##n = \
+		{ self_test_dep_name_##n, self_test_dep_list_##n }; \
+	static const struct self_test_depends SELF_TEST_DEPENDS_SECTION \
+		*self_test_dep_ptr_##n = &self_test_dep_desc_##n
+
+// Fixtures are collected in a section of their own, bounded by
+// __start_slftst_fix and __stop_slftst_fix.  The setup and teardown
+// functions must be declared before the fixture; the setup function also
+// names the fixture for SELF_TEST_FIXTURE_STATE().
+
+#define SELF_TEST_FIXTURE_SECTION \
+	__attribute__((__used__,__section__("slftst_fix")))
+
+#define SELF_TEST_FIXTURE(l,s,t) \
+	static const char SELF_TEST_RO self_test_fixture_name_##s[] = # s; \
+	static const char SELF_TEST_RO self_test_fixture_level_##s[] = l; \
+	static const struct self_test_fixture SELF_TEST_RO \
+		self_test_fixture_desc_##s = \
+		{ self_test_fixture_name_##s, self_test_fixture_level_##s, s, t }; \
+	static const struct self_test_fixture SELF_TEST_FIXTURE_SECTION \
+		*self_test_fixture_ptr_##s = &self_test_fixture_desc_##s
+
+#define SELF_TEST_FIXTURE_STATE(s) \
+	sys_self_test_fixture(&self_test_fixture_desc_##s, self_test_report)
+
+// Memory budgets are collected in a section of their own, bounded by
+// __start_slftst_mem and __stop_slftst_mem.
+
+#define SELF_TEST_BUDGET_SECTION \
+	__attribute__((__used__,__section__("slftst_mem")))
+
+#define SELF_TEST_MEMORY_BUDGET(n,b) \
+	static const char SELF_TEST_RO self_test_budget_name_##n[] = # n; \
+	static const struct self_test_budget SELF_TEST_RO \
+		self_test_budget_desc_##n = { self_test_budget_name_##n, (b) }; \
+	static const struct self_test_budget SELF_TEST_BUDGET_SECTION \
+		*self_test_budget_ptr_##n = &self_test_budget_desc_##n
+
+// The name of each baseline is collected in a section of its own, bounded
+// by __start_slftst_perf and __stop_slftst_perf, to size the baseline file.
+
+#define SELF_TEST_PERF_SECTION \
+	__attribute__((__used__,__section__("slftst_perf")))
+
+#define SELF_TEST_PERF_ASSERT(x,n,t) \
+	do { \
+		static const char SELF_TEST_RO name[] = # n; \
+		static const char SELF_TEST_RO file[] = __FILE__; \
+		static const char SELF_TEST_PERF_SECTION *name_ptr = name; \
+		struct self_test_perf perf = { .name = name, .tolerance = (t) }; \
+		size_t i; \
+		while (sys_self_test_perf_next(&perf)) \
+			for (i = perf.iterations; i != 0; --i) \
+				SELF_BENCH_KEEP(x); \
+		if (!sys_self_test_perf_check(&perf, self_test_report, file, \
+			__LINE__)) \
+			goto failure; \
+	} while(0)
+
 #define SELF_TEST_ASSERT(x) \
 	do { \
 		if (!(x)) { \
@@ -89,4 +171,60 @@ extern void __attribute__((__section__(".slftst.inie"))) *self_test_list_end;
 		} \
 	} while(0)
 
+#else /* SELF_TEST_STRIP */
+
+// A production build compiled with SELF_TEST_STRIP defined leaves its self
+// tests to a companion shared object built from the same sources; see
+// linux_selftest_companion.c.  The tests, benchmarks and their helpers
+// become unused static functions that an optimizing compiler drops along
+// with their strings, and nothing is placed in the self-test sections.
+
+#define SELF_TEST_FUNC __attribute__((__unused__))
+#define SELF_TEST_RO __attribute__((__unused__))
+#define SELF_TEST_LEVEL(l)
+
+#define SELF_TEST(n,l) \
+	static int SELF_TEST_FUNC self_test_##n( \
+		self_test_report_pf self_test_report __attribute__((__unused__)))
+
+#define SELF_BENCH(n,l) \
+	static int SELF_TEST_FUNC self_bench_##n( \
+		self_test_report_pf self_test_report __attribute__((__unused__)), \
+		size_t self_bench_iterations)
+
+#define SELF_BENCH_KEEP(x) \
+	__asm__ __volatile__("" : : "g"(x) : "memory")
+
+#define SELF_TEST_DEPENDS(n,...) \
+	extern const struct self_test_depends self_test_dep_desc_##n
+
+#define SELF_TEST_FIXTURE(l,s,t) \
+	extern const struct self_test_fixture self_test_fixture_desc_##s
+
+#define SELF_TEST_FIXTURE_STATE(s) ((void *)0)
+
+#define SELF_TEST_MEMORY_BUDGET(n,b) \
+	extern const struct self_test_budget self_test_budget_desc_##n
+
+#define SELF_TEST_PERF_ASSERT(x,n,t) \
+	do { \
+		if (0) \
+			SELF_BENCH_KEEP(x); \
+	} while(0)
+
+#define SELF_TEST_ASSERT(x) \
+	do { \
+		if (!(x)) \
+			goto failure; \
+	} while(0)
+
+#endif /* SELF_TEST_STRIP */
+
+// Tell the buffered reporting channel which test runs on the calling
+// thread.  Tests are numbered from one in the order they are defined,
+// level after level.
+
+extern void sys_self_test_begin(size_t test);
+extern void sys_self_test_end(size_t test);
+
 #endif /* LINUX_SELFTEST_H */
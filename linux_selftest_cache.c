@@ -0,0 +1,380 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#define _GNU_SOURCE			// dl_iterate_phdr
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+#include "linux_selftest_internal.h"
+
+//
+// Result cache.
+//
+// When self_test_options.cache_path names a file, the verdict of each test
+// is kept there from one run of the program to the next, and a test that
+// passed before is skipped.  The file starts with a header holding a hash
+// of the ELF build-id of the program and of the host name; a header that
+// does not match this program on this host discards every verdict in the
+// file.  An open-addressed table follows, with one entry per test keyed by
+// a hash of the test's name and code.  The code of a test is taken to run
+// from its function to the next test or benchmark function in the
+// slftst_txt section.
+//
+// The file is mapped shared, so the verdicts are written in place as the
+// tests complete, and concurrent runs of the same program share them.  It
+// is locked only while it is checked and laid out.  A program without a
+// build-id cannot tell its builds apart and does not use the cache.
+//
+// SELF_TEST_FLAG_FORCE runs every test and records the new verdicts.
+//
+
+#define SELF_TEST_CACHE_MAGIC "slftstc1"
+
+struct cache_header
+{
+	char				magic[8];
+	uint64_t			binary;		// Hash of the build-id and host name
+	uint32_t			capacity;	// Entries in the table; a power of two
+	uint32_t			reserved;
+};
+
+struct cache_entry
+{
+	uint64_t			key;		// Hash of the test; zero when free
+	uint32_t			passed;
+	uint32_t			reserved;
+};
+
+struct cache
+{
+	struct cache_header	*header;	// Mapping of the file; NULL when off
+	size_t				size;		// Bytes mapped
+	struct cache_entry	**entry;	// Entry of each test, by ordinal
+};
+
+static struct cache s_cache;
+
+static const char SELF_TEST_RO msg_cache_open[] =
+	"self-test: warning: cannot use result cache %s";
+static const char SELF_TEST_RO msg_cache_build_id[] =
+	"self-test: warning: result cache disabled; the program has no build-id";
+
+struct build_id
+{
+	uintptr_t			address;	// Address within the object
+	uint64_t			hash;
+	int					found;
+};
+
+// Hash the build-id note of the object that holds this runner, which is
+// the object whose tests it runs
+
+static int build_id_find(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct build_id *id = (struct build_id *)data;
+	const ElfW(Phdr) *phdr;
+	const ElfW(Nhdr) *note;
+	const char *next, *end, *name, *desc;
+	uintptr_t start;
+	int i, inside = 0;
+
+	(void)size;
+	for (i = 0; i < info->dlpi_phnum; ++i)
+	{
+		phdr = &info->dlpi_phdr[i];
+		start = info->dlpi_addr + phdr->p_vaddr;
+		if (phdr->p_type == PT_LOAD && id->address >= start &&
+			id->address < start + phdr->p_memsz)
+			inside = 1;
+	}
+
+	if (!inside)
+		return 0;
+
+	for (i = 0; i < info->dlpi_phnum && !id->found; ++i)
+	{
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		next = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+		end = next + phdr->p_memsz;
+
+		while (next + sizeof(*note) <= end)
+		{
+			note = (const ElfW(Nhdr) *)next;
+			name = next + sizeof(*note);
+			desc = name + ((note->n_namesz + 3) & ~3u);
+			next = desc + ((note->n_descsz + 3) & ~3u);
+
+			if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+				memcmp(name, "GNU", 4) == 0 && desc + note->n_descsz <= end)
+			{
+				id->hash = hash_bytes(id->hash, desc, note->n_descsz);
+				id->found = 1;
+				break;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static int compare_address(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Hash the name and the code of a test; entry holds the sorted addresses
+// of every test and benchmark function.  A test of a shared object is
+// keyed by the build-id of its object instead of its code, and gets no key
+// when its object has no build-id.
+
+static uint64_t cache_key(const struct self_test *test,
+	const uintptr_t *entry, size_t entries)
+{
+	struct build_id id = { (uintptr_t)test->func, HASH_INIT, 0 };
+	uintptr_t code, end;
+	uint64_t hash = HASH_INIT;
+	size_t i;
+
+	if (test->name != NULL)
+		hash = hash_bytes(hash, test->name, strlen(test->name));
+
+	code = (uintptr_t)test->func;
+	end = (uintptr_t)__stop_slftst_txt;
+
+	if (__start_slftst_txt != NULL && code >= (uintptr_t)__start_slftst_txt &&
+		code < end)
+	{
+		for (i = 0; i < entries; ++i)
+		{
+			// The functions of shared objects lie outside the section
+
+			if (entry[i] > code)
+			{
+				if (entry[i] < end)
+					end = entry[i];
+				break;
+			}
+		}
+
+		hash = hash_bytes(hash, (const void *)code, end - code);
+	}
+	else
+	{
+		id.hash = hash;
+		dl_iterate_phdr(build_id_find, &id);
+		if (!id.found)
+			return 0;
+		hash = id.hash;
+	}
+
+	return hash != 0 ? hash : 1;
+}
+
+static int cache_map(int fd, uint64_t binary, uint32_t capacity)
+{
+	struct cache_header *header;
+	struct stat st;
+	size_t size;
+
+	size = sizeof(*header) + (size_t)capacity * sizeof(struct cache_entry);
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+
+	if ((size_t)st.st_size != size && ftruncate(fd, (off_t)size) != 0)
+		return 0;
+
+	header = (struct cache_header *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+		return 0;
+
+	// Start over when the file belongs to another build or host
+
+	if (memcmp(header->magic, SELF_TEST_CACHE_MAGIC, sizeof(header->magic)) ||
+		header->binary != binary || header->capacity != capacity)
+	{
+		memset(header, 0, size);
+		memcpy(header->magic, SELF_TEST_CACHE_MAGIC, sizeof(header->magic));
+		header->binary = binary;
+		header->capacity = capacity;
+	}
+
+	s_cache.header = header;
+	s_cache.size = size;
+	return 1;
+}
+
+void sys_self_test_cache_open(self_test_report_pf report)
+{
+	struct build_id id = { (uintptr_t)&sys_self_test_cache_open, HASH_INIT, 0 };
+	struct cache_entry *table, *entry;
+	const struct self_bench **bench;
+	uintptr_t *address = NULL;
+	size_t level, slot, tests, entries, ordinal, i;
+	uint32_t capacity;
+	char host[256];
+	char buffer[512];
+	uint64_t key;
+	int fd;
+
+	if (self_test_options.cache_path == NULL)
+		return;
+
+	dl_iterate_phdr(build_id_find, &id);
+	if (!id.found)
+	{
+		report(msg_cache_build_id, NULL, 0);
+		return;
+	}
+
+	if (gethostname(host, sizeof(host)) == 0)
+	{
+		host[sizeof(host) - 1] = '\0';
+		id.hash = hash_bytes(id.hash, host, strlen(host));
+	}
+
+	for (tests = 0, level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		tests += sys_self_test_level_count(level);
+
+	if (tests == 0)
+		return;
+
+	for (capacity = 64; capacity < 2 * tests; capacity *= 2)
+		;
+
+	entries = tests;
+	if (__start_slftst_bench != NULL)
+		entries += __stop_slftst_bench - __start_slftst_bench;
+
+	address = (uintptr_t *)calloc(entries, sizeof(*address));
+	s_cache.entry = (struct cache_entry **)calloc(tests + 1,
+		sizeof(*s_cache.entry));
+
+	fd = open(self_test_options.cache_path, O_RDWR | O_CREAT | O_CLOEXEC,
+		0600);
+
+	if (address == NULL || s_cache.entry == NULL || fd < 0 ||
+		flock(fd, LOCK_EX) != 0 || !cache_map(fd, id.hash, capacity))
+	{
+		snprintf(buffer, sizeof(buffer), msg_cache_open,
+			self_test_options.cache_path);
+		report(buffer, NULL, 0);
+
+		if (fd >= 0)
+			close(fd);
+		free(address);
+		free(s_cache.entry);
+		s_cache.entry = NULL;
+		return;
+	}
+
+	for (i = 0, level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		for (slot = 0; slot < sys_self_test_level_count(level); ++slot)
+			address[i++] =
+				(uintptr_t)sys_self_test_level_test(level, slot)->func;
+	if (__start_slftst_bench != NULL)
+		for (bench = __start_slftst_bench; bench < __stop_slftst_bench; ++bench)
+			address[i++] = (uintptr_t)(*bench)->func;
+
+	qsort(address, entries, sizeof(*address), compare_address);
+
+	// Find or claim the entry of each test while the file is locked
+
+	table = (struct cache_entry *)(s_cache.header + 1);
+
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		for (slot = 0; slot < sys_self_test_level_count(level); ++slot)
+		{
+			key = cache_key(sys_self_test_level_test(level, slot), address,
+				entries);
+			ordinal = sys_self_test_ordinal(level, slot);
+			if (key == 0)
+				continue;
+
+			i = (size_t)key & (capacity - 1);
+			while (table[i].key != 0 && table[i].key != key)
+				i = (i + 1) & (capacity - 1);
+
+			entry = &table[i];
+			if (entry->key == 0)
+			{
+				entry->key = key;
+				entry->passed = 0;
+			}
+
+			s_cache.entry[ordinal] = entry;
+		}
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+	free(address);
+}
+
+void sys_self_test_cache_close(void)
+{
+	if (s_cache.header == NULL)
+		return;
+
+	munmap(s_cache.header, s_cache.size);
+	free(s_cache.entry);
+	memset(&s_cache, 0, sizeof(s_cache));
+}
+
+int sys_self_test_cache_passed(size_t ordinal)
+{
+	if (s_cache.header == NULL || s_cache.entry[ordinal] == NULL)
+		return 0;
+
+	return __atomic_load_n(&s_cache.entry[ordinal]->passed, __ATOMIC_RELAXED);
+}
+
+void sys_self_test_cache_record(size_t ordinal, int passed)
+{
+	if (s_cache.header == NULL || s_cache.entry[ordinal] == NULL)
+		return;
+
+	__atomic_store_n(&s_cache.entry[ordinal]->passed, passed ? 1 : 0,
+		__ATOMIC_RELAXED);
+}
+
+#endif /* LINUX_SELFTEST_H */
@@ -0,0 +1,227 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+/*
+
+Companion loader.
+
+A production build compiled with SELF_TEST_STRIP defined carries no self
+tests.  The SELF_TEST() bodies and their helpers are dropped by the
+compiler, and none of the self-test sections exist in the program.  The
+tests and the runner are built from the same sources into a companion
+shared object, named after the program:
+
+	cc -O2 -DSELF_TEST_STRIP -rdynamic -o toy main.c mem.c list.c selftest.c \
+		linux_selftest_companion.c -ldl
+	cc -O2 -shared -fPIC -pthread -o toy.selftest.so mem.c list.c \
+		linux_selftest.c linux_selftest_report.c
+
+This file stands in for the runner in the program.  The first call that
+needs the runner loads the companion with dlopen(), from
+self_test_options.companion_path or else from the path of the program
+followed by ".selftest.so", and each call is forwarded to the function of
+the same name in the companion.  A run that never asks for its self tests
+never maps the companion.
+
+The program is linked with -rdynamic so that the companion binds to the
+definitions of the program: self_test_options is shared, and the self
+tests call the production code of the program rather than the copy
+compiled into the companion.  Only the static functions of the tested
+sources run from that copy.  The companion is loaded with RTLD_GLOBAL so
+that shared objects loaded later find the fixtures and performance
+assertions of the runner.
+
+*/
+
+static const char SELF_TEST_RO msg_naked[] = "%s\n";
+static const char SELF_TEST_RO msg_decorated[] = "%s:%zu: %s\n";
+static const char SELF_TEST_RO msg_companion_suffix[] = ".selftest.so";
+static const char SELF_TEST_RO msg_companion_path[] =
+	"self-test: error: cannot find the path of the program";
+static const char SELF_TEST_RO msg_companion_open[] =
+	"self-test: error: cannot load the self tests: %s";
+static const char SELF_TEST_RO msg_companion_symbol[] =
+	"self-test: error: %s not found in the self tests";
+
+// Handle of the companion once loaded; the entry points of the runner are
+// called from the main thread
+
+static void *s_companion;
+
+void sys_self_test_report(const char *msg, const char *file, size_t line)
+{
+	if (file == NULL)
+		fprintf(stderr, msg_naked, msg);
+	else
+		fprintf(stderr, msg_decorated, file, line, msg);
+}
+
+// Load the companion if need be and look up a function of the runner
+
+static void *companion_symbol(const char *name, self_test_report_pf report)
+{
+	const char *file = self_test_options.companion_path;
+	char path[PATH_MAX], message[PATH_MAX + 128];
+	ssize_t length;
+	void *symbol;
+
+	if (s_companion == NULL)
+	{
+		if (file == NULL)
+		{
+			length = readlink("/proc/self/exe", path,
+				sizeof(path) - sizeof(msg_companion_suffix));
+			if (length < 0)
+			{
+				report(msg_companion_path, NULL, 0);
+				return NULL;
+			}
+
+			memcpy(path + length, msg_companion_suffix,
+				sizeof(msg_companion_suffix));
+			file = path;
+		}
+
+		s_companion = dlopen(file, RTLD_NOW | RTLD_GLOBAL);
+		if (s_companion == NULL)
+		{
+			snprintf(message, sizeof(message), msg_companion_open, dlerror());
+			report(message, NULL, 0);
+			return NULL;
+		}
+	}
+
+	// Looking up through the handle finds the definition of the companion
+	// rather than the one in this file
+
+	symbol = dlsym(s_companion, name);
+	if (symbol == NULL)
+	{
+		snprintf(message, sizeof(message), msg_companion_symbol, name);
+		report(message, NULL, 0);
+	}
+
+	return symbol;
+}
+
+#define COMPANION(f,report) ((__typeof__(&f))companion_symbol(# f, report))
+
+void sys_self_test_report_buffered(
+	const char *msg, const char *file, size_t line)
+{
+	void (*forward)(const char *, const char *, size_t) = NULL;
+
+	if (s_companion != NULL)
+		forward = COMPANION(sys_self_test_report_buffered,
+			sys_self_test_report);
+
+	if (forward != NULL)
+		forward(msg, file, line);
+	else
+		sys_self_test_report(msg, file, line);
+}
+
+void sys_self_test_flush(void)
+{
+	void (*forward)(void) = NULL;
+
+	if (s_companion != NULL)
+		forward = COMPANION(sys_self_test_flush, sys_self_test_report);
+
+	if (forward != NULL)
+		forward();
+}
+
+int sys_self_test_run(self_test_report_pf report, unsigned flags)
+{
+	int (*forward)(self_test_report_pf, unsigned) =
+		COMPANION(sys_self_test_run, report);
+
+	return forward != NULL ? forward(report, flags) : 0;
+}
+
+int sys_self_test_run_modules(self_test_report_pf report, unsigned flags)
+{
+	int (*forward)(self_test_report_pf, unsigned) =
+		COMPANION(sys_self_test_run_modules, report);
+
+	return forward != NULL ? forward(report, flags) : 0;
+}
+
+int sys_self_bench_run(self_test_report_pf report, unsigned flags)
+{
+	int (*forward)(self_test_report_pf, unsigned) =
+		COMPANION(sys_self_bench_run, report);
+
+	return forward != NULL ? forward(report, flags) : 0;
+}
+
+// Nothing was mapped when the companion was never loaded
+
+size_t sys_self_test_release(void)
+{
+	size_t (*forward)(void) = NULL;
+
+	if (s_companion != NULL)
+		forward = COMPANION(sys_self_test_release, sys_self_test_report);
+
+	return forward != NULL ? forward() : 0;
+}
+
+int sys_self_test_start_async(self_test_report_pf report, unsigned flags)
+{
+	int (*forward)(self_test_report_pf, unsigned) =
+		COMPANION(sys_self_test_start_async, report);
+
+	return forward != NULL ? forward(report, flags) : 0;
+}
+
+int sys_self_test_wait(void)
+{
+	int (*forward)(void) = NULL;
+
+	if (s_companion != NULL)
+		forward = COMPANION(sys_self_test_wait, sys_self_test_report);
+
+	return forward != NULL ? forward() : 0;
+}
+
+size_t sys_self_test_catalog(self_test_catalog_pf visit, void *data)
+{
+	size_t (*forward)(self_test_catalog_pf, void *) =
+		COMPANION(sys_self_test_catalog, sys_self_test_report);
+
+	return forward != NULL ? forward(visit, data) : 0;
+}
+
+#endif /* LINUX_SELFTEST_H && SELF_TEST_STRIP */
@@ -0,0 +1,703 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "linux_selftest_internal.h"
+
+//
+// Dependency scheduler.
+//
+// SELF_TEST_DEPENDS() names the tests a test needs.  Once a dependency is
+// declared anywhere, the tests run as a graph instead of level by level:
+// a test starts as soon as the tests it waits for have finished, on any
+// free thread or worker, lowest ordinal first.  A test that declares its
+// dependencies waits for them only.  Any other test still waits for all
+// the tests of the lower levels, so the levels keep ordering the tests
+// that do not say otherwise.  Those implicit edges go through a node that
+// stands for the end of each level, which keeps the graph linear in size.
+// A test that waits for a test of a higher level no longer holds its own
+// level back.
+//
+// A declared edge carries failures: a test whose dependency failed or was
+// skipped is skipped in turn, and so on downstream; a test left out of
+// the selection passes the failures of its dependencies on.  An implicit
+// edge only orders the tests; as in a level run, a failure does not keep
+// the higher levels from running.  Tests that are part of a dependency cycle fail
+// without running.  A dependency on a test that is not linked is reported
+// and ignored.
+//
+// Once the time budget is spent, the tests of the first level still start
+// but no other test does.  The tests running are let finish, and those
+// that did not run are left to the deferred run, which settles the tests
+// already finished as passed without running them again.
+//
+
+struct edge
+{
+	size_t				node;		// Node that waits
+	int					declared;	// Declared, as opposed to implicit
+};
+
+static const char SELF_TEST_RO msg_dag_unknown[] =
+	"self-test: warning: test %s depends on %s, which is not linked";
+static const char SELF_TEST_RO msg_dag_cycle[] =
+	"self-test: error: test %s is part of a dependency cycle";
+static const char SELF_TEST_RO msg_dag_blocked[] =
+	"self-test: error: test %s skipped; its dependency %s failed or was "
+	"skipped";
+static const char SELF_TEST_RO msg_dag_memory[] =
+	"self-test: warning: out of memory; running the tests by level";
+
+// Node of the test of a given name; SIZE_MAX when none is linked
+
+static size_t dag_find(const char *name)
+{
+	const struct catalog_entry *entry = sys_self_test_catalog_find(name);
+
+	return entry != NULL ? entry->ordinal - 1 : SIZE_MAX;
+}
+
+static const struct self_test *dag_test(const struct dag *dag, size_t n)
+{
+	return sys_self_test_level_test(dag->node[n].level, dag->node[n].slot);
+}
+
+// Ready tests are kept in a binary heap ordered by ordinal, which is the
+// node number of a test plus one
+
+static void dag_push(struct dag *dag, size_t n)
+{
+	size_t i = dag->ready++, parent;
+
+	while (i > 0 && dag->heap[parent = (i - 1) / 2] > n)
+	{
+		dag->heap[i] = dag->heap[parent];
+		i = parent;
+	}
+	dag->heap[i] = n;
+}
+
+static size_t dag_pop(struct dag *dag)
+{
+	size_t top = dag->heap[0], last = dag->heap[--dag->ready];
+	size_t i = 0, child;
+
+	while ((child = 2 * i + 1) < dag->ready)
+	{
+		if (child + 1 < dag->ready && dag->heap[child + 1] < dag->heap[child])
+			++child;
+		if (dag->heap[child] >= last)
+			break;
+		dag->heap[i] = dag->heap[child];
+		i = child;
+	}
+	if (dag->ready > 0)
+		dag->heap[i] = last;
+
+	return top;
+}
+
+// Finish a node and release the nodes waiting for it; a level end is
+// finished as soon as it is released.  Called with the lock held.
+
+static void dag_settle(struct dag *dag, size_t n, int passed)
+{
+	struct node *node = &dag->node[n], *next;
+	const struct edge *edge;
+	size_t i;
+
+	node->finished = 1;
+	if (node->slot != SIZE_MAX)
+		--dag->remaining;
+
+	for (i = 0; i < node->edges; ++i)
+	{
+		edge = &dag->edge[node->first + i];
+		next = &dag->node[edge->node];
+
+		if (edge->declared && !passed && next->blocker == NULL)
+			next->blocker = dag_test(dag, n);
+
+		if (--next->pending != 0 || next->finished)
+			continue;
+
+		if (next->slot == SIZE_MAX)
+			dag_settle(dag, edge->node, 1);
+		else
+			dag_push(dag, edge->node);
+	}
+}
+
+void sys_self_test_dag_finish(struct pool *pool, size_t n, int passed)
+{
+	struct dag *dag = pool->dag;
+
+	pthread_mutex_lock(&dag->lock);
+	--dag->running;
+	dag_settle(dag, n, passed);
+	pthread_cond_broadcast(&dag->wake);
+	pthread_mutex_unlock(&dag->lock);
+}
+
+//
+// Find the nodes that are part of a dependency cycle: those of a strongly
+// connected component of more than one node, and those that wait for
+// themselves.  Tarjan's algorithm finds them in a single pass over the
+// graph.  work holds five entries per node and mark one, both cleared;
+// a node of a cycle gets DAG_CYCLE in mark.
+//
+
+#define DAG_PATH	1			// On the path of the search
+#define DAG_CYCLE	2			// Part of a cycle
+
+static void dag_cycles(const struct dag *dag, size_t *work, unsigned char *mark)
+{
+	size_t nodes = dag->tests + SELF_TEST_LEVEL_COUNT;
+	size_t *index = work, *low = work + nodes, *next = work + 2 * nodes;
+	size_t *path = work + 3 * nodes, *call = work + 4 * nodes;
+	size_t counter = 0, paths = 0, calls, root, top, n, m;
+
+	for (root = 0; root < nodes; ++root)
+	{
+		if (index[root] != 0)
+			continue;
+
+		index[root] = low[root] = ++counter;
+		path[paths++] = root;
+		mark[root] |= DAG_PATH;
+		call[0] = root;
+		calls = 1;
+
+		while (calls > 0)
+		{
+			n = call[calls - 1];
+
+			if (next[n] < dag->node[n].edges)
+			{
+				m = dag->edge[dag->node[n].first + next[n]++].node;
+
+				if (m == n)
+					mark[n] |= DAG_CYCLE;
+
+				if (index[m] == 0)
+				{
+					index[m] = low[m] = ++counter;
+					path[paths++] = m;
+					mark[m] |= DAG_PATH;
+					call[calls++] = m;
+				}
+				else if ((mark[m] & DAG_PATH) && index[m] < low[n])
+					low[n] = index[m];
+				continue;
+			}
+
+			// Every edge of n is seen; n may be the root of a component
+
+			--calls;
+			if (calls > 0 && low[n] < low[call[calls - 1]])
+				low[call[calls - 1]] = low[n];
+
+			if (low[n] != index[n])
+				continue;
+
+			top = paths;
+			do
+			{
+				m = path[--paths];
+				mark[m] &= (unsigned char)~DAG_PATH;
+			}
+			while (m != n);
+
+			if (top - paths > 1)
+				for (m = paths; m < top; ++m)
+					mark[path[m]] |= DAG_CYCLE;
+		}
+	}
+}
+
+// Add an edge to the list of pairs; the list is sorted into place later
+
+static int dag_edge(struct edge **pair, size_t *pairs, size_t *capacity,
+	size_t from, size_t to, int declared)
+{
+	struct edge *grown;
+	size_t size;
+
+	if (*pairs + 2 > *capacity)
+	{
+		size = *capacity ? *capacity * 2 : 256;
+		grown = (struct edge *)realloc(*pair, size * sizeof(*grown));
+		if (grown == NULL)
+			return 0;
+		*pair = grown;
+		*capacity = size;
+	}
+
+	// Pairs are stored as (from, declared) then (to, declared)
+
+	(*pair)[(*pairs)++] = (struct edge){ from, declared };
+	(*pair)[(*pairs)++] = (struct edge){ to, declared };
+	return 1;
+}
+
+void sys_self_test_dag_free(struct dag *dag)
+{
+	if (dag == NULL)
+		return;
+
+	pthread_mutex_destroy(&dag->lock);
+	pthread_cond_destroy(&dag->wake);
+	free(dag->node);
+	free(dag->edge);
+	free(dag->heap);
+	free(dag);
+}
+
+// Build the graph of the linked tests; return NULL when no dependency is
+// declared or the graph cannot be built
+
+struct dag *sys_self_test_dag_build(struct pool *pool)
+{
+	const struct self_test_depends **depends;
+	struct outcome failed = { .status = STATUS_FAIL };
+	const struct catalog_entry *entry;
+	const struct self_test *test;
+	struct edge *pair = NULL;
+	struct dag *dag = NULL;
+	struct node *node;
+	unsigned char *mark = NULL;
+	size_t *work = NULL, *count = NULL;
+	size_t tests, nodes, pairs = 0, capacity = 0, level, slot, n, m, i;
+	const char *p, *end;
+	char buffer[256], name[128];
+	int ok = 0;
+
+	if (sys_self_test_depends_start == NULL ||
+		sys_self_test_depends_stop - sys_self_test_depends_start == 0)
+		return NULL;
+
+	for (tests = 0, level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+		tests += sys_self_test_level_count(level);
+	nodes = tests + SELF_TEST_LEVEL_COUNT;
+
+	dag = (struct dag *)calloc(1, sizeof(*dag));
+	if (dag == NULL)
+		goto done;
+
+	pthread_mutex_init(&dag->lock, NULL);
+	pthread_cond_init(&dag->wake, NULL);
+
+	dag->tests = tests;
+	dag->remaining = tests;
+	dag->node = (struct node *)calloc(nodes, sizeof(*dag->node));
+	dag->heap = (size_t *)calloc(tests + 1, sizeof(*dag->heap));
+	count = (size_t *)calloc(nodes + 1, sizeof(*count));
+	mark = (unsigned char *)calloc(nodes, 1);
+	work = (size_t *)calloc(5 * nodes, sizeof(*work));
+	if (dag->node == NULL || dag->heap == NULL || count == NULL ||
+		mark == NULL || work == NULL)
+		goto done;
+
+	for (level = 0; level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		node = &dag->node[tests + level];
+		node->level = level;
+		node->slot = SIZE_MAX;
+
+		for (slot = 0; slot < sys_self_test_level_count(level); ++slot)
+		{
+			n = sys_self_test_ordinal(level, slot) - 1;
+			dag->node[n].level = level;
+			dag->node[n].slot = slot;
+		}
+	}
+
+	// Declared edges; the names are separated by commas and spaces
+
+	for (depends = sys_self_test_depends_start;
+		depends < sys_self_test_depends_stop; ++depends)
+	{
+		n = dag_find((*depends)->name);
+		if (n == SIZE_MAX)
+			continue;
+
+		dag->node[n].declared = 1;
+
+		for (p = (*depends)->depends; *p != '\0'; p = end)
+		{
+			while (*p == ',' || *p == ' ' || *p == '\t')
+				++p;
+			for (end = p; *end != '\0' && *end != ',' && *end != ' ' &&
+				*end != '\t'; ++end)
+				;
+			if (end == p)
+				continue;
+
+			snprintf(name, sizeof(name), "%.*s", (int)(end - p), p);
+			m = dag_find(name);
+
+			if (m == SIZE_MAX)
+			{
+				snprintf(buffer, sizeof(buffer), msg_dag_unknown,
+					(*depends)->name, name);
+				pool->report(buffer, NULL, 0);
+			}
+			else if (!dag_edge(&pair, &pairs, &capacity, m, n, 1))
+				goto done;
+			else if (dag->node[m].level > dag->node[n].level)
+				mark[n] = 1;
+		}
+	}
+
+	// Implicit edges: each test ends its level, unless it waits for a test
+	// of a higher level; a test without declared dependencies waits for the
+	// end of the level below, and each level end waits for the one below
+
+	for (n = 0; n < tests; ++n)
+	{
+		level = dag->node[n].level;
+
+		if (!mark[n] &&
+			!dag_edge(&pair, &pairs, &capacity, n, tests + level, 0))
+			goto done;
+		if (level > 0 && !dag->node[n].declared &&
+			!dag_edge(&pair, &pairs, &capacity, tests + level - 1, n, 0))
+			goto done;
+	}
+
+	for (level = 1; level < SELF_TEST_LEVEL_COUNT; ++level)
+		if (!dag_edge(&pair, &pairs, &capacity, tests + level - 1,
+			tests + level, 0))
+			goto done;
+
+	// Lay the edges out by source node
+
+	dag->edge = (struct edge *)calloc(pairs / 2 + 1, sizeof(*dag->edge));
+	if (dag->edge == NULL)
+		goto done;
+
+	for (i = 0; i < pairs; i += 2)
+		++count[pair[i].node];
+	for (n = 0, m = 0; n < nodes; ++n)
+	{
+		dag->node[n].first = m;
+		m += count[n];
+	}
+	for (i = 0; i < pairs; i += 2)
+	{
+		node = &dag->node[pair[i].node];
+		dag->edge[node->first + node->edges++] = pair[i + 1];
+		++dag->node[pair[i + 1].node].pending;
+	}
+
+	// Fail the tests of the cycles; once they are out of the graph, the
+	// rest of it is free of cycles
+
+	memset(mark, 0, nodes);
+	dag_cycles(dag, work, mark);
+
+	for (n = 0; n < tests; ++n)
+	{
+		if (!(mark[n] & DAG_CYCLE))
+			continue;
+
+		dag->node[n].finished = 1;
+
+		entry = sys_self_test_catalog_at(n + 1);
+		if (entry != NULL && !sys_self_test_selected(entry))
+		{
+			++pool->skipped;
+			continue;
+		}
+
+		test = dag_test(dag, n);
+		snprintf(buffer, sizeof(buffer), msg_dag_cycle,
+			sys_self_test_name(test));
+		pool->report(buffer, NULL, 0);
+		sys_self_test_output_test(sys_self_test_name(test),
+			dag->node[n].level, &failed);
+		sys_self_test_module_record(sys_self_test_name(test), &failed);
+		pool->rc = 0;
+		if (pool->flags & SELF_TEST_FLAG_STOP_ON_FAILURE)
+			pool->stop = 1;
+	}
+
+	// In a deferred run, take out the tests that finished before it as
+	// well; mark now tells them from the tests of a cycle
+
+	memset(mark, 0, nodes);
+	for (n = 0; n < tests; ++n)
+	{
+		if (!dag->node[n].finished && (pool->done != NULL &&
+			pool->done_tests == tests ? pool->done[n] :
+			dag->node[n].level < pool->first_level))
+		{
+			dag->node[n].finished = 1;
+			mark[n] = 1;
+		}
+	}
+
+	// Release the nodes that wait for nothing, then the nodes that only
+	// waited for the tests taken out
+
+	for (n = 0; n < nodes; ++n)
+	{
+		node = &dag->node[n];
+		if (node->pending == 0 && !node->finished)
+		{
+			if (node->slot == SIZE_MAX)
+				dag_settle(dag, n, 1);
+			else
+				dag_push(dag, n);
+		}
+	}
+
+	for (n = 0; n < tests; ++n)
+		if (dag->node[n].finished)
+			dag_settle(dag, n, mark[n]);
+
+	ok = 1;
+
+done:
+	free(pair);
+	free(count);
+	free(mark);
+	free(work);
+
+	if (!ok && dag != NULL)
+	{
+		pool->report(msg_dag_memory, NULL, 0);
+		sys_self_test_dag_free(dag);
+		dag = NULL;
+	}
+
+	return dag;
+}
+
+// Whether the time budget holds back the first of the ready tests: once
+// the budget is spent, only the tests of the first level start.  Called
+// with the lock held.
+
+static int dag_late(const struct pool *pool)
+{
+	const struct dag *dag = pool->dag;
+
+	return pool->deadline_ns != 0 && dag->ready > 0 &&
+		dag->node[dag->heap[0]].level > pool->first_level &&
+		clock_ns(CLOCK_MONOTONIC) >= pool->deadline_ns;
+}
+
+// Take the next test that has to run, settling the tests that are skipped
+// on the way.  Without wait, return SIZE_MAX as soon as no test can start;
+// with wait, only once no test is left, the run is stopped, or the budget
+// is spent and the tests running have finished.
+
+size_t sys_self_test_dag_next(struct pool *pool, int wait)
+{
+	struct dag *dag = pool->dag;
+	const struct self_test *test;
+	struct outcome outcome = { .status = STATUS_SKIP };
+	const struct catalog_entry *entry;
+	struct node *node;
+	char buffer[256];
+	size_t n;
+	int late, stop;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&dag->lock);
+
+		for (;;)
+		{
+			late = dag_late(pool);
+			stop = __atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE);
+
+			if ((dag->ready > 0 && !late) || stop || !wait ||
+				dag->remaining == 0 || (late && dag->running == 0))
+				break;
+
+			pthread_cond_wait(&dag->wake, &dag->lock);
+		}
+
+		n = SIZE_MAX;
+		if (dag->ready > 0 && !late && !stop)
+		{
+			n = dag_pop(dag);
+			++dag->running;
+		}
+
+		pthread_mutex_unlock(&dag->lock);
+
+		if (n == SIZE_MAX)
+			return n;
+
+		node = &dag->node[n];
+		test = dag_test(dag, n);
+		entry = sys_self_test_catalog_at(n + 1);
+
+		// A test left out of the selection passes a failure on
+
+		if (entry != NULL && !sys_self_test_selected(entry))
+		{
+			__atomic_fetch_add(&pool->skipped, 1, __ATOMIC_RELAXED);
+			sys_self_test_dag_finish(pool, n, node->blocker == NULL);
+		}
+		else if (node->blocker != NULL)
+		{
+			sys_self_test_begin(n + 1);
+			snprintf(buffer, sizeof(buffer), msg_dag_blocked,
+				sys_self_test_name(test), sys_self_test_name(node->blocker));
+			pool->report(buffer, NULL, 0);
+			sys_self_test_output_test(sys_self_test_name(test), node->level,
+				&outcome);
+			sys_self_test_module_record(sys_self_test_name(test), &outcome);
+			sys_self_test_end(n + 1);
+
+			__atomic_fetch_add(&pool->skipped, 1, __ATOMIC_RELAXED);
+			sys_self_test_dag_finish(pool, n, 0);
+		}
+		else if (sys_self_test_pool_skip(pool, node->level, node->slot))
+		{
+			sys_self_test_dag_finish(pool, n, 1);
+		}
+		else
+		{
+			return n;
+		}
+	}
+}
+
+void sys_self_test_dag_run(struct pool *pool)
+{
+	struct node *node;
+	size_t n;
+	int passed;
+
+	while ((n = sys_self_test_dag_next(pool, 1)) != SIZE_MAX)
+	{
+		node = &pool->dag->node[n];
+		passed = sys_self_test_pool_run(pool, node->level, n + 1,
+			dag_test(pool->dag, n));
+		sys_self_test_dag_finish(pool, n, passed);
+	}
+}
+
+//
+// Count the tests of a graph that did not finish, note in done those that
+// did, and set the first level left over for the deferred run.
+//
+size_t sys_self_test_dag_defer(struct pool *pool, unsigned char *done)
+{
+	const struct dag *dag = pool->dag;
+	size_t n;
+
+	pool->deferred = SELF_TEST_LEVEL_COUNT;
+
+	for (n = 0; n < dag->tests; ++n)
+	{
+		if (dag->node[n].finished)
+		{
+			if (done != NULL)
+				done[n] = 1;
+		}
+		else if (dag->node[n].level < pool->deferred)
+			pool->deferred = dag->node[n].level;
+	}
+
+	return dag->remaining;
+}
+
+//
+// Building linux_selftest_dag.c with SELF_TEST_RUNNER_TESTS adds the tests of
+// the runner itself to the program.  They exercise its internals on the
+// tests of the program, so they are left out of the programs that merely
+// link the runner.
+//
+// With the budget spent from the start, a graph only starts the tests of
+// the first level, and leaves the tests of every other level to the
+// deferred run.  Without a declared dependency there is no graph to check.
+//
+
+#if defined(SELF_TEST_RUNNER_TESTS)
+SELF_TEST(runner_budget, SELF_TEST_LEVEL_1)
+{
+	struct pool pool = { .gate = PTHREAD_MUTEX_INITIALIZER };
+	unsigned char *done = NULL;
+	size_t level, count, first, n;
+	int rc = 0;
+
+	pool.report = self_test_report;
+	pool.flags = SELF_TEST_FLAG_FORCE;
+	pool.last_level = SELF_TEST_LEVEL_COUNT;
+	pool.deadline_ns = 1;
+
+	pool.dag = sys_self_test_dag_build(&pool);
+	if (pool.dag == NULL && (sys_self_test_depends_start == NULL ||
+		sys_self_test_depends_stop - sys_self_test_depends_start == 0))
+	{
+		rc = 1;
+		goto failure;
+	}
+	SELF_TEST_ASSERT(pool.dag != NULL);
+
+	while ((n = sys_self_test_dag_next(&pool, 0)) != SIZE_MAX)
+	{
+		SELF_TEST_ASSERT(pool.dag->node[n].level == 0);
+		sys_self_test_dag_finish(&pool, n, 1);
+	}
+
+	for (count = 0, first = SELF_TEST_LEVEL_COUNT, level = 1;
+		level < SELF_TEST_LEVEL_COUNT; ++level)
+	{
+		count += sys_self_test_level_count(level);
+		if (sys_self_test_level_count(level) != 0 &&
+			first == SELF_TEST_LEVEL_COUNT)
+			first = level;
+	}
+
+	done = (unsigned char *)calloc(pool.dag->tests + 1, 1);
+	SELF_TEST_ASSERT(done != NULL);
+	SELF_TEST_ASSERT(sys_self_test_dag_defer(&pool, done) == count);
+	SELF_TEST_ASSERT(pool.deferred == first);
+
+	for (n = 0; n < pool.dag->tests; ++n)
+		SELF_TEST_ASSERT(done[n] == (pool.dag->node[n].level == 0));
+
+	rc = 1;
+
+failure:
+	free(done);
+	sys_self_test_dag_free(pool.dag);
+	return rc;
+}
+#endif
+
+#endif /* LINUX_SELFTEST_H */
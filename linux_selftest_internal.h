@@ -0,0 +1,308 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+#ifndef LINUX_SELFTEST_INTERNAL_H
+#define LINUX_SELFTEST_INTERNAL_H
+
+/*
+
+Internals of the Linux runner.
+
+The runner is split by concern into translation units that share the
+definitions below; none of them is part of the interface of the framework.
+
+	linux_selftest.c = catalog, shared objects, fixtures, test runner,
+		isolated, deferred and asynchronous runs, release, benchmarks
+	linux_selftest_cache.c = result cache
+	linux_selftest_perf.c = performance assertions and their baselines
+	linux_selftest_output.c = machine-readable output
+	linux_selftest_dag.c = dependency scheduler
+	linux_selftest_report.c = buffered reporting channel
+
+Functions shared between them carry the sys_self_test_ prefix; everything
+else stays static to its file.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SELF_TEST_LEVEL_COUNT 10
+
+// Code, benchmark and baseline name section bounds; weak so that a program
+// without any of them still links
+
+extern const char __start_slftst_txt[] __attribute__((__weak__));
+extern const char __stop_slftst_txt[] __attribute__((__weak__));
+
+extern const struct self_bench *__start_slftst_bench[] __attribute__((__weak__));
+extern const struct self_bench *__stop_slftst_bench[] __attribute__((__weak__));
+
+extern const char *__start_slftst_perf[] __attribute__((__weak__));
+extern const char *__stop_slftst_perf[] __attribute__((__weak__));
+
+// Dependencies of the program and of the shared objects
+
+extern const struct self_test_depends **sys_self_test_depends_start;
+extern const struct self_test_depends **sys_self_test_depends_stop;
+
+static inline uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline double ms(uint64_t ns)
+{
+	return (double)ns / 1e6;
+}
+
+// FNV-1a
+
+#define HASH_INIT 14695981039346656037u
+
+static inline uint64_t hash_bytes(uint64_t hash, const void *data,
+	size_t size)
+{
+	const unsigned char *byte = (const unsigned char *)data;
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+	{
+		hash ^= byte[i];
+		hash *= 1099511628211u;
+	}
+
+	return hash;
+}
+
+static inline int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+// Scale the iteration count of a sample that took elapsed nanoseconds
+// toward the target, growing at least twofold and at most a hundredfold
+// at a time, and aiming a little past the target to converge in one step
+
+static inline size_t sample_scale(size_t iterations, uint64_t elapsed,
+	uint64_t target)
+{
+	size_t scaled;
+
+	scaled = (elapsed == 0) ? iterations * 100 :
+		(size_t)((double)iterations * 1.2 * (double)target / (double)elapsed);
+	if (scaled < iterations * 2)
+		scaled = iterations * 2;
+	if (scaled > iterations * 100)
+		scaled = iterations * 100;
+
+	return scaled;
+}
+
+// Tests are numbered from one, level after level
+
+extern size_t sys_self_test_level_count(size_t level);
+extern size_t sys_self_test_ordinal(size_t level, size_t slot);
+extern const struct self_test *sys_self_test_level_test(size_t level,
+	size_t slot);
+extern const char *sys_self_test_name(const struct self_test *test);
+
+//
+// Test catalog.
+//
+
+struct catalog_entry
+{
+	const char			*name;
+	uint64_t			hash;		// Hash of the name
+	size_t				level;
+	size_t				slot;
+	size_t				ordinal;
+	size_t				budget;		// Peak of the live bytes; 0 unbounded
+	size_t				module;		// 0 for the program
+};
+
+extern const struct catalog_entry *sys_self_test_catalog_find(
+	const char *name);
+extern const struct catalog_entry *sys_self_test_catalog_at(size_t ordinal);
+extern int sys_self_test_selected(const struct catalog_entry *entry);
+
+//
+// Outcome of a test.
+//
+
+struct counters
+{
+	uint32_t			hardware;	// Whether the hardware counts are valid
+	uint32_t			reserved;
+	uint64_t			instructions;
+	uint64_t			cycles;
+	uint64_t			cache_misses;
+	uint64_t			branch_misses;
+	uint64_t			page_faults;
+	uint64_t			switches;	// Context switches; rusage only
+};
+
+struct heap_usage
+{
+	size_t				allocations;	// Allocations made by the test
+	size_t				bytes;			// Bytes allocated by the test
+	size_t				peak_bytes;		// Peak over the live bytes at start
+	size_t				leaks;			// Allocations left behind
+};
+
+enum { STATUS_PASS, STATUS_FAIL, STATUS_CACHED, STATUS_SKIP };
+
+struct outcome
+{
+	int						status;		// STATUS_*
+	uint64_t				wall_ns;
+	const struct heap_usage	*heap;		// NULL unless measured
+	const char				*file;		// Last location reported by the
+	size_t					line;		// test; NULL without one
+	const struct counters	*counters;	// NULL unless counting
+};
+
+// Count the outcome of a test toward the results of its module
+
+extern void sys_self_test_module_record(const char *name,
+	const struct outcome *outcome);
+
+//
+// Test runner.
+//
+
+struct result
+{
+	const struct self_test	*test;
+	size_t					level;
+	int						passed;
+	uint64_t				start_ns;	// Monotonic clock at test start
+	uint64_t				wall_ns;	// Elapsed wall time
+	uint64_t				cpu_ns;		// CPU time of the running thread
+	struct counters			counters;	// With SELF_TEST_FLAG_COUNTERS
+};
+
+struct pool
+{
+	self_test_report_pf	report;
+	unsigned			flags;
+	pthread_mutex_t		gate;		// Held while the pool is created
+	pthread_barrier_t	barrier;
+	size_t				threads;
+	size_t				next[SELF_TEST_LEVEL_COUNT];	// Next slot to claim
+	size_t				test_count;	// Tests started; indexes the results
+	size_t				cached;		// Tests skipped as passed earlier
+	size_t				skipped;	// Tests left out of the selection
+	struct result		*result;	// One per test when timing
+	struct dag			*dag;		// Dependency graph; NULL by level
+	size_t				first_level;	// Levels run, first to last excluded
+	size_t				last_level;
+	const unsigned char	*done;		// Tests finished before a deferred
+	size_t				done_tests;	// run, by ordinal - 1; NULL for none
+	uint64_t			deadline_ns;	// End of the time budget; 0 for none
+	size_t				deferred;	// First level left over; 0 for none
+	self_test_heap_pf	heap;		// Statistics of the heap checks
+	self_test_blocks_pf	blocks;
+	int					rc;
+	int					stop;
+	int					abort;		// Pool could not be set up
+};
+
+extern int sys_self_test_pool_run(struct pool *pool, size_t level,
+	size_t ordinal, const struct self_test *test);
+extern int sys_self_test_pool_skip(struct pool *pool, size_t level,
+	size_t slot);
+
+//
+// Dependency scheduler.
+//
+
+struct node
+{
+	size_t				level;
+	size_t				slot;		// SIZE_MAX for the end of a level
+	size_t				pending;	// Nodes still to finish before this one
+	size_t				first;		// Outgoing edges, in dag->edge
+	size_t				edges;
+	int					declared;	// Dependencies were declared
+	int					finished;
+	const struct self_test	*blocker;	// Failed dependency; NULL for none
+};
+
+struct dag
+{
+	struct node			*node;		// Tests by ordinal - 1, then level ends
+	size_t				tests;
+	struct edge			*edge;
+	size_t				*heap;		// Ready tests, by ordinal
+	size_t				ready;
+	size_t				remaining;	// Tests not finished yet
+	size_t				running;	// Tests taken and not finished yet
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+};
+
+extern struct dag *sys_self_test_dag_build(struct pool *pool);
+extern void sys_self_test_dag_free(struct dag *dag);
+extern size_t sys_self_test_dag_next(struct pool *pool, int wait);
+extern void sys_self_test_dag_finish(struct pool *pool, size_t n, int passed);
+extern void sys_self_test_dag_run(struct pool *pool);
+extern size_t sys_self_test_dag_defer(struct pool *pool, unsigned char *done);
+
+//
+// Result cache.
+//
+
+extern void sys_self_test_cache_open(self_test_report_pf report);
+extern void sys_self_test_cache_close(void);
+extern int sys_self_test_cache_passed(size_t ordinal);
+extern void sys_self_test_cache_record(size_t ordinal, int passed);
+
+//
+// Performance assertions.
+//
+
+extern void sys_self_test_baseline_open(self_test_report_pf report,
+	unsigned flags);
+extern void sys_self_test_baseline_close(void);
+
+//
+// Machine-readable output.
+//
+
+extern void sys_self_test_output_open(self_test_report_pf report);
+extern void sys_self_test_output_end(void);
+extern int sys_self_test_output_active(void);
+extern void sys_self_test_output_test(const char *name, size_t level,
+	const struct outcome *outcome);
+
+#endif /* LINUX_SELFTEST_INTERNAL_H */
@@ -0,0 +1,440 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "linux_selftest_internal.h"
+
+//
+// Machine-readable output.
+//
+// With self_test_options.output_format set, one record is written for each
+// test as soon as it finishes, in JSON Lines or in TAP.  A record carries
+// the name and level of the test, its status, its wall time, the location
+// of the last message it reported with a file when it failed, its heap
+// figures when self_test_options.heap is set, and its performance
+// counters with SELF_TEST_FLAG_COUNTERS.  Each record
+// is written with a single write(2) on a descriptor opened once per
+// process, so the records written before a crash are never lost and the
+// deferred and isolated runs add to the same stream.
+//
+// The stream is opened once, with the TAP header, by the process of the
+// first run, which owns it.  Every process writing records to it, such as
+// the forked children of the deferred, asynchronous and isolated runs,
+// shares a lock and the count of records through an anonymous shared
+// mapping, so TAP numbers the tests of all the runs in the order they
+// finish.  The owner writes the single plan as it exits, after which no
+// other record is written.
+//
+// Without a path the records go to standard output, which the program may
+// be writing through stdio as well; its buffer is flushed before each
+// record and before the plan so that the two keep their order.
+//
+// A record is formatted in a fixed buffer.  Its strings, the name and the
+// file of the test, are cut short within their quotes when they are too
+// long, so that a record always reads as valid JSON or YAML.
+//
+
+#define SELF_TEST_RECORD_SIZE	2048	// Bytes of a record
+#define SELF_TEST_RECORD_STRING	512		// Bytes of a string in a record
+
+static const char *const status_name[] = { "pass", "fail", "cached", "skip" };
+
+struct output_shared
+{
+	pthread_mutex_t	lock;		// Held while writing a record
+	size_t			count;		// Records written to the stream
+	int				ended;		// Set once the plan is written
+};
+
+static int s_output_fd = -1;
+static pid_t s_output_owner = 0;		// Process that opened the stream
+static struct output_shared *s_output_shared;
+static struct output_shared s_output_private = {
+	.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char SELF_TEST_RO msg_output_open[] =
+	"self-test: warning: cannot open self-test output %s";
+
+//
+// Append a quoted string to a record, with JSON escapes or as a YAML
+// single-quoted scalar.  A string whose escaped form would take more than
+// SELF_TEST_RECORD_STRING bytes is cut short and ends with an ellipsis;
+// the closing quote is always written.
+//
+static size_t record_string(char *buffer, size_t size, size_t used,
+	const char *string, int json)
+{
+	static const char hex[] = "0123456789abcdef";
+	char quote = json ? '"' : '\'';
+	size_t end;
+	unsigned char c;
+
+	if (used + SELF_TEST_RECORD_STRING + 2 > size)
+		return size;
+
+	end = used + 1 + SELF_TEST_RECORD_STRING - 3;
+	buffer[used++] = quote;
+
+	for (; *string != '\0'; ++string)
+	{
+		c = (unsigned char)*string;
+
+		if (used + 6 > end)
+		{
+			memcpy(buffer + used, "...", 3);
+			used += 3;
+			break;
+		}
+
+		if (json && (c == '"' || c == '\\'))
+		{
+			buffer[used++] = '\\';
+			buffer[used++] = (char)c;
+		}
+		else if (json && c < 0x20)
+		{
+			memcpy(buffer + used, "\\u00", 4);
+			buffer[used + 4] = hex[c >> 4];
+			buffer[used + 5] = hex[c & 15];
+			used += 6;
+		}
+		else if (!json && c == '\'')
+		{
+			buffer[used++] = '\'';
+			buffer[used++] = '\'';
+		}
+		else
+		{
+			// YAML takes no control character in a quoted scalar
+
+			buffer[used++] = !json && c < 0x20 ? '?' : (char)c;
+		}
+	}
+
+	buffer[used++] = quote;
+	return used;
+}
+
+// Append formatted text to a record, saturating at its size
+
+static size_t record_printf(char *buffer, size_t size, size_t used,
+	const char *format, ...) __attribute__((__format__(__printf__, 4, 5)));
+
+static size_t record_printf(char *buffer, size_t size, size_t used,
+	const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	if (used >= size)
+		return size;
+
+	va_start(args, format);
+	length = vsnprintf(buffer + used, size - used, format, args);
+	va_end(args);
+
+	if (length < 0 || (size_t)length >= size - used)
+		return size;
+	return used + (size_t)length;
+}
+
+static void output_write(const char *buffer, size_t length)
+{
+	ssize_t written;
+
+	if (s_output_fd == STDOUT_FILENO)
+		fflush(stdout);
+
+	while (length > 0)
+	{
+		written = write(s_output_fd, buffer, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		buffer += written;
+		length -= (size_t)written;
+	}
+}
+
+// Share the lock and the count with the processes forked from now on;
+// without a shared mapping, they are only shared by the threads
+
+static void output_share(void)
+{
+	pthread_mutexattr_t attr;
+	void *shared;
+
+	s_output_shared = &s_output_private;
+
+	shared = mmap(NULL, sizeof(*s_output_shared), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		return;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+	if (pthread_mutex_init(&((struct output_shared *)shared)->lock,
+		&attr) == 0)
+		s_output_shared = (struct output_shared *)shared;
+	else
+		munmap(shared, sizeof(*s_output_shared));
+
+	pthread_mutexattr_destroy(&attr);
+}
+
+// An isolated test killed while writing leaves the lock to the next writer
+
+static void output_lock(void)
+{
+	if (pthread_mutex_lock(&s_output_shared->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&s_output_shared->lock);
+}
+
+static void output_unlock(void)
+{
+	pthread_mutex_unlock(&s_output_shared->lock);
+}
+
+//
+// Write the TAP plan, once, from the process that owns the stream.  It is
+// called at exit, and before a forked child that owns the stream leaves.
+//
+void sys_self_test_output_end(void)
+{
+	char buffer[64];
+	size_t length;
+
+	if (s_output_fd < 0 || s_output_owner != getpid())
+		return;
+
+	output_lock();
+
+	if (!s_output_shared->ended &&
+		self_test_options.output_format == SELF_TEST_OUTPUT_TAP)
+	{
+		length = (size_t)snprintf(buffer, sizeof(buffer), "1..%zu\n",
+			s_output_shared->count);
+		output_write(buffer, length);
+	}
+
+	s_output_shared->ended = 1;
+	output_unlock();
+}
+
+void sys_self_test_output_open(self_test_report_pf report)
+{
+	static int registered = 0;
+	const char *path = self_test_options.output_path;
+	char buffer[512];
+	size_t length;
+
+	if (self_test_options.output_format == SELF_TEST_OUTPUT_TEXT ||
+		s_output_fd >= 0)
+		return;
+
+	if (path == NULL)
+		s_output_fd = STDOUT_FILENO;
+	else
+		s_output_fd = open(path,
+			O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if (s_output_fd < 0)
+	{
+		snprintf(buffer, sizeof(buffer), msg_output_open, path);
+		report(buffer, NULL, 0);
+		return;
+	}
+
+	output_share();
+	s_output_owner = getpid();
+
+	if (!registered)
+	{
+		registered = 1;
+		atexit(sys_self_test_output_end);
+	}
+
+	if (self_test_options.output_format == SELF_TEST_OUTPUT_TAP)
+	{
+		length = (size_t)snprintf(buffer, sizeof(buffer), "TAP version 13\n");
+		output_write(buffer, length);
+	}
+}
+
+static size_t output_json(char *buffer, size_t size, const char *name,
+	size_t level, const struct outcome *outcome)
+{
+	const struct counters *counters = outcome->counters;
+	size_t used;
+
+	used = record_printf(buffer, size, 0, "{\"name\":");
+	used = record_string(buffer, size, used, name, 1);
+	used = record_printf(buffer, size, used,
+		",\"level\":%zu,\"status\":\"%s\",\"duration_ms\":%.3f",
+		level + 1, status_name[outcome->status], ms(outcome->wall_ns));
+
+	if (outcome->file != NULL)
+	{
+		used = record_printf(buffer, size, used, ",\"file\":");
+		used = record_string(buffer, size, used, outcome->file, 1);
+		used = record_printf(buffer, size, used, ",\"line\":%zu",
+			outcome->line);
+	}
+
+	if (outcome->heap != NULL)
+		used = record_printf(buffer, size, used,
+			",\"allocations\":%zu,\"bytes\":%zu,\"peak_bytes\":%zu"
+			",\"leaks\":%zu", outcome->heap->allocations,
+			outcome->heap->bytes, outcome->heap->peak_bytes,
+			outcome->heap->leaks);
+
+	if (counters != NULL && counters->hardware)
+		used = record_printf(buffer, size, used,
+			",\"instructions\":%llu,\"cycles\":%llu,\"cache_misses\":%llu"
+			",\"branch_misses\":%llu,\"page_faults\":%llu",
+			(unsigned long long)counters->instructions,
+			(unsigned long long)counters->cycles,
+			(unsigned long long)counters->cache_misses,
+			(unsigned long long)counters->branch_misses,
+			(unsigned long long)counters->page_faults);
+	else if (counters != NULL)
+		used = record_printf(buffer, size, used,
+			",\"page_faults\":%llu,\"context_switches\":%llu",
+			(unsigned long long)counters->page_faults,
+			(unsigned long long)counters->switches);
+
+	return record_printf(buffer, size, used, "}\n");
+}
+
+static size_t output_tap(char *buffer, size_t size, size_t number,
+	const char *name, size_t level, const struct outcome *outcome)
+{
+	const struct counters *counters = outcome->counters;
+	size_t used;
+
+	used = record_printf(buffer, size, 0, "%s %zu - %s%s\n",
+		outcome->status == STATUS_FAIL ? "not ok" : "ok", number, name,
+		outcome->status == STATUS_CACHED ? " # SKIP cached" :
+		outcome->status == STATUS_SKIP ? " # SKIP dependency failed" : "");
+
+	used = record_printf(buffer, size, used,
+		"  ---\n  level: %zu\n  duration_ms: %.3f\n",
+		level + 1, ms(outcome->wall_ns));
+
+	if (outcome->file != NULL)
+	{
+		used = record_printf(buffer, size, used, "  file: ");
+		used = record_string(buffer, size, used, outcome->file, 0);
+		used = record_printf(buffer, size, used, "\n  line: %zu\n",
+			outcome->line);
+	}
+
+	if (outcome->heap != NULL)
+		used = record_printf(buffer, size, used,
+			"  allocations: %zu\n  bytes: %zu\n  peak_bytes: %zu\n"
+			"  leaks: %zu\n", outcome->heap->allocations,
+			outcome->heap->bytes, outcome->heap->peak_bytes,
+			outcome->heap->leaks);
+
+	if (counters != NULL && counters->hardware)
+		used = record_printf(buffer, size, used,
+			"  instructions: %llu\n  cycles: %llu\n  cache_misses: %llu\n"
+			"  branch_misses: %llu\n  page_faults: %llu\n",
+			(unsigned long long)counters->instructions,
+			(unsigned long long)counters->cycles,
+			(unsigned long long)counters->cache_misses,
+			(unsigned long long)counters->branch_misses,
+			(unsigned long long)counters->page_faults);
+	else if (counters != NULL)
+		used = record_printf(buffer, size, used,
+			"  page_faults: %llu\n  context_switches: %llu\n",
+			(unsigned long long)counters->page_faults,
+			(unsigned long long)counters->switches);
+
+	return record_printf(buffer, size, used, "  ...\n");
+}
+
+// Whether the records of this process go to a stream
+
+int sys_self_test_output_active(void)
+{
+	return s_output_fd >= 0;
+}
+
+void sys_self_test_output_test(const char *name, size_t level,
+	const struct outcome *outcome)
+{
+	char buffer[SELF_TEST_RECORD_SIZE];
+	size_t length, number;
+
+	if (s_output_fd < 0)
+		return;
+
+	// Keep the TAP numbers in the order of the records, and write none
+	// after the plan
+
+	output_lock();
+	if (s_output_shared->ended)
+	{
+		output_unlock();
+		return;
+	}
+	number = ++s_output_shared->count;
+
+	if (self_test_options.output_format == SELF_TEST_OUTPUT_JSON)
+		length = output_json(buffer, sizeof(buffer), name, level, outcome);
+	else
+		length = output_tap(buffer, sizeof(buffer), number, name, level,
+			outcome);
+
+	// The strings are bounded so that every record fits; should one not,
+	// keep its line ending
+
+	if (length >= sizeof(buffer))
+	{
+		length = sizeof(buffer) - 1;
+		buffer[length - 1] = '\n';
+	}
+
+	output_write(buffer, length);
+	output_unlock();
+}
+
+#endif /* LINUX_SELFTEST_H */
@@ -0,0 +1,427 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "linux_selftest_internal.h"
+
+//
+// Performance assertions.
+//
+// SELF_TEST_PERF_ASSERT() measures the code it is given and compares the
+// time of one run of it against a baseline kept in the file named by
+// self_test_options.baseline_path.  The code is run in samples whose
+// iteration count is calibrated like a benchmark's, though shorter, after
+// a few warm-up samples.  Samples further from the median than three
+// times the scaled median absolute deviation are rejected as noise, such
+// as a preemption or a migration on a busy host, and the mean of the rest
+// is the measurement.  A measurement over the baseline by more than the
+// tolerance of the assertion fails the test.
+//
+// The file holds a header and an open-addressed table with one entry per
+// baseline, keyed by a hash of its name.  It is only read when checking;
+// no baseline file, or no baseline of the name, lets the assertion pass
+// without running the code.  With SELF_TEST_FLAG_RECORD_BASELINE, every
+// assertion measures its code and records the result instead.  The file
+// is then mapped shared and laid out again for the baselines linked into
+// the program, so that worker processes record in place and the baselines
+// of tests that did not run are kept.
+//
+// Baselines are not tied to a build, since the point is to compare builds,
+// but they are to a kind of host: record them where they are checked.
+//
+
+#define SELF_TEST_BASELINE_MAGIC "slftstp1"
+#define SELF_TEST_PERF_TARGET_NS	1000000u	// Duration of one sample
+#define SELF_TEST_PERF_WARMUP		2			// Samples discarded
+
+enum { PERF_START, PERF_CALIBRATE, PERF_WARMUP, PERF_SAMPLE, PERF_DONE };
+
+struct baseline_header
+{
+	char				magic[8];
+	uint32_t			capacity;	// Entries in the table; a power of two
+	uint32_t			reserved;
+};
+
+struct baseline_entry
+{
+	uint64_t			key;		// Hash of the name; zero when free
+	double				ns_per_op;
+};
+
+struct baseline
+{
+	struct baseline_header	*header;	// Mapping of the file; NULL when off
+	size_t				size;		// Bytes mapped
+	int					record;		// SELF_TEST_FLAG_RECORD_BASELINE
+};
+
+static struct baseline s_baseline;
+
+static const char SELF_TEST_RO msg_baseline_open[] =
+	"self-test: warning: cannot use baseline file %s";
+static const char SELF_TEST_RO msg_baseline_full[] =
+	"self-test: warning: no room to record baseline %s";
+static const char SELF_TEST_RO msg_baseline_missing[] =
+	"warning: self-test has no baseline %s; not checked";
+static const char SELF_TEST_RO msg_baseline_recorded[] =
+	"self-test: info: baseline %s: %.2f ns/op from %d of %d samples";
+static const char SELF_TEST_RO msg_perf_failed[] =
+	"error: self-test perf regression: %s at %.2f ns/op, baseline %.2f "
+	"ns/op, tolerance %g%%";
+
+// Baseline name section bounds; weak so that a program without any
+// performance assertion still links
+
+extern const char *__start_slftst_perf[] __attribute__((__weak__));
+extern const char *__stop_slftst_perf[] __attribute__((__weak__));
+
+static uint64_t baseline_key(const char *name)
+{
+	uint64_t key = hash_bytes(HASH_INIT, name, strlen(name));
+
+	return key != 0 ? key : 1;
+}
+
+// Find the entry of a baseline, or claim a free one for it when recording
+
+static struct baseline_entry *baseline_find(const char *name, int claim)
+{
+	struct baseline_entry *table, *entry;
+	uint64_t key = baseline_key(name), seen;
+	uint32_t mask, i, probes;
+
+	if (s_baseline.header == NULL)
+		return NULL;
+
+	table = (struct baseline_entry *)(s_baseline.header + 1);
+	mask = s_baseline.header->capacity - 1;
+
+	for (i = (uint32_t)key & mask, probes = 0; probes <= mask;
+		i = (i + 1) & mask, ++probes)
+	{
+		entry = &table[i];
+		seen = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+		if (seen == key)
+			return entry;
+		if (seen != 0)
+			continue;
+		if (!claim)
+			return NULL;
+
+		// Another thread or worker may claim the entry first
+
+		if (__atomic_compare_exchange_n(&entry->key, &seen, key, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || seen == key)
+			return entry;
+	}
+
+	return NULL;
+}
+
+// Lay out a table with room for the baselines linked into the program and
+// those already in the file, and copy the entries of the file into it
+
+static int baseline_layout(int fd)
+{
+	struct baseline_header header, *mapping;
+	struct baseline_entry *old = NULL, *table;
+	size_t count, size, i;
+	uint32_t capacity, old_capacity = 0, j;
+	ssize_t got;
+
+	got = pread(fd, &header, sizeof(header), 0);
+	if (got == (ssize_t)sizeof(header) &&
+		!memcmp(header.magic, SELF_TEST_BASELINE_MAGIC, sizeof(header.magic))
+		&& header.capacity != 0 && (header.capacity & (header.capacity - 1)) == 0
+		&& header.capacity <= (1u << 24))
+	{
+		old_capacity = header.capacity;
+		old = (struct baseline_entry *)malloc(old_capacity * sizeof(*old));
+		if (old == NULL || pread(fd, old, old_capacity * sizeof(*old),
+			sizeof(header)) != (ssize_t)(old_capacity * sizeof(*old)))
+			old_capacity = 0;
+	}
+
+	count = __start_slftst_perf != NULL ?
+		(size_t)(__stop_slftst_perf - __start_slftst_perf) : 0;
+	for (j = 0; j < old_capacity; ++j)
+		count += old[j].key != 0;
+
+	for (capacity = 64; capacity < 2 * count; capacity *= 2)
+		;
+
+	size = sizeof(header) + (size_t)capacity * sizeof(*table);
+	if (ftruncate(fd, (off_t)size) != 0)
+	{
+		free(old);
+		return 0;
+	}
+
+	mapping = (struct baseline_header *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		free(old);
+		return 0;
+	}
+
+	memset(mapping, 0, size);
+	memcpy(mapping->magic, SELF_TEST_BASELINE_MAGIC, sizeof(mapping->magic));
+	mapping->capacity = capacity;
+	table = (struct baseline_entry *)(mapping + 1);
+
+	for (j = 0; j < old_capacity; ++j)
+	{
+		if (old[j].key == 0)
+			continue;
+
+		for (i = old[j].key & (capacity - 1); table[i].key != 0;
+			i = (i + 1) & (capacity - 1))
+			;
+		table[i] = old[j];
+	}
+
+	free(old);
+	s_baseline.header = mapping;
+	s_baseline.size = size;
+	return 1;
+}
+
+void sys_self_test_baseline_open(self_test_report_pf report, unsigned flags)
+{
+	struct baseline_header *header;
+	struct stat st;
+	char buffer[512];
+	int fd, ok;
+
+	s_baseline.record = (flags & SELF_TEST_FLAG_RECORD_BASELINE) != 0;
+
+	if (self_test_options.baseline_path == NULL)
+		return;
+
+	if (!s_baseline.record)
+	{
+		// Nothing to check against is not a failure
+
+		fd = open(self_test_options.baseline_path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*header);
+		header = ok ? (struct baseline_header *)mmap(NULL,
+			(size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+
+		if (header != MAP_FAILED && !memcmp(header->magic,
+			SELF_TEST_BASELINE_MAGIC, sizeof(header->magic)) &&
+			header->capacity != 0 &&
+			(header->capacity & (header->capacity - 1)) == 0 &&
+			sizeof(*header) + (size_t)header->capacity *
+			sizeof(struct baseline_entry) <= (size_t)st.st_size)
+		{
+			s_baseline.header = header;
+			s_baseline.size = (size_t)st.st_size;
+			return;
+		}
+
+		if (header != MAP_FAILED)
+			munmap(header, (size_t)st.st_size);
+	}
+	else
+	{
+		fd = open(self_test_options.baseline_path,
+			O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		ok = fd >= 0 && flock(fd, LOCK_EX) == 0 && baseline_layout(fd);
+		if (fd >= 0)
+		{
+			flock(fd, LOCK_UN);
+			close(fd);
+		}
+
+		if (ok)
+			return;
+	}
+
+	snprintf(buffer, sizeof(buffer), msg_baseline_open,
+		self_test_options.baseline_path);
+	report(buffer, NULL, 0);
+}
+
+void sys_self_test_baseline_close(void)
+{
+	if (s_baseline.header == NULL)
+		return;
+
+	munmap(s_baseline.header, s_baseline.size);
+	memset(&s_baseline, 0, sizeof(s_baseline));
+}
+
+int sys_self_test_perf_next(struct self_test_perf *perf)
+{
+	uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - perf->start_ns;
+
+	switch (perf->phase)
+	{
+	case PERF_START:
+		perf->iterations = 1;
+		perf->phase = s_baseline.header != NULL && (s_baseline.record ||
+			baseline_find(perf->name, 0) != NULL) ? PERF_CALIBRATE : PERF_DONE;
+		break;
+
+	case PERF_CALIBRATE:
+		if (elapsed < SELF_TEST_PERF_TARGET_NS)
+			perf->iterations = sample_scale(perf->iterations, elapsed,
+				SELF_TEST_PERF_TARGET_NS);
+		else
+			perf->phase = PERF_WARMUP;
+		break;
+
+	case PERF_WARMUP:
+		if (++perf->samples == SELF_TEST_PERF_WARMUP)
+		{
+			perf->samples = 0;
+			perf->phase = PERF_SAMPLE;
+		}
+		break;
+
+	case PERF_SAMPLE:
+		perf->sample[perf->samples++] =
+			(double)elapsed / (double)perf->iterations;
+		if (perf->samples == SELF_TEST_PERF_SAMPLES)
+			perf->phase = PERF_DONE;
+		break;
+	}
+
+	if (perf->phase == PERF_DONE)
+		return 0;
+
+	perf->start_ns = clock_ns(CLOCK_MONOTONIC);
+	return 1;
+}
+
+// Reject the samples too far from the median and average the rest;
+// return the number of samples kept
+
+static double distance(double a, double b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int perf_estimate(struct self_test_perf *perf, double *ns_per_op)
+{
+	double deviation[SELF_TEST_PERF_SAMPLES], median, limit, sum = 0;
+	int i, kept = 0;
+
+	qsort(perf->sample, perf->samples, sizeof(perf->sample[0]),
+		compare_double);
+	median = perf->sample[perf->samples / 2];
+
+	for (i = 0; i < perf->samples; ++i)
+		deviation[i] = distance(perf->sample[i], median);
+	qsort(deviation, perf->samples, sizeof(deviation[0]), compare_double);
+
+	// 1.4826 scales the median absolute deviation to a standard deviation
+
+	limit = 3 * 1.4826 * deviation[perf->samples / 2];
+
+	for (i = 0; i < perf->samples; ++i)
+	{
+		if (distance(perf->sample[i], median) <= limit)
+		{
+			sum += perf->sample[i];
+			++kept;
+		}
+	}
+
+	*ns_per_op = sum / kept;
+	return kept;
+}
+
+int sys_self_test_perf_check(struct self_test_perf *perf,
+	self_test_report_pf report, const char *file, size_t line)
+{
+	struct baseline_entry *entry;
+	double ns_per_op, baseline;
+	char buffer[320];
+	int kept;
+
+	if (perf->samples == 0)
+	{
+		// Not measured: there is no baseline to check against
+
+		if (self_test_options.baseline_path != NULL && !s_baseline.record)
+		{
+			snprintf(buffer, sizeof(buffer), msg_baseline_missing,
+				perf->name);
+			report(buffer, file, line);
+		}
+		return 1;
+	}
+
+	kept = perf_estimate(perf, &ns_per_op);
+
+	if (s_baseline.record)
+	{
+		entry = baseline_find(perf->name, 1);
+		if (entry == NULL)
+		{
+			snprintf(buffer, sizeof(buffer), msg_baseline_full, perf->name);
+			report(buffer, NULL, 0);
+			return 1;
+		}
+
+		__atomic_store(&entry->ns_per_op, &ns_per_op, __ATOMIC_RELAXED);
+		snprintf(buffer, sizeof(buffer), msg_baseline_recorded, perf->name,
+			ns_per_op, kept, perf->samples);
+		report(buffer, NULL, 0);
+		return 1;
+	}
+
+	entry = baseline_find(perf->name, 0);
+	if (entry == NULL)
+		return 1;
+
+	baseline = entry->ns_per_op;
+	if (ns_per_op <= baseline * (1 + perf->tolerance / 100))
+		return 1;
+
+	snprintf(buffer, sizeof(buffer), msg_perf_failed, perf->name, ns_per_op,
+		baseline, perf->tolerance);
+	report(buffer, file, line);
+	return 0;
+}
+
+#endif /* LINUX_SELFTEST_H */
@@ -0,0 +1,696 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "selftest.h"
+#if defined(LINUX_SELFTEST_H) && !defined(SELF_TEST_STRIP)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+/*
+
+Buffered reporting channel.
+
+sys_self_test_report_buffered() is a report function that never blocks on
+standard error.  Each message is copied into a fixed-size record of a
+bounded lock-free ring, along with its file, line, the ordinal of the
+test that reported it and the time on the monotonic clock it was reported
+at.  The time is written in front of the message, in seconds as the kernel
+log shows it, since the grouped output no longer tells when each message
+came in.  Any number of threads may report at the same time;
+they only contend on the atomic increment that hands out ring slots.
+
+A single drain thread empties the ring.  It keeps the records of each test
+aside until the runner marks the test as ended, and then writes the tests
+out in the order of their ordinals, which is the order in which the tests
+are laid out by level.  The output of a run is therefore grouped per test
+and identical from one run to the next whatever the number of threads.
+Messages reported outside of any test are written after the output of
+the tests that started before them.  Formatted output is accumulated and
+written to standard error in large batches with write(2).
+
+The ring follows Dmitry Vyukov's bounded queue: every cell carries a
+sequence number that tells producers when the cell is free and tells the
+consumer when it is filled.  A producer that finds the ring full yields
+until the drain thread catches up, so no message is ever dropped; this is
+the only time a reporting thread waits on the output.
+
+The drain thread sleeps on a condition variable while the ring is empty.
+A producer only takes the lock of the channel to wake it, when the drain
+thread has announced that it is about to sleep.
+
+sys_self_test_flush() waits until every message reported so far has been
+written.  self_test_run() calls it before returning, the channel calls it
+at exit, and the runners call it before forking so that a child does not
+inherit half-written output.  Once a flush leaves nothing behind, the drain
+thread stops; the next message starts another one.  Producers count
+themselves in while they use the ring, so the drain thread only stops
+after those that found it running are done.  A forked child starts a
+channel of its own on its first message.
+
+*/
+
+#define CHANNEL_CAPACITY	256		// Records in the ring; a power of two
+#define CHANNEL_OUTPUT		16384	// Bytes formatted before a write
+
+enum { ENTRY_MESSAGE, ENTRY_END };
+
+struct entry
+{
+	uint32_t		kind;		// ENTRY_MESSAGE or ENTRY_END
+	uint32_t		has_file;
+	size_t			test;		// Ordinal of the test; 0 outside a test
+	size_t			line;
+	uint64_t		time_ns;	// CLOCK_MONOTONIC when reported
+	char			file[96];
+	char			msg[280];
+};
+
+struct cell
+{
+	size_t			seq;		// Ring position the cell is ready for
+	struct entry	entry;
+};
+
+struct group
+{
+	struct entry	*entry;		// Messages of the test, in report order
+	size_t			count;
+	size_t			capacity;
+	struct entry	*after;		// Messages reported outside of any test
+	size_t			after_count;	// once this test had started
+	size_t			after_capacity;
+	int				ended;
+};
+
+struct channel
+{
+	struct cell		cell[CHANNEL_CAPACITY];
+	size_t			tail;			// Next position to fill; producers
+	size_t			head;			// Next position to drain; drain thread
+	size_t			flush_request;	// Flushes requested
+	size_t			flush_done;		// Flushes completed
+	size_t			writers;		// Threads using the ring
+	int				waiting;		// Drain thread about to sleep
+	int				state;			// CHANNEL_*
+};
+
+enum { CHANNEL_IDLE, CHANNEL_STARTING, CHANNEL_RUNNING, CHANNEL_STOPPING,
+	CHANNEL_FAILED };
+
+static struct channel s_channel;
+static pthread_mutex_t s_channel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_channel_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_channel_done = PTHREAD_COND_INITIALIZER;
+
+// State of the drain thread
+
+static struct group *s_group;		// Indexed by test ordinal
+static size_t s_groups;
+static size_t s_next = 1;			// Next test ordinal to write
+static size_t s_seen = 0;			// Highest test ordinal seen
+static char s_output[CHANNEL_OUTPUT];
+static size_t s_output_length;
+
+// Ordinal of the test running on this thread
+
+static __thread size_t s_current_test = 0;
+
+static const char SELF_TEST_RO msg_naked[] = "[%5llu.%06llu] %s\n";
+static const char SELF_TEST_RO msg_decorated[] =
+	"[%5llu.%06llu] %s:%zu: %s\n";
+
+static void copy_string(char *buffer, size_t size, const char *string)
+{
+	size_t length = strlen(string);
+
+	if (length >= size)
+		length = size - 1;
+	memcpy(buffer, string, length);
+	buffer[length] = '\0';
+}
+
+//
+// Ring operations
+//
+
+static void channel_push(const struct entry *entry)
+{
+	struct cell *cell;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = __atomic_load_n(&s_channel.tail, __ATOMIC_RELAXED);
+
+	for (;;)
+	{
+		cell = &s_channel.cell[pos & (CHANNEL_CAPACITY - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&s_channel.tail, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			// Full; wait for the drain thread to free a cell
+
+			sched_yield();
+			pos = __atomic_load_n(&s_channel.tail, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			pos = __atomic_load_n(&s_channel.tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->entry = *entry;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int channel_pop(struct entry *entry)
+{
+	struct cell *cell;
+	size_t pos;
+
+	pos = s_channel.head;
+	cell = &s_channel.cell[pos & (CHANNEL_CAPACITY - 1)];
+
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	*entry = cell->entry;
+	__atomic_store_n(&cell->seq, pos + CHANNEL_CAPACITY, __ATOMIC_RELEASE);
+	s_channel.head = pos + 1;
+
+	return 1;
+}
+
+static int channel_filled(void)
+{
+	size_t pos = s_channel.head;
+
+	return __atomic_load_n(&s_channel.cell[pos & (CHANNEL_CAPACITY - 1)].seq,
+		__ATOMIC_ACQUIRE) == pos + 1;
+}
+
+// Wake the drain thread if it is sleeping or about to
+
+static void channel_wake(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&s_channel.waiting, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&s_channel_lock);
+		pthread_cond_signal(&s_channel_ready);
+		pthread_mutex_unlock(&s_channel_lock);
+	}
+}
+
+// Count a thread in while it uses the ring; zero when the channel is not
+// running, in which case the thread is not counted
+
+static int channel_enter(void)
+{
+	__atomic_add_fetch(&s_channel.writers, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&s_channel.state, __ATOMIC_SEQ_CST) == CHANNEL_RUNNING)
+		return 1;
+
+	__atomic_sub_fetch(&s_channel.writers, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static void channel_leave(void)
+{
+	__atomic_sub_fetch(&s_channel.writers, 1, __ATOMIC_SEQ_CST);
+	channel_wake();
+}
+
+static int channel_send(const struct entry *entry)
+{
+	if (!channel_enter())
+		return 0;
+
+	channel_push(entry);
+	channel_leave();
+	return 1;
+}
+
+//
+// Drain thread
+//
+
+static void output_flush(void)
+{
+	size_t written = 0;
+	ssize_t length;
+
+	while (written < s_output_length)
+	{
+		length = write(STDERR_FILENO, s_output + written,
+			s_output_length - written);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length <= 0)
+			break;
+		written += (size_t)length;
+	}
+
+	s_output_length = 0;
+}
+
+static void output_entry(const struct entry *entry)
+{
+	unsigned long long seconds = entry->time_ns / 1000000000u;
+	unsigned long long micros = entry->time_ns % 1000000000u / 1000u;
+	size_t room;
+	int length;
+
+	for (;;)
+	{
+		room = sizeof(s_output) - s_output_length;
+
+		if (entry->has_file)
+			length = snprintf(s_output + s_output_length, room,
+				msg_decorated, seconds, micros, entry->file, entry->line,
+				entry->msg);
+		else
+			length = snprintf(s_output + s_output_length, room,
+				msg_naked, seconds, micros, entry->msg);
+
+		if (length >= 0 && (size_t)length < room)
+		{
+			s_output_length += (size_t)length;
+			return;
+		}
+
+		if (s_output_length == 0)
+			return;		// Cannot happen; records are shorter than the buffer
+
+		output_flush();
+	}
+}
+
+static int entries_append(struct entry **entry, size_t *count,
+	size_t *capacity, const struct entry *item)
+{
+	struct entry *grown;
+	size_t size;
+
+	if (*count == *capacity)
+	{
+		size = *capacity ? *capacity * 2 : 16;
+		grown = (struct entry *)realloc(*entry, size * sizeof(*grown));
+		if (grown == NULL)
+			return 0;
+		*entry = grown;
+		*capacity = size;
+	}
+
+	(*entry)[(*count)++] = *item;
+	return 1;
+}
+
+static struct group *group_get(size_t test)
+{
+	struct group *grown;
+	size_t size;
+
+	if (test >= s_groups)
+	{
+		size = s_groups ? s_groups : 64;
+		while (size <= test)
+			size *= 2;
+
+		grown = (struct group *)realloc(s_group, size * sizeof(*grown));
+		if (grown == NULL)
+			return NULL;
+
+		memset(grown + s_groups, 0, (size - s_groups) * sizeof(*grown));
+		s_group = grown;
+		s_groups = size;
+	}
+
+	return &s_group[test];
+}
+
+static void group_write(struct group *group)
+{
+	size_t i;
+
+	for (i = 0; i < group->count; ++i)
+		output_entry(&group->entry[i]);
+	for (i = 0; i < group->after_count; ++i)
+		output_entry(&group->after[i]);
+
+	free(group->entry);
+	free(group->after);
+	memset(group, 0, sizeof(*group));
+}
+
+// Write the tests that have ended, in order, up to the first test that
+// is still running.  With force, write everything that is held.
+
+static void drain_write(int force)
+{
+	struct group *group;
+
+	while (s_next <= s_seen)
+	{
+		group = &s_group[s_next];
+		if (!group->ended && !force)
+			break;
+		group_write(group);
+		++s_next;
+	}
+
+	if (force)
+	{
+		s_next = 1;
+		s_seen = 0;
+	}
+}
+
+static void drain_accept(const struct entry *entry)
+{
+	struct group *group;
+
+	if (entry->test == 0)
+	{
+		// Outside a test: hold the message behind the tests that have
+		// started and are not written yet
+
+		if (s_next > s_seen || (group = group_get(s_seen)) == NULL ||
+			!entries_append(&group->after, &group->after_count,
+				&group->after_capacity, entry))
+			output_entry(entry);
+		return;
+	}
+
+	// Ordinals restart from one with every run
+
+	if (entry->test < s_next)
+		drain_write(1);
+
+	group = group_get(entry->test);
+	if (group == NULL)
+	{
+		if (entry->kind == ENTRY_MESSAGE)
+			output_entry(entry);
+		return;
+	}
+
+	if (entry->test > s_seen)
+		s_seen = entry->test;
+
+	if (entry->kind == ENTRY_END)
+		group->ended = 1;
+	else if (!entries_append(&group->entry, &group->count,
+		&group->capacity, entry))
+		output_entry(entry);
+}
+
+static void drain_done(size_t request)
+{
+	__atomic_store_n(&s_channel.flush_done, request, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&s_channel_lock);
+	pthread_cond_broadcast(&s_channel_done);
+	pthread_mutex_unlock(&s_channel_lock);
+}
+
+// Sleep until a message or a flush request comes in
+
+static void drain_wait(void)
+{
+	pthread_mutex_lock(&s_channel_lock);
+
+	__atomic_store_n(&s_channel.waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!channel_filled() && __atomic_load_n(&s_channel.flush_request,
+		__ATOMIC_ACQUIRE) == s_channel.flush_done)
+		pthread_cond_wait(&s_channel_ready, &s_channel_lock);
+
+	__atomic_store_n(&s_channel.waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s_channel_lock);
+}
+
+//
+// Stop the drain thread.  The reporters that found the channel running
+// are let through, what they queued is written, and every flush requested
+// meanwhile is completed before the channel goes idle.
+//
+static void drain_stop(void)
+{
+	struct entry entry;
+
+	__atomic_store_n(&s_channel.state, CHANNEL_STOPPING, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		if (channel_pop(&entry))
+			drain_accept(&entry);
+		else if (__atomic_load_n(&s_channel.writers, __ATOMIC_SEQ_CST) == 0)
+			break;
+		else
+			sched_yield();
+	}
+
+	while (channel_pop(&entry))
+		drain_accept(&entry);
+
+	drain_write(1);
+	output_flush();
+
+	drain_done(__atomic_load_n(&s_channel.flush_request, __ATOMIC_ACQUIRE));
+
+	pthread_mutex_lock(&s_channel_lock);
+	__atomic_store_n(&s_channel.state, CHANNEL_IDLE, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&s_channel_done);
+	pthread_mutex_unlock(&s_channel_lock);
+}
+
+static void *drain_main(void *arg)
+{
+	struct entry entry;
+	size_t request, drained;
+
+	(void)arg;
+
+	for (;;)
+	{
+		drained = 0;
+		while (drained < CHANNEL_CAPACITY && channel_pop(&entry))
+		{
+			drain_accept(&entry);
+			++drained;
+		}
+
+		drain_write(0);
+
+		if (drained != 0)
+			continue;
+
+		// Write out what was gathered; stop once a flush is completed
+
+		request = __atomic_load_n(&s_channel.flush_request, __ATOMIC_ACQUIRE);
+		if (request != s_channel.flush_done)
+		{
+			drain_stop();
+			return NULL;
+		}
+
+		output_flush();
+		drain_wait();
+	}
+
+	return NULL;
+}
+
+//
+// Channel life cycle
+//
+
+static void channel_exit(void)
+{
+	sys_self_test_flush();
+}
+
+// A forked child has no drain thread; forget what it inherited, without
+// touching memory the drain thread may have been changing, and let its
+// first message start a channel of its own.
+
+static void channel_child(void)
+{
+	memset(&s_channel, 0, sizeof(s_channel));
+	pthread_mutex_init(&s_channel_lock, NULL);
+	pthread_cond_init(&s_channel_ready, NULL);
+	pthread_cond_init(&s_channel_done, NULL);
+	s_group = NULL;
+	s_groups = 0;
+	s_next = 1;
+	s_seen = 0;
+	s_output_length = 0;
+}
+
+static int channel_start(void)
+{
+	static int registered = 0;
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t i;
+	int state;
+
+	for (;;)
+	{
+		state = __atomic_load_n(&s_channel.state, __ATOMIC_ACQUIRE);
+		if (state == CHANNEL_RUNNING || state == CHANNEL_FAILED)
+			return state == CHANNEL_RUNNING;
+
+		if (state == CHANNEL_IDLE && __atomic_compare_exchange_n(
+			&s_channel.state, &state, CHANNEL_STARTING, 0, __ATOMIC_ACQUIRE,
+			__ATOMIC_ACQUIRE))
+			break;
+
+		// Someone else is starting the channel, or it is stopping
+
+		sched_yield();
+	}
+
+	// The ring of a stopped channel is empty and nobody uses it
+
+	s_channel.head = 0;
+	s_channel.tail = 0;
+	for (i = 0; i < CHANNEL_CAPACITY; ++i)
+		s_channel.cell[i].seq = i;
+
+	if (!registered)
+	{
+		registered = 1;
+		pthread_atfork(NULL, NULL, channel_child);
+		atexit(channel_exit);
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	state = pthread_create(&thread, &attr, drain_main, NULL) == 0 ?
+		CHANNEL_RUNNING : CHANNEL_FAILED;
+	pthread_attr_destroy(&attr);
+
+	__atomic_store_n(&s_channel.state, state, __ATOMIC_RELEASE);
+	return state == CHANNEL_RUNNING;
+}
+
+//
+// Interface
+//
+
+void sys_self_test_report_buffered(
+	const char *msg, const char *file, size_t line)
+{
+	struct entry entry;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	entry.kind = ENTRY_MESSAGE;
+	entry.test = s_current_test;
+	entry.line = line;
+	entry.time_ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+	entry.has_file = file != NULL;
+	copy_string(entry.msg, sizeof(entry.msg), msg);
+	if (file != NULL)
+		copy_string(entry.file, sizeof(entry.file), file);
+
+	while (!channel_send(&entry))
+	{
+		if (!channel_start())
+		{
+			sys_self_test_report(msg, file, line);
+			return;
+		}
+	}
+}
+
+void sys_self_test_flush(void)
+{
+	size_t request = 0;
+	int running;
+
+	running = channel_enter();
+	if (running)
+	{
+		request = __atomic_add_fetch(&s_channel.flush_request, 1,
+			__ATOMIC_RELEASE);
+		channel_leave();
+	}
+
+	// A channel that is stopping writes everything out as well
+
+	pthread_mutex_lock(&s_channel_lock);
+	while (running ? (intptr_t)(__atomic_load_n(&s_channel.flush_done,
+		__ATOMIC_ACQUIRE) - request) < 0 :
+		__atomic_load_n(&s_channel.state, __ATOMIC_ACQUIRE) == CHANNEL_STOPPING)
+		pthread_cond_wait(&s_channel_done, &s_channel_lock);
+	pthread_mutex_unlock(&s_channel_lock);
+}
+
+void sys_self_test_begin(size_t test)
+{
+	s_current_test = test;
+}
+
+void sys_self_test_end(size_t test)
+{
+	struct entry entry;
+
+	s_current_test = 0;
+
+	entry.kind = ENTRY_END;
+	entry.test = test;
+	entry.line = 0;
+	entry.time_ns = 0;
+	entry.has_file = 0;
+	entry.msg[0] = '\0';
+	entry.file[0] = '\0';
+
+	// A channel that is not running holds no message of the test
+
+	channel_send(&entry);
+}
+
+#endif /* LINUX_SELFTEST_H */
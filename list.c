@@ -34,14 +34,30 @@ void list_init(struct list *list)
 	assert(list != NULL);
 
     list->next = NULL;
+    list->arena = NULL;
 } 
 
+void list_init_arena(struct list *list, struct mem_arena *arena)
+{
+	assert(list != NULL);
+
+	list->next = NULL;
+	list->arena = arena;
+}
+
 void list_clear(struct list *list)
 {
 	struct link *link = NULL;
 
 	assert(list != NULL);
 
+	if (list->arena != NULL)
+	{
+		// The links are released along with the arena
+		list->next = NULL;
+		return;
+	}
+
 	while(list->next != NULL)
 	{
 		link = list->next;
@@ -94,7 +110,10 @@ int list_add(struct list *list, int value)
 
 	assert(list != NULL);
 
-	link = mem_create(struct link);
+	if (list->arena != NULL)
+		link = (struct link *)mem_arena_alloc(list->arena, sizeof(*link));
+	else
+		link = mem_create(struct link);
 	if (link == NULL) 
 		return 0;
 
@@ -123,7 +142,8 @@ void list_remove(struct list *list, int value)
 		{
 			link = (*ptr);
 			(*ptr) = link->next;
-			mem_free(link);
+			if (list->arena == NULL)
+				mem_free(link);
 			break;
 		}
 	}
@@ -135,14 +155,53 @@ void list_remove(struct list *list, int value)
 //
 ////////////////////////////////////////////////////////////////////////
 
+// The list tests share an empty list allocated from an initialized
+// memory subsystem; the teardown fails if any element was leaked.
+
+static int SELF_TEST_FUNC list_fixture_setup(
+	self_test_report_pf report, void **state)
+{
+	struct list *list;
+
+	(void)report;
+	mem_init();
+	list = mem_create(struct list);
+	if (list == NULL)
+	{
+		mem_uninit(NULL, NULL);
+		return 0;
+	}
+
+	list_init(list);
+	*state = list;
+	return 1;
+}
+
+static int SELF_TEST_FUNC list_fixture_teardown(
+	self_test_report_pf report, void *state)
+{
+	struct list *list = (struct list *)state;
+
+	(void)report;
+	list_clear(list);
+	mem_free(list);
+	return mem_uninit(NULL, NULL);
+}
+
+SELF_TEST_FIXTURE(SELF_TEST_LEVEL_DEFAULT, list_fixture_setup,
+	list_fixture_teardown);
+
+SELF_TEST_DEPENDS(list, memory);
+SELF_TEST_MEMORY_BUDGET(list, 8192);
+
 SELF_TEST(list, SELF_TEST_LEVEL_DEFAULT)
 {
-	struct list s_list;
-	struct list *list = &s_list;
+	struct list *list = SELF_TEST_FIXTURE_STATE(list_fixture_setup);
+	struct list arena_list;
+	struct mem_arena *arena = NULL;
 	int rc = 0;
 
-	// Initialize memory subsystem
-	mem_init();
+	SELF_TEST_ASSERT(list != NULL);
 
 	// Verify list initialization
 	list_init(list);
@@ -175,6 +234,9 @@ SELF_TEST(list, SELF_TEST_LEVEL_DEFAULT)
 	SELF_TEST_ASSERT(list_contains(list, 100));
 	SELF_TEST_ASSERT(list_contains(list, 200));
 
+	// Catch a slower lookup when checked against a recorded baseline
+	SELF_TEST_PERF_ASSERT(list_contains(list, 200), list_contains, 25);
+
 	// Verify that clearing a non-empty list works
 	list_clear(list);
 	SELF_TEST_ASSERT(list->next == NULL);
@@ -211,10 +273,83 @@ SELF_TEST(list, SELF_TEST_LEVEL_DEFAULT)
 	SELF_TEST_ASSERT(list_count(list) == 0);
 	SELF_TEST_ASSERT(!list_contains(list, 100));
 
+	// Build a list in an arena, then drop it at once
+	arena = mem_arena_create();
+	SELF_TEST_ASSERT(arena != NULL);
+	list_init_arena(&arena_list, arena);
+	SELF_TEST_ASSERT(list_add(&arena_list, 100));
+	SELF_TEST_ASSERT(list_add(&arena_list, 200));
+	list_remove(&arena_list, 100);
+	SELF_TEST_ASSERT(list_count(&arena_list) == 1);
+	SELF_TEST_ASSERT(list_contains(&arena_list, 200));
+	list_clear(&arena_list);
+	SELF_TEST_ASSERT(list_count(&arena_list) == 0);
+
+	rc = 1;
+
+failure:
+	mem_arena_destroy(arena);
+	return rc;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// List system benchmarks
+//
+////////////////////////////////////////////////////////////////////////
+
+// list_add walks to the end of the list, so the list is cleared every few
+// additions to keep the cost of one iteration independent of the count.
+
+SELF_BENCH(list_add, SELF_TEST_LEVEL_DEFAULT)
+{
+	struct list s_list;
+	struct list *list = &s_list;
+	size_t i;
+	int rc = 0;
+
+	mem_init();
+	list_init(list);
+
+	for (i = 0; i < self_bench_iterations; ++i)
+	{
+		SELF_TEST_ASSERT(list_add(list, (int)i));
+		if ((i & 15) == 15)
+			list_clear(list);
+	}
+
+	list_clear(list);
 	SELF_TEST_ASSERT(mem_uninit(NULL, NULL) == 1);
+	return 1;
+
+failure:
+	list_clear(list);
+	mem_uninit(NULL, NULL);
+	return rc;
+}
+
+// Look up values in a 64 element list; half of the lookups miss.
+
+SELF_BENCH(list_contains, SELF_TEST_LEVEL_DEFAULT)
+{
+	struct list s_list;
+	struct list *list = &s_list;
+	size_t i;
+	int rc = 0;
+
+	mem_init();
+	list_init(list);
+
+	for (i = 0; i < 64; ++i)
+		SELF_TEST_ASSERT(list_add(list, (int)i));
+
+	for (i = 0; i < self_bench_iterations; ++i)
+		SELF_BENCH_KEEP(list_contains(list, (int)(i & 127)));
 
 	rc = 1;
 
 failure:
+	list_clear(list);
+	mem_uninit(NULL, NULL);
 	return rc;
 }
@@ -28,11 +28,19 @@ SOFTWARE.
 // Define the opaque data type `list` that uses a hidden type called `link`
 // that implements the linked list.
 
-struct list { struct link *next; };
+// The links of a list are allocated from an arena when it is given one.
+
+struct mem_arena;
+
+struct list { struct link *next; struct mem_arena *arena; };
 
 // Initialize a list 
 extern void list_init(struct list *list);
 
+// Initialize a list whose links are allocated from an arena; clearing the
+// list takes constant time and the links are released with the arena
+extern void list_init_arena(struct list *list, struct mem_arena *arena);
+
 // Return the number of entries in the list
 extern size_t list_count(struct list *list);
 
@@ -33,15 +33,26 @@ SOFTWARE.
 // comparison functions to make this easier for me.
 
 #if defined(_MSC_VER)
+#include <windows.h>
 #define streq(a,b) (0 == strcmp((a),(b)))
 #define strieq(a,b) (0 == _stricmp((a),(b)))
+#define load_module(p) (LoadLibraryA(p) != NULL)
 #else
 #include <strings.h>
+#include <dlfcn.h>
 #define streq(a,b) (0 == strcmp((a),(b)))
 #define strieq(a,b) (0 == strcasecmp((a),(b)))
+#define load_module(p) (dlopen((p), RTLD_NOW) != NULL)
 #endif
 
 static int f_self_test = 0;
+static int f_self_bench = 0;
+static int f_self_test_release = 0;
+static int f_self_test_async = 0;
+static int f_self_test_list = 0;
+static const char *f_self_test_load = NULL;
+static self_test_report_pf f_self_test_report = SELF_TEST_SYSTEM_REPORT;
+static unsigned f_self_test_flags = SELF_TEST_FLAG_NONE;
 
 void parse_args(int argc, char **argv)
 {
@@ -51,9 +62,155 @@ void parse_args(int argc, char **argv)
 			f_self_test = 1;
 		if (strieq(argv[i], "/SELF-TEST"))
 			f_self_test = 1;
+		if (streq(argv[i], "--self-test-parallel"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_PARALLEL;
+		}
+		if (streq(argv[i], "--self-test-release"))
+		{
+			f_self_test = 1;
+			f_self_test_release = 1;
+		}
+		if (streq(argv[i], "--self-test-async"))
+		{
+			f_self_test = 1;
+			f_self_test_async = 1;
+		}
+		if (streq(argv[i], "--self-bench"))
+			f_self_bench = 1;
+		if (streq(argv[i], "--self-test-isolate"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_ISOLATE;
+		}
+		if (strncmp(argv[i], "--self-test-timeout=", 20) == 0)
+			self_test_options.timeout_ms = (unsigned)atoi(argv[i] + 20);
+		if (strncmp(argv[i], "--self-test-cache=", 18) == 0)
+			self_test_options.cache_path = argv[i] + 18;
+		if (streq(argv[i], "--self-test-force"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_FORCE;
+		}
+		if (strncmp(argv[i], "--self-test-budget=", 19) == 0)
+		{
+			f_self_test = 1;
+			self_test_options.budget_us = (unsigned)atoi(argv[i] + 19);
+		}
+		if (streq(argv[i], "--self-test-buffered"))
+		{
+			f_self_test = 1;
+			f_self_test_report = SELF_TEST_BUFFERED_REPORT;
+		}
+		if (strncmp(argv[i], "--self-test-json", 16) == 0 ||
+			strncmp(argv[i], "--self-test-tap", 15) == 0)
+		{
+			// The game talks on standard output; keep the records apart
+
+			if (strchr(argv[i], '=') == NULL)
+			{
+				fprintf(stderr, "error: %s needs =path\n", argv[i]);
+				exit(EXIT_FAILURE);
+			}
+
+			f_self_test = 1;
+			self_test_options.output_format = argv[i][12] == 'j' ?
+				SELF_TEST_OUTPUT_JSON : SELF_TEST_OUTPUT_TAP;
+			self_test_options.output_path = strchr(argv[i], '=') + 1;
+		}
+		if (strncmp(argv[i], "--self-test-shard=", 18) == 0)
+		{
+			f_self_test = 1;
+			if (sscanf(argv[i] + 18, "%u/%u", &self_test_options.shard_index,
+				&self_test_options.shard_count) != 2 ||
+				self_test_options.shard_index >= self_test_options.shard_count)
+				self_test_options.shard_count = 0;
+		}
+		if (streq(argv[i], "--self-test-counters"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_COUNTERS;
+		}
+		if (streq(argv[i], "--self-test-timing"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_TIMING;
+		}
+		if (strncmp(argv[i], "--self-test=", 12) == 0)
+		{
+			f_self_test = 1;
+			self_test_options.include = argv[i] + 12;
+		}
+		if (strncmp(argv[i], "--self-test-exclude=", 20) == 0)
+		{
+			f_self_test = 1;
+			self_test_options.exclude = argv[i] + 20;
+		}
+		if (strncmp(argv[i], "--self-test-baseline=", 21) == 0)
+		{
+			f_self_test = 1;
+			self_test_options.baseline_path = argv[i] + 21;
+		}
+		if (streq(argv[i], "--self-test-record-baseline"))
+		{
+			f_self_test = 1;
+			f_self_test_flags |= SELF_TEST_FLAG_RECORD_BASELINE;
+		}
+		if (strncmp(argv[i], "--self-test-load=", 17) == 0)
+			f_self_test_load = argv[i] + 17;
+		if (streq(argv[i], "--self-test-list"))
+			f_self_test_list = 1;
 	}
 }
 
+// Called from a background thread when a self test deferred by the time
+// budget fails; the program can no longer be trusted
+
+void deferred_self_test_failed(const char *name)
+{
+	fprintf(stderr, "error: deferred self test %s failed; exiting\n",
+		name != NULL ? name : "run");
+	exit(EXIT_FAILURE);
+}
+
+void list_self_test(const char *name, unsigned level, void *data)
+{
+	(void)data;
+	printf("%s (level %u)\n", name, level);
+}
+
+// Hand the heap statistics of the memory subsystem to the self tests so
+// that each test is checked for leaks, those of the calling thread when
+// the tests run on several threads
+
+void self_test_copy_heap(struct self_test_heap *heap,
+	const struct mem_statistics *statistics)
+{
+	heap->allocations = statistics->allocations;
+	heap->bytes = statistics->bytes;
+	heap->blocks = statistics->blocks;
+	heap->live_bytes = statistics->live_bytes;
+	heap->peak_bytes = statistics->peak_bytes;
+	heap->serial = statistics->serial;
+}
+
+void self_test_heap(struct self_test_heap *heap, int reset_peak)
+{
+	struct mem_statistics statistics;
+
+	mem_statistics(&statistics, reset_peak);
+	self_test_copy_heap(heap, &statistics);
+}
+
+void self_test_thread_heap(struct self_test_heap *heap, int reset_peak)
+{
+	struct mem_statistics statistics;
+
+	mem_thread_statistics(&statistics, reset_peak);
+	self_test_copy_heap(heap, &statistics);
+}
+
 void mem_leak_detected(const char *file, int line, void *data)
 {
 	fprintf(stderr, "%s:%d: error: memory leak detected!\n",
@@ -67,15 +224,63 @@ int main(int argc, char **argv)
 	int	guess;
 
 	parse_args(argc, argv);
+	self_test_options.deferred_failure = deferred_self_test_failed;
+	self_test_options.heap = self_test_heap;
+	self_test_options.blocks = mem_blocks;
+	self_test_options.thread_heap = self_test_thread_heap;
+	self_test_options.thread_blocks = mem_thread_blocks;
+
+	if (f_self_test_list)
+	{
+		// List the selected self tests and leave without running them
+
+		self_test_catalog(list_self_test, NULL);
+		return 0;
+	}
+
+	if (f_self_test_async)
+	{
+		// Overlap the self tests with initialization; the verdict is
+		// checked before the first real work
 
-	if (f_self_test)
+		if (!self_test_start_async(f_self_test_report, f_self_test_flags))
+			return 0;
+	}
+	else if (f_self_test)
 	{
 		// Report on stderr under LINUX and OutputDebugString() under Windows
 
-		if (!self_test_run(SELF_TEST_SYSTEM_REPORT, SELF_TEST_FLAG_NONE))
+		if (!self_test_run(f_self_test_report, f_self_test_flags))
+			return 0;
+
+		// The self tests will not run again; drop their pages
+
+		if (f_self_test_release)
+			self_test_release(SELF_TEST_SYSTEM_REPORT);
+	}
+
+	if (f_self_test_load != NULL)
+	{
+		// Load a plugin, then test it before it is put to work
+
+		if (!load_module(f_self_test_load))
+		{
+			fprintf(stderr, "error: cannot load %s\n", f_self_test_load);
+			return 0;
+		}
+
+		if (!self_test_run_modules(f_self_test_report, f_self_test_flags))
 			return 0;
 	}
 
+	if (f_self_bench)
+	{
+		// Benchmarks are a development aid; run them and leave
+
+		return self_bench_run(SELF_TEST_SYSTEM_REPORT, SELF_TEST_FLAG_NONE)
+			? 0 : 1;
+	}
+
 	mem_init();
 	list = mem_create(struct list);
 	list_init(list);
@@ -88,6 +293,20 @@ int main(int argc, char **argv)
 		list_add(list, scaled);
 	}
 
+	if (f_self_test_async)
+	{
+		if (!self_test_wait())
+		{
+			list_clear(list);
+			mem_free(list);
+			mem_uninit(mem_leak_detected, NULL);
+			return 0;
+		}
+
+		if (f_self_test_release)
+			self_test_release(SELF_TEST_SYSTEM_REPORT);
+	}
+
 	for (int i = 0; i < max_tries; ++i)
 	{
 		printf("You have %d tries to pick one of my numbers.\n", max_tries - i);
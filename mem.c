@@ -22,179 +22,1701 @@ SOFTWARE.
 
 */
 
+#if !defined(_MSC_VER)
+#define _POSIX_C_SOURCE 200112L	// posix_memalign
+#endif
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include "mem.h"
 #include "selftest.h"
 
+//
+// Each thread allocates from a heap of its own, so the threads never
+// contend on the allocation path.  The primitives differ between the
+// Microsoft and the GNU tool chains.
+//
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <malloc.h>
+
+#define MEM_THREAD __declspec(thread)
+#define MEM_KEY_DECL WINAPI
+#define MEM_NOINLINE __declspec(noinline)
+#define MEM_INLINE __forceinline
+
+typedef SRWLOCK mem_lock_t;
+typedef DWORD mem_key_t;
+
+#define MEM_LOCK_INITIALIZER SRWLOCK_INIT
+#define mem_lock(l) AcquireSRWLockExclusive(l)
+#define mem_unlock(l) ReleaseSRWLockExclusive(l)
+#define mem_key_create(k,f) ((*(k) = FlsAlloc(f)) != FLS_OUT_OF_INDEXES)
+#define mem_key_set(k,v) FlsSetValue((k), (v))
+#define mem_page_alloc(p) \
+	((*(p) = _aligned_malloc(MEM_SLAB_SIZE, MEM_SLAB_SIZE)) != NULL)
+
+// Volatile accesses have acquire and release semantics under Microsoft C
+
+#define mem_atomic_load(p) (*(p))
+#define mem_atomic_store(p,v) (*(p) = (v))
+#define mem_atomic_add(p,v) InterlockedExchangeAddSizeT((p), (v))
+#define mem_atomic_swap(p,v) \
+	InterlockedExchangePointer((PVOID volatile *)(p), (v))
+#define mem_atomic_cas(p,o,n) \
+	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+
+// Aligned accesses of a word are atomic
+
+#define mem_relaxed_load(p) (*(p))
+#define mem_relaxed_store(p,v) (*(p) = (v))
+#else
+#include <pthread.h>
+
+#define MEM_THREAD __thread
+#define MEM_KEY_DECL
+#define MEM_NOINLINE __attribute__((__noinline__))
+#define MEM_INLINE __inline__ __attribute__((__always_inline__))
+
+typedef pthread_mutex_t mem_lock_t;
+typedef pthread_key_t mem_key_t;
+
+#define MEM_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define mem_lock(l) pthread_mutex_lock(l)
+#define mem_unlock(l) pthread_mutex_unlock(l)
+#define mem_key_create(k,f) (pthread_key_create((k), (f)) == 0)
+#define mem_key_set(k,v) pthread_setspecific((k), (v))
+#define mem_page_alloc(p) \
+	(posix_memalign((p), MEM_SLAB_SIZE, MEM_SLAB_SIZE) == 0)
+
+#define mem_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mem_atomic_store(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define mem_atomic_add(p,v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define mem_atomic_swap(p,v) __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define mem_atomic_cas(p,o,n) __sync_bool_compare_and_swap((p), (o), (n))
+#define mem_relaxed_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define mem_relaxed_store(p,v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+// Add to a counter that only the owner of its heap writes, and that other
+// threads may read meanwhile
+
+#define mem_count(p,v) mem_relaxed_store((p), mem_relaxed_load(p) + (v))
+
 // 
 // This union will create a data type that has the strictest alignment
 // requirements of all data types.
 //
 
-union align
-{
-	char	c;
-	int		i;
-	float	f;
-	double	d;
-	void 	*p;
-};
+union align
+{
+	char	c;
+	int		i;
+	float	f;
+	double	d;
+	void 	*p;
+};
+
+// 
+// The heap marker is a compact header placed before each allocation.  The
+// file and line of the allocation are interned into a site number, and the
+// marker holds the site, the size of a small block, the low bits of the
+// number of the allocation and a flag set while the block is tracked in
+// eight bytes.  The tracked blocks are found by walking the markers of
+// the slabs that hold them rather than through a list, so tracking a
+// block only writes its own marker.
+//
+// The structure is technically variably sized as the 'data' portion of the
+// structure will hold the actual data requested by the calling
+// application. The alignment requirements of the union will ensure that
+// the pointer returned to the caller will be properly aligned.
+//
+// A block that waits on a free list, or on the remote-free stack of its
+// heap, is linked through its data.
+//
+
+#define MEM_SITE_BITS 22
+#define MEM_SIZE_LARGE 1023		// Size of a block with a slab of its own
+#define MEM_SERIAL_MASK 0x7FFFFFFFu
+
+// The size is read by any thread that frees the block, so the flag, which
+// only the owner of the block writes once it is handed out, is kept in the
+// other word; the unnamed field makes the words separate memory locations.
+
+struct marker
+{
+	uint32_t		site : MEM_SITE_BITS;		// Interned file and line
+	uint32_t		size : 32 - MEM_SITE_BITS;	// Size of a small block
+	uint32_t		: 0;
+	uint32_t		serial : 31;	// Low bits of the number of the allocation
+	uint32_t		live : 1;		// Set while the block is tracked
+	union align		data;
+};
+
+//
+// Small blocks, marker included, are carved out of slabs of MEM_SLAB_SIZE
+// bytes aligned on their size, one size class every MEM_SLAB_GRAIN bytes,
+// so the slab of a block is found by masking its address.  The header of
+// a slab names its heap, which is only read to free a block.  A larger
+// block is allocated with a slab header of its own just before its marker.
+//
+// A freed block goes back on the free list of its class in the heap it was
+// carved for, so the slabs are reused but never handed back.
+//
+
+#define MEM_SLAB_SIZE 4096
+#define MEM_SLAB_GRAIN 16
+#define MEM_SLAB_CLASSES 32			// Blocks of up to 512 bytes
+
+struct thread_heap;
+
+struct slab
+{
+	struct thread_heap	*owner;		// Heap the blocks belong to
+	struct slab			*prev;		// Slabs of the heap
+	struct slab			*next;
+	size_t				size;		// Size of a block, or of the large block
+	size_t				index;		// Size class, or MEM_SLAB_CLASSES
+};
+
+#define MEM_SLAB_HEADER \
+	((sizeof(struct slab) + MEM_SLAB_GRAIN - 1) & ~(size_t)(MEM_SLAB_GRAIN - 1))
+
+//
+// Sites are numbered from one in the order they are first seen; zero
+// stands for a site that could not be interned.  Each heap caches the
+// sites it used, so the table shared by the threads is only locked the
+// first time a thread allocates at a site.  The pages of the table never
+// move, so a site is read without the lock.
+//
+// A site is found by the address of its file name, as __FILE__ gives it,
+// but the name is copied when the site is added: the site outlives the
+// string when the shared object that allocated is unloaded.
+//
+
+#define MEM_SITE_PAGE 1024
+#define MEM_SITE_PAGES ((1u << MEM_SITE_BITS) / MEM_SITE_PAGE)
+#define MEM_SITE_CACHE 64
+
+struct mem_site
+{
+	const char		*key;			// File name as given; not read
+	const char		*file;			// Copy of the file name
+	int				line;
+};
+
+//
+// Each heap counts the allocations made at each site in pages of its own,
+// created the first time it allocates at a site of the page.  A block is
+// counted at site zero when the page of its site could not be created.
+//
+
+struct site_profile
+{
+	size_t			allocations;	// Same as the statistics of the heap
+	size_t			bytes;
+	size_t			blocks;
+	size_t			live_bytes;
+	size_t			peak_bytes;
+};
+
+struct site_cache
+{
+	const char		*file;
+	int				line;
+	uint32_t		site;
+};
+
+//
+// The heap of a thread holds the slabs of the blocks it allocated, along
+// with their counters by site.  The statistics of the heap are the sums of
+// those of its sites, but for the peak, which is kept with the live bytes
+// it follows.  Only the owning thread tracks and releases
+// blocks, and it takes no lock to do so: the other threads never touch
+// its slabs and free lists, and only read its counters, which the owner
+// updates with single atomic stores.
+//
+// A block freed by another thread is pushed on the remote-free stack of
+// its heap with a compare-and-swap.  The owner takes the whole stack with
+// a single exchange the next time it allocates or walks its heap, so a
+// block is never released twice.  Until then the block is counted as
+// outstanding by the other threads.
+//
+// The heap of a thread that exits keeps its blocks and slabs, and is taken
+// over by the next thread that needs a heap.  Until then it has no owner,
+// so a walk holding the registry lock may release and forget its blocks
+// like those of the calling thread; the heap of another running thread is
+// never walked nor emptied behind its back.
+//
+
+struct thread_heap
+{
+	struct slab			*slabs;			// Slabs of the heap, newest first
+	size_t				live_bytes;		// Sum of the live bytes of the sites
+	size_t				peak_bytes;		// Highest live_bytes since the reset
+	size_t				serial;			// Next number of the reserved batch
+	size_t				serial_end;		// End of the reserved batch
+	size_t				epoch;			// Value of s_epoch at the reservation
+	struct marker		*free[MEM_SLAB_CLASSES];	// Free blocks by class
+	struct site_cache	site[MEM_SITE_CACHE];		// Sites used lately
+	struct site_profile	unknown;		// Blocks of site zero
+	struct site_profile	*volatile profile[MEM_SITE_PAGES];	// Each site
+	struct thread_heap	*next_heap;		// Next heap of the registry
+	volatile int		abandoned;		// Set once its thread has exited
+	char				pad[64];		// Keep the stack off the lines above
+	struct marker *volatile	remote;		// Blocks freed by other threads
+};
+
+//
+// Allocations are numbered in batches reserved by each heap, so that the
+// threads do not share a counter.  The numbers of a heap increase, but
+// they leave gaps and are not a count.  Bumping the epoch makes each heap
+// reserve a new batch at its next allocation, so every allocation made
+// after mem_statistics returns is numbered at least its serial.  Markers
+// keep the low 31 bits, which order allocations less than 2^30 apart.
+//
+
+#define MEM_SERIAL_BATCH 256
+
+// 
+// Statically declare the registry of the heaps, the table of the sites and
+// the state shared by every thread.  The registry lock is held while
+// walking the heaps.  The subsystem is initialized while the number of
+// calls to mem_init exceeds that of the calls to mem_uninit, so that a
+// thread or test pairing the two does not stop the others.
+
+static struct thread_heap *s_heaps;
+static mem_lock_t s_heaps_lock = MEM_LOCK_INITIALIZER;
+static mem_key_t s_heaps_key;
+static int s_heaps_key_created;
+static volatile size_t s_users;
+static volatile size_t s_serial;
+static volatile size_t s_epoch;
+
+static mem_lock_t s_sites_lock = MEM_LOCK_INITIALIZER;
+static struct mem_site *s_site_page[MEM_SITE_PAGES];
+static uint32_t s_sites = 1;			// Number of the next site
+static uint32_t *s_site_hash;			// Open addressing on file and line
+static size_t s_site_hash_size;
+
+static MEM_THREAD struct thread_heap *t_heap;
+
+static size_t site_hash(const char *file, int line)
+{
+	return (((uintptr_t)file >> 3) ^ (size_t)line * 2654435761u) * 31;
+}
+
+static const struct mem_site *site_get(uint32_t site)
+{
+	static const struct mem_site unknown = { NULL, NULL, 0 };
+
+	if (site == 0)
+		return &unknown;
+
+	return &s_site_page[site / MEM_SITE_PAGE][site % MEM_SITE_PAGE];
+}
+
+// Keep the hash of the sites at most half full; the table keeps working,
+// fuller, if it cannot grow
+
+static void site_grow(void)
+{
+	const struct mem_site *entry;
+	uint32_t *hash;
+	size_t size, i, j;
+
+	size = s_site_hash_size != 0 ? 2 * s_site_hash_size : 1024;
+	hash = (uint32_t *)calloc(size, sizeof(*hash));
+	if (hash == NULL)
+		return;
+
+	for (i = 0; i < s_site_hash_size; ++i)
+	{
+		if (s_site_hash[i] != 0)
+		{
+			entry = site_get(s_site_hash[i]);
+			j = site_hash(entry->key, entry->line) & (size - 1);
+			while (hash[j] != 0)
+				j = (j + 1) & (size - 1);
+			hash[j] = s_site_hash[i];
+		}
+	}
+
+	free(s_site_hash);
+	s_site_hash = hash;
+	s_site_hash_size = size;
+}
+
+//
+// Find the number of a site in the shared table, adding the site when it
+// is new.  Zero is returned when the table is full or out of memory.
+//
+static uint32_t site_intern(const char *file, int line)
+{
+	const struct mem_site *entry;
+	struct mem_site *page;
+	uint32_t site = 0;
+	size_t i, size;
+	char *copy;
+
+	mem_lock(&s_sites_lock);
+
+	if (2 * (size_t)s_sites >= s_site_hash_size)
+		site_grow();
+
+	if (s_sites < s_site_hash_size)
+	{
+		for (i = site_hash(file, line) & (s_site_hash_size - 1);
+			s_site_hash[i] != 0; i = (i + 1) & (s_site_hash_size - 1))
+		{
+			// An object loaded where an unloaded one was may reuse the
+			// address of a name, so compare the copy too
+
+			entry = site_get(s_site_hash[i]);
+			if (entry->key == file && entry->line == line &&
+				strcmp(entry->file, file) == 0)
+			{
+				site = s_site_hash[i];
+				break;
+			}
+		}
+
+		if (site == 0 && s_sites < (1u << MEM_SITE_BITS))
+		{
+			page = s_site_page[s_sites / MEM_SITE_PAGE];
+			if (page == NULL)
+			{
+				page = (struct mem_site *)malloc(
+					MEM_SITE_PAGE * sizeof(*page));
+				s_site_page[s_sites / MEM_SITE_PAGE] = page;
+			}
+
+			size = strlen(file) + 1;
+			copy = page != NULL ? (char *)malloc(size) : NULL;
+			if (copy != NULL)
+			{
+				memcpy(copy, file, size);
+				site = s_sites++;
+				page[site % MEM_SITE_PAGE].key = file;
+				page[site % MEM_SITE_PAGE].file = copy;
+				page[site % MEM_SITE_PAGE].line = line;
+				s_site_hash[i] = site;
+			}
+		}
+	}
+
+	mem_unlock(&s_sites_lock);
+	return site;
+}
+
+//
+// Make sure that a heap has a page to count the blocks of a site, giving
+// site zero when the page cannot be created.  Only the owner of the heap
+// may call it.
+//
+static uint32_t heap_page(struct thread_heap *heap, uint32_t site)
+{
+	struct site_profile *volatile *page;
+	struct site_profile *created;
+
+	// The page is published whole to the threads walking the profile
+
+	page = &heap->profile[site / MEM_SITE_PAGE];
+	if (site != 0 && *page == NULL)
+	{
+		created = (struct site_profile *)calloc(MEM_SITE_PAGE,
+			sizeof(*created));
+		mem_atomic_store(page, created);
+	}
+
+	return *page != NULL ? site : 0;
+}
+
+//
+// Find the number of a site through the cache of a heap, making sure that
+// the heap has a page to count the blocks of the site.  Only the owner of
+// the heap may call it.
+//
+static uint32_t heap_site(struct thread_heap *heap, const char *file, int line)
+{
+	struct site_cache *cache;
+
+	cache = &heap->site[site_hash(file, line) % MEM_SITE_CACHE];
+
+	if (cache->file != file || cache->line != line || cache->site == 0)
+	{
+		cache->file = file;
+		cache->line = line;
+		cache->site = heap_page(heap, site_intern(file, line));
+	}
+
+	return cache->site;
+}
+
+static struct site_profile *heap_profile(struct thread_heap *heap,
+	uint32_t site)
+{
+	if (site == 0)
+		return &heap->unknown;
+
+	return &heap->profile[site / MEM_SITE_PAGE][site % MEM_SITE_PAGE];
+}
+
+static void profile_add(struct mem_site_profile *total,
+	const struct site_profile *profile)
+{
+	total->allocations += mem_relaxed_load(&profile->allocations);
+	total->bytes += mem_relaxed_load(&profile->bytes);
+	total->blocks += mem_relaxed_load(&profile->blocks);
+	total->live_bytes += mem_relaxed_load(&profile->live_bytes);
+	total->peak_bytes += mem_relaxed_load(&profile->peak_bytes);
+}
+
+// Add up the counters of every site of a heap
+
+static void heap_sum(struct thread_heap *heap, struct mem_site_profile *total)
+{
+	struct site_profile *page;
+	size_t i, j;
+
+	profile_add(total, &heap->unknown);
+	for (i = 0; i < MEM_SITE_PAGES; ++i)
+		if ((page = mem_atomic_load(&heap->profile[i])) != NULL)
+			for (j = 0; j < MEM_SITE_PAGE; ++j)
+				profile_add(total, &page[j]);
+}
+
+// Size class of a block of the given size, marker included; large blocks
+// get MEM_SLAB_CLASSES or more
+
+static size_t slab_class(size_t marker_size)
+{
+	return (marker_size - 1) / MEM_SLAB_GRAIN;
+}
+
+static struct slab *marker_slab(struct marker *marker)
+{
+	if (marker->size == MEM_SIZE_LARGE)
+		return (struct slab *)((char *)marker - MEM_SLAB_HEADER);
+
+	return (struct slab *)((uintptr_t)marker & ~(uintptr_t)(MEM_SLAB_SIZE - 1));
+}
+
+// Number of blocks of a slab, and the block at a position
+
+static size_t slab_blocks(struct slab *slab)
+{
+	if (slab->index == MEM_SLAB_CLASSES)
+		return 1;
+
+	return (MEM_SLAB_SIZE - MEM_SLAB_HEADER) / slab->size;
+}
+
+static struct marker *slab_marker(struct slab *slab, size_t bit)
+{
+	if (slab->index == MEM_SLAB_CLASSES)
+		bit = 0;
+
+	return (struct marker *)((char *)slab + MEM_SLAB_HEADER + bit * slab->size);
+}
+
+static size_t marker_bytes(struct marker *marker)
+{
+	return marker->size == MEM_SIZE_LARGE ?
+		marker_slab(marker)->size : marker->size;
+}
+
+static void slab_link(struct thread_heap *heap, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = heap->slabs;
+	if (slab->next != NULL)
+		slab->next->prev = slab;
+	heap->slabs = slab;
+}
+
+static void slab_unlink(struct thread_heap *heap, struct slab *slab)
+{
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		heap->slabs = slab->next;
+
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+}
+
+//
+// Take a block of a class from the free list of a heap, carving a new slab
+// into blocks of that class when the list is empty.  Only the owner of the
+// heap, or a walk of a heap it owns, may call it.
+//
+static struct marker *slab_take(struct thread_heap *heap, size_t index)
+{
+	struct marker *marker;
+	struct slab *slab;
+	void *page;
+	size_t i;
+
+	if (heap->free[index] == NULL)
+	{
+		if (!mem_page_alloc(&page))
+			return NULL;
+
+		slab = (struct slab *)page;
+		memset(slab, 0, MEM_SLAB_HEADER);
+		slab->owner = heap;
+		slab->size = (index + 1) * MEM_SLAB_GRAIN;
+		slab->index = index;
+		slab_link(heap, slab);
+
+		for (i = slab_blocks(slab); i != 0; --i)
+		{
+			marker = slab_marker(slab, i - 1);
+			memset(marker, 0, offsetof(struct marker, data));
+			marker->data.p = heap->free[index];
+			heap->free[index] = marker;
+		}
+	}
+
+	marker = heap->free[index];
+	heap->free[index] = (struct marker *)marker->data.p;
+	return marker;
+}
+
+//
+// Stop tracking a block, then give it back to the free list of its class,
+// or to malloc when it is large.  Only the owner of the heap, or a walk of
+// a heap it owns, may call it.
+//
+static void heap_release(struct thread_heap *heap, struct marker *marker)
+{
+	struct site_profile *profile;
+	struct slab *slab;
+	size_t bytes = marker_bytes(marker);
+	size_t index = slab_class(offsetof(struct marker, data) + bytes);
+
+	// A block forgotten by mem_init or mem_uninit is no longer tracked
+
+	if (marker->live)
+	{
+		profile = heap_profile(heap, marker->site);
+		marker->live = 0;
+		mem_count(&heap->live_bytes, 0 - bytes);
+		mem_count(&profile->blocks, (size_t)-1);
+		mem_count(&profile->live_bytes, 0 - bytes);
+	}
+
+	if (index < MEM_SLAB_CLASSES)
+	{
+		marker->data.p = heap->free[index];
+		heap->free[index] = marker;
+	}
+	else
+	{
+		slab = marker_slab(marker);
+		slab_unlink(heap, slab);
+		free(slab);
+	}
+}
+
+//
+// Release the blocks that other threads pushed on the remote-free stack of
+// a heap.  Only the owner of the heap, or a walk of a heap it owns, may
+// call it.
+//
+static void heap_drain(struct thread_heap *heap)
+{
+	struct marker *marker, *next;
+
+	marker = (struct marker *)mem_atomic_swap(&heap->remote, NULL);
+
+	while (marker != NULL)
+	{
+		next = (struct marker *)marker->data.p;
+		heap_release(heap, marker);
+		marker = next;
+	}
+}
+
+static void heap_push_remote(struct thread_heap *heap, struct marker *marker)
+{
+	struct marker *head;
+
+	do
+	{
+		head = (struct marker *)mem_atomic_load(&heap->remote);
+		marker->data.p = head;
+	}
+	while (!mem_atomic_cas(&heap->remote, head, marker));
+}
+
+static void heap_reserve(struct thread_heap *heap)
+{
+	heap->epoch = mem_atomic_load(&s_epoch);
+	heap->serial = mem_atomic_add(&s_serial, MEM_SERIAL_BATCH);
+	heap->serial_end = heap->serial + MEM_SERIAL_BATCH;
+}
+
+// Called as a thread exits; the heap waits for another thread
+
+static void MEM_KEY_DECL heap_detach(void *data)
+{
+	struct thread_heap *heap = (struct thread_heap *)data;
+
+	if (heap != NULL)
+		mem_atomic_store(&heap->abandoned, 1);
+}
+
+//
+// Give the calling thread a heap, taking over that of an exited thread
+// when there is one.
+//
+static struct thread_heap *heap_attach(void)
+{
+	struct thread_heap *heap;
+
+	mem_lock(&s_heaps_lock);
+
+	if (!s_heaps_key_created)
+		s_heaps_key_created = mem_key_create(&s_heaps_key, heap_detach);
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+	{
+		if (mem_atomic_load(&heap->abandoned))
+		{
+			heap->abandoned = 0;
+			break;
+		}
+	}
+
+	if (heap == NULL)
+	{
+		heap = (struct thread_heap *)calloc(1, sizeof(*heap));
+
+		if (heap != NULL)
+		{
+			heap->next_heap = s_heaps;
+			s_heaps = heap;
+		}
+	}
+
+	mem_unlock(&s_heaps_lock);
+
+	if (heap != NULL)
+	{
+		t_heap = heap;
+		if (s_heaps_key_created)
+			mem_key_set(s_heaps_key, heap);
+	}
+
+	return heap;
+}
+
+// Whether the calling thread may walk and forget the blocks of a heap: its
+// own, or that of an exited thread, which nobody takes over while the
+// registry lock is held
+
+static int heap_owned(const struct thread_heap *heap)
+{
+	return heap == t_heap || mem_atomic_load(&heap->abandoned);
+}
+
+// Whether a heap is that of the calling thread
+
+static int heap_own(const struct thread_heap *heap)
+{
+	return heap == t_heap;
+}
+
+//
+// Release the blocks waiting on the remote-free stacks of the heaps
+// selected among those the calling thread owns.  The registry lock must
+// be held.
+//
+static void heaps_drain(int (*selected)(const struct thread_heap *))
+{
+	struct thread_heap *heap;
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+		if (selected(heap))
+			heap_drain(heap);
+}
+
+static int marker_newer(const void *a, const void *b)
+{
+	const struct marker *first = *(const struct marker *const *)a;
+	const struct marker *second = *(const struct marker *const *)b;
+	int32_t age = (int32_t)((second->serial - first->serial) << 1);
+
+	return age > 0 ? 1 : age < 0 ? -1 : 0;
+}
+
+//
+// Gather the tracked blocks of the heaps selected among those the calling
+// thread owns from the markers of their slabs and call the visit function
+// for each, newest allocation first.  Should the blocks not fit in memory
+// for sorting, they are visited slab by slab.  The registry lock must be
+// held and the heaps drained.
+//
+static void heaps_walk(int (*selected)(const struct thread_heap *),
+	void (*visit)(struct marker *, void *), void *data)
+{
+	struct mem_site_profile total = { NULL, 0, 0, 0, 0, 0, 0 };
+	struct thread_heap *heap;
+	struct marker **marker = NULL;
+	struct slab *slab;
+	size_t count, found = 0, bit;
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+		if (selected(heap))
+			heap_sum(heap, &total);
+
+	count = total.blocks;
+
+	if (count != 0)
+		marker = (struct marker **)malloc(count * sizeof(*marker));
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+	{
+		if (!selected(heap))
+			continue;
+
+		for (slab = heap->slabs; slab != NULL; slab = slab->next)
+		{
+			for (bit = 0; bit < slab_blocks(slab); ++bit)
+			{
+				if (!slab_marker(slab, bit)->live)
+					continue;
+
+				if (marker != NULL && found < count)
+					marker[found++] = slab_marker(slab, bit);
+				else
+					visit(slab_marker(slab, bit), data);
+			}
+		}
+	}
+
+	if (marker != NULL)
+	{
+		qsort(marker, found, sizeof(*marker), marker_newer);
+		for (bit = 0; bit < found; ++bit)
+			visit(marker[bit], data);
+		free(marker);
+	}
+}
+
+//
+// Forget the blocks of the heaps the calling thread owns, and optionally
+// the peaks of their sites.  The peak of a heap is left alone: it only
+// starts over when the statistics are copied with reset_peak, so that a
+// caller measuring the peak across a mem_init keeps it.  The blocks are
+// no longer tracked, so freeing one later simply releases it.  The
+// registry lock must be held and the heaps drained.
+//
+
+static void profile_empty(struct site_profile *profile, int reset_peak)
+{
+	mem_relaxed_store(&profile->blocks, 0);
+	mem_relaxed_store(&profile->live_bytes, 0);
+	if (reset_peak)
+		mem_relaxed_store(&profile->peak_bytes, 0);
+}
+
+static void heaps_empty(int reset_peak)
+{
+	struct thread_heap *heap;
+	struct slab *slab;
+	size_t page, i;
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+	{
+		if (!heap_owned(heap))
+			continue;
+
+		for (slab = heap->slabs; slab != NULL; slab = slab->next)
+			for (i = 0; i < slab_blocks(slab); ++i)
+				slab_marker(slab, i)->live = 0;
+
+		mem_relaxed_store(&heap->live_bytes, 0);
+
+		profile_empty(&heap->unknown, reset_peak);
+		for (page = 0; page < MEM_SITE_PAGES; ++page)
+			if (heap->profile[page] != NULL)
+				for (i = 0; i < MEM_SITE_PAGE; ++i)
+					profile_empty(&heap->profile[page][i], reset_peak);
+	}
+}
+
+//
+// Initialize the memory subsystem.
+//
+// The blocks tracked by the heap of the calling thread, and by those of
+// the threads that exited, will be forgotten, so that only the allocations
+// made from now on are tracked.  The heaps of the other threads are left
+// alone.
+//
+void mem_init(void)
+{
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+	heaps_empty(1);
+	mem_atomic_add(&s_users, 1);
+	mem_unlock(&s_heaps_lock);
+}
+
+//
+// Uninitialize the memory subsystem an optionally report memory leaks.
+//
+// If the reporting function is specified, walk the tracked blocks of the
+// calling thread and of the threads that exited, newest first, and call
+// the reporting function with the site of each block remaining.  Those
+// blocks are then forgotten; the blocks of the threads still running are
+// neither reported nor forgotten.  Allocations keep working until every
+// mem_init has been matched.
+//
+// Return code 1 means success, 0 means memory was leaked.
+//
+
+struct leak_walk
+{
+	mem_report_pf	report;
+	void			*data;
+	size_t			leaks;
+};
+
+static void mem_report_leak(struct marker *marker, void *data)
+{
+	struct leak_walk *walk = (struct leak_walk *)data;
+	const struct mem_site *site = site_get(marker->site);
+
+	if (walk->report != NULL)
+		walk->report(site->file, site->line, walk->data);
+	walk->leaks += 1;
+}
+
+int mem_uninit(mem_report_pf report, void *data)
+{
+	struct leak_walk walk = { report, data, 0 };
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+	heaps_walk(heap_owned, mem_report_leak, &walk);
+	heaps_empty(0);
+
+	if (mem_atomic_load(&s_users) != 0)
+		mem_atomic_add(&s_users, (size_t)-1);
+	mem_unlock(&s_heaps_lock);
+
+	return walk.leaks == 0;
+}
+
+//
+// Count the outstanding allocations.
+//
+// Like the leaks reported by mem_uninit, the allocations are those of the
+// calling thread and of the threads that exited.  An uninitialized memory
+// subsystem has none.
+//
+size_t mem_allocations(void)
+{
+	struct mem_site_profile total = { NULL, 0, 0, 0, 0, 0, 0 };
+	struct thread_heap *heap;
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+		if (heap_owned(heap))
+			heap_sum(heap, &total);
+
+	mem_unlock(&s_heaps_lock);
+
+	return total.blocks;
+}
+
+//
+// Copy the heap statistics.
+//
+// The statistics are the sums of those of every thread.  When reset_peak
+// is set, the peak of each thread starts over from its bytes currently
+// allocated, so that the next copy gives the peak since this one.  The
+// peak is exact when one thread allocates, and otherwise an upper bound.
+// The counters of a running thread are read as it updates them, so they
+// are only exact for the calling thread and the threads that exited.
+//
+// The statistics of the calling thread alone are exact whatever the other
+// threads do.  The blocks it allocated and another thread freed count as
+// freed once copied.  The serial is shared by every thread either way.
+//
+
+static void heap_statistics(struct thread_heap *heap,
+	struct mem_statistics *statistics, struct mem_site_profile *total,
+	int reset_peak)
+{
+	if (reset_peak)
+		mem_relaxed_store(&heap->peak_bytes,
+			mem_relaxed_load(&heap->live_bytes));
+
+	heap_sum(heap, total);
+	statistics->live_bytes += mem_relaxed_load(&heap->live_bytes);
+	statistics->peak_bytes += mem_relaxed_load(&heap->peak_bytes);
+}
+
+static void statistics_end(struct mem_statistics *statistics,
+	const struct mem_site_profile *total)
+{
+	statistics->allocations = total->allocations;
+	statistics->bytes = total->bytes;
+	statistics->blocks = total->blocks;
+
+	mem_atomic_add(&s_epoch, 1);
+	statistics->serial = mem_atomic_add(&s_serial, 0);
+}
+
+void mem_statistics(struct mem_statistics *statistics, int reset_peak)
+{
+	struct mem_site_profile total = { NULL, 0, 0, 0, 0, 0, 0 };
+	struct thread_heap *heap;
+
+	memset(statistics, 0, sizeof(*statistics));
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+
+	for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+		heap_statistics(heap, statistics, &total, reset_peak);
+
+	mem_unlock(&s_heaps_lock);
+
+	statistics_end(statistics, &total);
+}
+
+void mem_thread_statistics(struct mem_statistics *statistics, int reset_peak)
+{
+	struct mem_site_profile total = { NULL, 0, 0, 0, 0, 0, 0 };
+	struct thread_heap *heap = t_heap;
+
+	memset(statistics, 0, sizeof(*statistics));
+
+	// A thread without a heap takes one now, since the heap of an exited
+	// thread it may take over holds counters already.  Only the owner
+	// allocates from and walks its heap, so no lock is needed to read it.
+
+	if (heap == NULL)
+		heap = heap_attach();
+
+	if (heap != NULL)
+	{
+		heap_drain(heap);
+		heap_statistics(heap, statistics, &total, reset_peak);
+	}
+
+	statistics_end(statistics, &total);
+}
+
+//
+// Walk the allocations made since a given one.
+//
+// Call the block function for each outstanding allocation of the calling
+// thread and of the threads that exited, or of the calling thread alone,
+// newest first, whose number is first or later.  The number is rebuilt
+// from the low bits kept by the marker.
+//
+
+struct block_walk
+{
+	size_t			first;
+	mem_block_pf	block;
+	void			*data;
+};
+
+static void mem_visit_block(struct marker *marker, void *data)
+{
+	struct block_walk *walk = (struct block_walk *)data;
+	const struct mem_site *site = site_get(marker->site);
+	uint32_t after = (marker->serial - (uint32_t)walk->first) &
+		MEM_SERIAL_MASK;
+
+	if (after < 0x40000000u)
+		walk->block(site->file, site->line,
+			marker_bytes(marker), walk->first + after,
+			walk->data);
+}
+
+void mem_blocks(size_t first, mem_block_pf block, void *data)
+{
+	struct block_walk walk = { first, block, data };
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+	heaps_walk(heap_owned, mem_visit_block, &walk);
+	mem_unlock(&s_heaps_lock);
+}
+
+void mem_thread_blocks(size_t first, mem_block_pf block, void *data)
+{
+	struct block_walk walk = { first, block, data };
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_own);
+	heaps_walk(heap_own, mem_visit_block, &walk);
+	mem_unlock(&s_heaps_lock);
+}
+
+//
+// Walk the allocation profile.
+//
+// The counters of each site are summed over the heaps of every thread,
+// and the profile function is called for each site that allocated,
+// largest live bytes first.  Like the peak of the statistics, the peak of
+// a site is exact when one thread allocates there, and otherwise an upper
+// bound.
+//
+// Return code 1 means success, 0 means out of memory.
+//
+
+static int profile_larger(const void *a, const void *b)
+{
+	const struct mem_site_profile *first = (const struct mem_site_profile *)a;
+	const struct mem_site_profile *second = (const struct mem_site_profile *)b;
+
+	if (first->live_bytes != second->live_bytes)
+		return first->live_bytes < second->live_bytes ? 1 : -1;
+	if (first->bytes != second->bytes)
+		return first->bytes < second->bytes ? 1 : -1;
+	return first->allocations < second->allocations ? 1 :
+		first->allocations > second->allocations ? -1 : 0;
+}
+
+int mem_profile(mem_profile_pf profile, void *data)
+{
+	struct mem_site_profile *site;
+	struct thread_heap *heap;
+	size_t sites, count, i;
+
+	mem_lock(&s_heaps_lock);
+	heaps_drain(heap_owned);
+
+	mem_lock(&s_sites_lock);
+	sites = s_sites;
+	mem_unlock(&s_sites_lock);
+
+	site = (struct mem_site_profile *)calloc(sites, sizeof(*site));
+
+	if (site != NULL)
+	{
+		for (heap = s_heaps; heap != NULL; heap = heap->next_heap)
+		{
+			profile_add(&site[0], &heap->unknown);
+			for (i = 1; i < sites; ++i)
+				if (mem_atomic_load(&heap->profile[i / MEM_SITE_PAGE]) != NULL)
+					profile_add(&site[i], heap_profile(heap, (uint32_t)i));
+		}
+	}
+
+	mem_unlock(&s_heaps_lock);
+
+	if (site == NULL)
+		return 0;
+
+	for (count = 0, i = 0; i < sites; ++i)
+	{
+		if (site[i].allocations != 0)
+		{
+			site[count] = site[i];
+			site[count].file = site_get((uint32_t)i)->file;
+			site[count].line = site_get((uint32_t)i)->line;
+			++count;
+		}
+	}
+
+	qsort(site, count, sizeof(*site), profile_larger);
+	for (i = 0; i < count; ++i)
+		profile(&site[i], data);
+
+	free(site);
+	return 1;
+}
+
+//
+// Write the allocation profile to a file.
+//
+// The text format lists the sites as mem_profile walks them, one per line.
+// The pprof format is an uncompressed profile.proto message, which pprof
+// reads as it is; each site becomes a function named after its file and
+// line, with a sample holding the counters of the site.
+//
+
+struct profile_buffer
+{
+	unsigned char	*data;
+	size_t			size;
+	size_t			capacity;
+	int				failed;			// Set once out of memory
+};
+
+struct profile_dump
+{
+	FILE					*file;
+	int						format;		// MEM_PROFILE_*
+	uint64_t				sites;		// Sites written so far
+	struct profile_buffer	profile;	// Message written so far
+	struct profile_buffer	strings;	// String table, written last
+	struct profile_buffer	message;	// Message of a site being built
+	struct profile_buffer	field;		// Field of that message
+};
+
+// Strings of the pprof profile, in the order of the string table, and
+// the type and unit of each sample value as indexes into the table
+
+static const char *const s_profile_strings[] =
+{
+	"", "alloc_objects", "count", "alloc_space", "bytes", "inuse_objects",
+	"inuse_space", "peak_space"
+};
+
+static const unsigned char s_profile_types[][2] =
+{
+	{ 1, 2 }, { 3, 4 }, { 5, 2 }, { 6, 4 }, { 7, 4 }
+};
+
+#define MEM_PROFILE_STRINGS \
+	(sizeof(s_profile_strings) / sizeof(s_profile_strings[0]))
+#define MEM_PROFILE_TYPES (sizeof(s_profile_types) / sizeof(s_profile_types[0]))
+#define MEM_PROFILE_DEFAULT 6		// inuse_space
+
+static void buffer_put(struct profile_buffer *buffer, const void *data,
+	size_t size)
+{
+	unsigned char *grown;
+	size_t capacity;
+
+	if (buffer->failed)
+		return;
+
+	if (buffer->size + size > buffer->capacity)
+	{
+		capacity = buffer->capacity != 0 ? buffer->capacity : 256;
+		while (capacity < buffer->size + size)
+			capacity *= 2;
+
+		grown = (unsigned char *)realloc(buffer->data, capacity);
+		if (grown == NULL)
+		{
+			buffer->failed = 1;
+			return;
+		}
+
+		buffer->data = grown;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void buffer_varint(struct profile_buffer *buffer, uint64_t value)
+{
+	unsigned char byte[10];
+	size_t size = 0;
+
+	while (value >= 0x80)
+	{
+		byte[size++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	byte[size++] = (unsigned char)value;
+
+	buffer_put(buffer, byte, size);
+}
+
+// Append a varint field, or a length-delimited one
+
+static void buffer_field(struct profile_buffer *buffer, unsigned field,
+	uint64_t value)
+{
+	buffer_varint(buffer, (uint64_t)field << 3);
+	buffer_varint(buffer, value);
+}
+
+static void buffer_bytes(struct profile_buffer *buffer, unsigned field,
+	const void *data, size_t size)
+{
+	buffer_varint(buffer, (uint64_t)field << 3 | 2);
+	buffer_varint(buffer, size);
+	buffer_put(buffer, data, size);
+}
+
+// Append the message or the field being built as a field, then empty it
+
+static void buffer_nest(struct profile_buffer *buffer, unsigned field,
+	struct profile_buffer *nested)
+{
+	buffer_bytes(buffer, field, nested->data, nested->size);
+	buffer->failed |= nested->failed;
+	nested->size = 0;
+}
+
+static void dump_string(struct profile_dump *dump, const char *string)
+{
+	buffer_bytes(&dump->strings, 6, string, strlen(string));
+}
+
+//
+// Start a pprof profile with its sample types and fixed strings.
+//
+static void dump_pprof_start(struct profile_dump *dump)
+{
+	size_t i;
+
+	for (i = 0; i < MEM_PROFILE_TYPES; ++i)
+	{
+		buffer_field(&dump->message, 1, s_profile_types[i][0]);
+		buffer_field(&dump->message, 2, s_profile_types[i][1]);
+		buffer_nest(&dump->profile, 1, &dump->message);
+	}
+
+	buffer_field(&dump->profile, 14, MEM_PROFILE_DEFAULT);
+
+	for (i = 0; i < MEM_PROFILE_STRINGS; ++i)
+		dump_string(dump, s_profile_strings[i]);
+}
+
+//
+// Add a site to a pprof profile: a function and a location numbered after
+// the site, and a sample at that location.  The name of the function is
+// followed by its file in the string table.
+//
+static void dump_pprof_site(struct profile_dump *dump,
+	const struct mem_site_profile *site)
+{
+	uint64_t id = ++dump->sites;
+	uint64_t name = MEM_PROFILE_STRINGS + 2 * (id - 1);
+	const char *file = site->file != NULL ? site->file : "(unknown)";
+	char *buffer;
+	int size;
+
+	size = snprintf(NULL, 0, "%s:%d", file, site->line);
+	buffer = (char *)malloc((size_t)size + 1);
+	if (buffer == NULL)
+	{
+		dump->strings.failed = 1;
+		return;
+	}
+	snprintf(buffer, (size_t)size + 1, "%s:%d", file, site->line);
+	dump_string(dump, buffer);
+	dump_string(dump, file);
+	free(buffer);
+
+	buffer_field(&dump->message, 1, id);
+	buffer_field(&dump->message, 2, name);
+	buffer_field(&dump->message, 3, name);
+	buffer_field(&dump->message, 4, name + 1);
+	buffer_field(&dump->message, 5, (uint64_t)site->line);
+	buffer_nest(&dump->profile, 5, &dump->message);
+
+	buffer_field(&dump->field, 1, id);
+	buffer_field(&dump->field, 2, (uint64_t)site->line);
+	buffer_field(&dump->message, 1, id);
+	buffer_nest(&dump->message, 4, &dump->field);
+	buffer_nest(&dump->profile, 4, &dump->message);
+
+	buffer_varint(&dump->field, id);
+	buffer_nest(&dump->message, 1, &dump->field);
+	buffer_varint(&dump->field, site->allocations);
+	buffer_varint(&dump->field, site->bytes);
+	buffer_varint(&dump->field, site->blocks);
+	buffer_varint(&dump->field, site->live_bytes);
+	buffer_varint(&dump->field, site->peak_bytes);
+	buffer_nest(&dump->message, 2, &dump->field);
+	buffer_nest(&dump->profile, 2, &dump->message);
+}
+
+static void dump_site(const struct mem_site_profile *site, void *data)
+{
+	struct profile_dump *dump = (struct profile_dump *)data;
+
+	if (dump->format == MEM_PROFILE_PPROF)
+		dump_pprof_site(dump, site);
+	else
+		fprintf(dump->file, "%14zu %12zu %14zu %14zu %12zu  %s:%d\n",
+			site->live_bytes, site->blocks, site->peak_bytes, site->bytes,
+			site->allocations, site->file != NULL ? site->file : "(unknown)",
+			site->line);
+}
+
+// Write the profile to an open file; 0 on failure
+
+static int profile_dump(FILE *file, int format)
+{
+	struct profile_dump dump;
+	int rc;
+
+	memset(&dump, 0, sizeof(dump));
+	dump.format = format;
+	dump.file = file;
+
+	if (format == MEM_PROFILE_PPROF)
+		dump_pprof_start(&dump);
+	else
+		fprintf(dump.file, "%14s %12s %14s %14s %12s  %s\n", "live bytes",
+			"live blocks", "peak bytes", "bytes", "allocations", "site");
+
+	rc = mem_profile(dump_site, &dump);
+
+	if (format == MEM_PROFILE_PPROF)
+	{
+		buffer_put(&dump.profile, dump.strings.data, dump.strings.size);
+		rc = rc && !dump.profile.failed && !dump.strings.failed &&
+			!dump.message.failed && !dump.field.failed &&
+			fwrite(dump.profile.data, 1, dump.profile.size, dump.file) ==
+			dump.profile.size;
+	}
 
-// 
-// The heap marker is a doubly-linked list of all memory allocations with
-// an attached file and line for each allocation.  
-//
-// The structure is technically variably sized as the 'data' portion of the
-// structure will hold the actual data requested by the calling
-// application. The alignment requirements of the union will ensure that
-// the pointer returned to the caller will be properly aligned.
-//
+	free(dump.profile.data);
+	free(dump.strings.data);
+	free(dump.message.data);
+	free(dump.field.data);
 
-struct marker
+	return fflush(dump.file) == 0 && rc;
+}
+
+int mem_profile_dump(const char *path, int format)
 {
-	struct marker	*prev;
-	struct marker	*next;
-	const char		*file;
-	int				line;
-	union align		data;
-};
+	FILE *file;
+	int rc;
 
-// 
-// Statically declare the head of the doubly-linked list.
+	file = path != NULL ? fopen(path, "wb") : stdout;
+	if (file == NULL)
+		return 0;
 
-static struct marker s_marker_list;
+	rc = profile_dump(file, format);
+	if (path != NULL && fclose(file) != 0)
+		rc = 0;
+
+	return rc;
+}
 
 //
-// Initialize the memory subsystem.
-//
-// The head of the doubly-linked list will be properly configured and the
-// file and line will be set to indicate no association with an actual
-// allocation.
+// Number a block taken for an allocation at a site, and track it in its
+// marker and in the counters of its heap.  The marker is written whole:
+// its fields share a word, which is slow to write piece by piece and read
+// back.
 //
-void mem_init(void)
+static MEM_INLINE void heap_track(struct thread_heap *heap,
+	struct marker *marker, size_t size, uint32_t site)
 {
-	struct marker *list = &s_marker_list;
-	
-	list->prev = list;
-	list->next = list;
-	list->file = NULL;
-	list->line = 0;
+	struct site_profile *profile = heap_profile(heap, site);
+	struct marker tracked;
+	size_t live;
+
+	tracked.site = site;
+	tracked.size = slab_class(offsetof(struct marker, data) + size) <
+		MEM_SLAB_CLASSES ? (uint32_t)size : MEM_SIZE_LARGE;
+	tracked.live = 1;
+	tracked.serial = (uint32_t)heap->serial++ & MEM_SERIAL_MASK;
+	memcpy(marker, &tracked, offsetof(struct marker, data));
+
+	live = mem_relaxed_load(&heap->live_bytes) + size;
+	mem_relaxed_store(&heap->live_bytes, live);
+	if (live > mem_relaxed_load(&heap->peak_bytes))
+		mem_relaxed_store(&heap->peak_bytes, live);
+
+	mem_count(&profile->allocations, 1);
+	mem_count(&profile->bytes, size);
+	mem_count(&profile->blocks, 1);
+	live = mem_relaxed_load(&profile->live_bytes) + size;
+	mem_relaxed_store(&profile->live_bytes, live);
+	if (live > mem_relaxed_load(&profile->peak_bytes))
+		mem_relaxed_store(&profile->peak_bytes, live);
+}
+
+// Whether a heap must release the blocks freed by other threads, or
+// reserve a batch of numbers, before its next allocation
+
+static int heap_stale(struct thread_heap *heap)
+{
+	return mem_atomic_load(&heap->remote) != NULL ||
+		heap->serial == heap->serial_end ||
+		heap->epoch != mem_atomic_load(&s_epoch);
 }
 
 //
-// Uninitialize the memory subsystem an optionally report memory leaks.
+// Take a small block from its free list for a site the heap counts, when
+// the allocation needs nothing more; NULL sends it to heap_alloc.
 //
-// If the reporting function is specified, walk the heap markers and call
-// the reporting function for each marker remaining. 
+static MEM_INLINE struct marker *heap_take(struct thread_heap *heap,
+	size_t size, uint32_t site)
+{
+	size_t index = slab_class(offsetof(struct marker, data) + size);
+	struct marker *marker;
+
+	if (heap == NULL || site == 0 || index >= MEM_SLAB_CLASSES ||
+		heap->free[index] == NULL || heap_stale(heap) ||
+		heap->profile[site / MEM_SITE_PAGE] == NULL)
+		return NULL;
+
+	marker = heap->free[index];
+	heap->free[index] = (struct marker *)marker->data.p;
+	heap_track(heap, marker, size, site);
+
+	return marker;
+}
+
 //
-// Return code 1 means success, 0 means memory was leaked.
+// Allocate a block the long way: give the thread a heap, release the
+// blocks freed by other threads, reserve numbers, intern the site, and
+// carve a slab or allocate a large block as needed.  The site is numbered
+// once for a call site, and otherwise looked up in the cache of the heap.
+// It is kept out of line so that the common case saves no registers.
 //
-int mem_uninit(mem_report_pf report, void *data)
+static MEM_NOINLINE void *heap_alloc(size_t size, const char *file, int line,
+	struct mem_call_site *call)
 {
-	int rc = 1;
+	struct thread_heap	*heap = t_heap;
+	struct marker		*marker;
+	struct slab			*slab = NULL;
+	size_t 				marker_size;
+	size_t				index;
+	uint32_t			site;
+
+	if (heap == NULL && (heap = heap_attach()) == NULL)
+		return NULL;
+
+	// XXX: There is a possibility of size overflow, but I'm not going to
+	// test for that because this is an example.
+
+	marker_size = offsetof(struct marker, data) + size;
+	index = slab_class(marker_size);
 
-	if (s_marker_list.next != &s_marker_list)
+	if (index >= MEM_SLAB_CLASSES)
 	{
-		rc = 0;
+		slab = (struct slab *)malloc(MEM_SLAB_HEADER + marker_size);
+		if (slab == NULL)
+			return NULL;
 
-		if (report != NULL)
-		{
-			struct marker *marker = s_marker_list.next;
+		memset(slab, 0, MEM_SLAB_HEADER);
+		slab->owner = heap;
+		slab->size = size;
+		slab->index = MEM_SLAB_CLASSES;
+	}
 
-			do 
-			{
-				report(marker->file, marker->line, data);
-				marker = marker->next;
-			}
-			while (marker != &s_marker_list);
-		}
+	if (mem_atomic_load(&heap->remote) != NULL)
+		heap_drain(heap);
+
+	if (slab != NULL)
+	{
+		slab_link(heap, slab);
+		marker = slab_marker(slab, 0);
 	}
+	else if ((marker = slab_take(heap, index)) == NULL)
+		return NULL;
 
-	memset(&s_marker_list, 0, sizeof(s_marker_list));
+	if (heap->serial == heap->serial_end ||
+		heap->epoch != mem_atomic_load(&s_epoch))
+		heap_reserve(heap);
 
-	return rc;
+	if (call != NULL && mem_relaxed_load(&call->site) == 0)
+		mem_relaxed_store(&call->site, site_intern(file, line));
+
+	site = call != NULL ? mem_relaxed_load(&call->site) : 0;
+	if (site != 0)
+		site = heap_page(heap, site);
+	else
+		site = heap_site(heap, file, line);
+
+	heap_track(heap, marker, size, site);
+	return &marker->data;
 }
 
 //
 // Allocate memory and record the calling location.
 //
 // A memory region will be allocated with space for both the client
-// requested are and the marker. Once the marker has been configured and
-// linked into the list of memory allocations, return the address of the
-// client's portion of the memory block.
+// requested are and the marker, from a slab of the calling thread's heap
+// or on its own when large. Once the marker has been configured and the
+// block tracked by its slab, return the address of the client's portion of
+// the memory block.  No lock is taken unless the site is new to the heap.
 //
 void *mem_alloc_internal(size_t size, const char *file, int line)
 {
-	struct marker	*list = &s_marker_list;
-	struct marker	*marker;
-	size_t 			marker_size;
-	intptr_t		addr;
+	struct thread_heap	*heap = t_heap;
+	struct site_cache	*cache;
+	struct marker		*marker;
 
-	if (s_marker_list.next == NULL)
+	if (mem_atomic_load(&s_users) == 0)
 		return NULL; // Memory subsytem not initialized
 
-	// XXX: There is a possibility of size overflow, but I'm not going to
-	// test for that because this is an example.
-
-	marker_size = offsetof(struct marker, data) + size;
-	marker = (struct marker *)malloc(marker_size);
+	if (heap != NULL)
+	{
+		cache = &heap->site[site_hash(file, line) % MEM_SITE_CACHE];
+		if (cache->file == file && cache->line == line &&
+			(marker = heap_take(heap, size, cache->site)) != NULL)
+			return &marker->data;
+	}
 
-	if (marker == NULL)
-		return NULL;
+	return heap_alloc(size, file, line, NULL);
+}
 
-	marker->file = file;
-	marker->line = line;
+//
+// Allocate memory for a call site of mem_alloc.
+//
+// The number of the site is kept with the call site the first time it
+// allocates, so the site is neither hashed nor looked up again.
+//
+void *mem_alloc_site(size_t size, struct mem_call_site *call)
+{
+	uint32_t		site = mem_relaxed_load(&call->site);
+	struct marker	*marker;
 
-	// XXX: This is not thread safe because it is an example.
+	if (mem_atomic_load(&s_users) == 0)
+		return NULL; // Memory subsytem not initialized
 
-	marker->next = list->next;
-	marker->prev = list;
-	marker->next->prev = marker;
-	marker->prev->next = marker;
+	if ((marker = heap_take(t_heap, size, site)) != NULL)
+		return &marker->data;
 
-	addr = (intptr_t)marker;
-	addr += offsetof(struct marker, data);
-	
-	return (void *)addr;
+	return heap_alloc(size, call->file, call->line, call);
 }
 
 //
 // Free a memory region.
 //
-// The marker's address will be computed from the client's address and then
-// the marker will be removed from the doubly-linked list. After removal,
-// the block will then be freed by the standard block allocator.
+// The marker's address will be computed from the client's address, and
+// the slab holding the block from the marker.  The block will then stop
+// being tracked and go back to the free list of its size class, or to the
+// standard block allocator when it is large.  A block allocated by another
+// thread is handed back to the heap of that thread instead.
 //
 void mem_free_internal(void *ptr)
 {
-	struct marker	*marker;
-	intptr_t		addr;
+	struct thread_heap	*heap;
+	struct marker		*marker;
 
 	if (ptr == NULL)
 		return;
 
-	addr = (intptr_t)ptr;
-	addr -= offsetof(struct marker, data);
-	marker = (struct marker *)addr;
+	marker = (struct marker *)((char *)ptr - offsetof(struct marker, data));
+	heap = marker_slab(marker)->owner;
+
+	if (heap == t_heap)
+		heap_release(heap, marker);
+	else
+		heap_push_remote(heap, marker);
+}
+
+//
+// An arena carves blocks out of chunks with a bump pointer.  Its first
+// chunk is part of the arena itself; another chunk is added whenever a
+// request does not fit, large enough for that request.  Resetting the
+// arena frees the added chunks and rewinds the first, so releasing every
+// block costs one free per added chunk whatever the number of blocks.
+//
+
+#define MEM_ARENA_CHUNK 4096
+
+struct arena_chunk
+{
+	struct arena_chunk	*next;		// Chunk added before this one
+	union align			data;
+};
+
+struct mem_arena
+{
+	struct arena_chunk	*chunks;	// Added chunks, newest first
+	char				*next;		// Next free byte of the current chunk
+	char				*end;		// End of the current chunk
+	const char			*file;		// Site that created the arena
+	int					line;
+	union align			data;		// First chunk
+};
+
+//
+// Create an arena, recording the calling location for its chunks.
+//
+struct mem_arena *mem_arena_create_internal(const char *file, int line)
+{
+	struct mem_arena *arena;
+
+	arena = (struct mem_arena *)mem_alloc_internal(
+		offsetof(struct mem_arena, data) + MEM_ARENA_CHUNK, file, line);
+
+	if (arena == NULL)
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->next = (char *)&arena->data;
+	arena->end = arena->next + MEM_ARENA_CHUNK;
+	arena->file = file;
+	arena->line = line;
+
+	return arena;
+}
+
+//
+// Allocate a block from an arena.
+//
+// The size is rounded up to keep every block aligned like the blocks of
+// mem_alloc.
+//
+void *mem_arena_alloc(struct mem_arena *arena, size_t size)
+{
+	struct arena_chunk	*chunk;
+	size_t				chunk_size;
+	char				*block;
 
-	// XXX: This is not thread safe because it is an example.
+	size = (size + sizeof(union align) - 1) & ~(sizeof(union align) - 1);
 
-	if (s_marker_list.next != NULL)
+	if ((size_t)(arena->end - arena->next) < size)
 	{
-		// Only remove the item from the list if it looks like the marker
-		// list is initialized.  Skipping this when uninitialized avoid
-		// access violations but still allows memory to be freed.
+		chunk_size = size > MEM_ARENA_CHUNK ? size : MEM_ARENA_CHUNK;
+		chunk = (struct arena_chunk *)mem_alloc_internal(
+			offsetof(struct arena_chunk, data) + chunk_size,
+			arena->file, arena->line);
+
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->next = (char *)&chunk->data;
+		arena->end = arena->next + chunk_size;
+	}
+
+	block = arena->next;
+	arena->next += size;
+
+	return block;
+}
 
-		marker->next->prev = marker->prev;
-		marker->prev->next = marker->next;
-		marker->next = NULL;
-		marker->prev = NULL;
+//
+// Release every block of an arena.
+//
+void mem_arena_reset(struct mem_arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while (arena->chunks != NULL)
+	{
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		mem_free(chunk);
 	}
 
-	free(marker);
+	arena->next = (char *)&arena->data;
+	arena->end = arena->next + MEM_ARENA_CHUNK;
+}
+
+void mem_arena_destroy(struct mem_arena *arena)
+{
+	if (arena == NULL)
+		return;
+
+	mem_arena_reset(arena);
+	mem_free(arena);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -224,9 +1746,87 @@ static void SELF_TEST_FUNC mem_report_self_test(
 	self_test_data->report(msg_leak, file, line);
 }
 
+// Copy the profile of the site at a given line of this file
+
+struct self_test_profile
+{
+	int						line;
+	struct mem_site_profile	site;
+};
+
+static void SELF_TEST_FUNC mem_profile_self_test(
+	const struct mem_site_profile *site, void *data)
+{
+	struct self_test_profile *profile = (struct self_test_profile *)data;
+
+	if (site->file != NULL && strcmp(site->file, __FILE__) == 0 &&
+		site->line == profile->line)
+		profile->site = *site;
+}
+
+// Free a block and allocate another on a thread of its own
+
+struct self_test_thread
+{
+	int		*free;
+	int		*alloc;
+	int		line;
+};
+
+static void SELF_TEST_FUNC mem_thread_self_test(struct self_test_thread *t)
+{
+	mem_free(t->free);
+	t->alloc = mem_create(int); t->line = __LINE__;
+}
+
+#if defined(_MSC_VER)
+static DWORD WINAPI SELF_TEST_FUNC mem_thread_start(LPVOID data)
+{
+	mem_thread_self_test((struct self_test_thread *)data);
+	return 0;
+}
+
+static int SELF_TEST_FUNC mem_thread_run(struct self_test_thread *t)
+{
+	HANDLE thread = CreateThread(NULL, 0, mem_thread_start, t, 0, NULL);
+
+	if (thread == NULL)
+		return 0;
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	return 1;
+}
+#else
+static void * SELF_TEST_FUNC mem_thread_start(void *data)
+{
+	mem_thread_self_test((struct self_test_thread *)data);
+	return NULL;
+}
+
+static int SELF_TEST_FUNC mem_thread_run(struct self_test_thread *t)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, mem_thread_start, t) != 0)
+		return 0;
+
+	pthread_join(thread, NULL);
+	return 1;
+}
+#endif
+
 SELF_TEST(memory, SELF_TEST_LEVEL_1)
 {
 	struct self_test_data data;
+	struct self_test_thread thread;
+	struct self_test_profile profile;
+	struct mem_site_profile dumped;
+	struct mem_statistics statistics;
+	struct mem_arena *arena;
+	FILE *dump = NULL;
+	char text[256], site[256];
+	size_t size;
 	int *p1, *p2;
 	int line;
 	int	rc = 0;
@@ -241,6 +1841,11 @@ SELF_TEST(memory, SELF_TEST_LEVEL_1)
 	p1 = mem_create(int);
 	SELF_TEST_ASSERT(p1 != NULL);
 	mem_free(p1);
+
+	// Catch a slower allocator when checked against a recorded baseline
+
+	SELF_TEST_PERF_ASSERT((p1 = mem_create(int), mem_free(p1), p1),
+		mem_alloc_free, 50);
 	mem_uninit(mem_report_self_test, &data);
 	SELF_TEST_ASSERT(data.leak_count == 0);
 	SELF_TEST_ASSERT(data.line == 0);
@@ -305,9 +1910,199 @@ SELF_TEST(memory, SELF_TEST_LEVEL_1)
 	SELF_TEST_ASSERT(data.line == line);
 	mem_free(p2);
 
+	// Test that a small block is reused once freed, that its marker takes
+	// no more than eight bytes, and that a large block is tracked as well
+
+	data.leak_count = 0;
+	data.line = 0;
+
+	mem_init();
+	p1 = mem_create(int);
+	mem_free(p1);
+	p2 = mem_create(int);
+	SELF_TEST_ASSERT(p2 == p1);
+	mem_free(p2);
+	SELF_TEST_ASSERT(offsetof(struct marker, data) <= 8);
+	p1 = (int *)mem_alloc(MEM_SLAB_SIZE); line = __LINE__;
+	SELF_TEST_ASSERT(p1 != NULL);
+	mem_uninit(mem_report_self_test, &data);
+	SELF_TEST_ASSERT(data.leak_count == 1);
+	SELF_TEST_ASSERT(data.line == line);
+	mem_free(p1);
+
+	// Test an arena: blocks are aligned and apart, a request larger than a
+	// chunk gets a chunk of its own, and a reset releases the added chunks
+
+	data.leak_count = 0;
+	data.line = 0;
+
+	mem_init();
+	arena = mem_arena_create(); line = __LINE__;
+	SELF_TEST_ASSERT(arena != NULL);
+	p1 = (int *)mem_arena_alloc(arena, 1);
+	p2 = (int *)mem_arena_alloc(arena, sizeof(int));
+	SELF_TEST_ASSERT(p1 != NULL && p2 != NULL);
+	SELF_TEST_ASSERT((char *)p2 - (char *)p1 == sizeof(union align));
+	SELF_TEST_ASSERT(mem_arena_alloc(arena, 2 * MEM_ARENA_CHUNK) != NULL);
+	SELF_TEST_ASSERT(mem_allocations() == 2);
+	mem_arena_reset(arena);
+	SELF_TEST_ASSERT(mem_allocations() == 1);
+	SELF_TEST_ASSERT(mem_arena_alloc(arena, sizeof(int)) == p1);
+	mem_uninit(mem_report_self_test, &data);
+	SELF_TEST_ASSERT(data.leak_count == 1);
+	SELF_TEST_ASSERT(data.line == line);
+	mem_arena_destroy(arena);
+
+	// Test that a nested mem_uninit leaves the subsystem initialized
+
+	data.leak_count = 0;
+	data.line = 0;
+
+	mem_init();
+	mem_init();
+	SELF_TEST_ASSERT(mem_uninit(mem_report_self_test, &data));
+	p1 = mem_create(int); line = __LINE__;
+	SELF_TEST_ASSERT(p1 != NULL);
+	mem_uninit(mem_report_self_test, &data);
+	SELF_TEST_ASSERT(data.leak_count == 1);
+	SELF_TEST_ASSERT(data.line == line);
+	mem_free(p1);
+
+	// Test a block freed by another thread, and a leak of another thread
+
+	data.leak_count = 0;
+	data.line = 0;
+
+	mem_init();
+	thread.free = mem_create(int);
+	SELF_TEST_ASSERT(thread.free != NULL);
+	SELF_TEST_ASSERT(mem_thread_run(&thread));
+	SELF_TEST_ASSERT(thread.alloc != NULL);
+	SELF_TEST_ASSERT(mem_allocations() == 1);
+	mem_thread_statistics(&statistics, 0);
+	SELF_TEST_ASSERT(statistics.blocks == 0);
+	SELF_TEST_ASSERT(statistics.live_bytes == 0);
+	mem_uninit(mem_report_self_test, &data);
+	SELF_TEST_ASSERT(data.leak_count == 1);
+	SELF_TEST_ASSERT(data.line == thread.line);
+	mem_free(thread.alloc);
+
+	// Test that a mem_init forgets the live bytes but keeps the peak, here
+	// that of a block larger than the peak so far
+
+	mem_init();
+	mem_thread_statistics(&statistics, 0);
+	size = statistics.peak_bytes + MEM_SLAB_SIZE;
+	p1 = (int *)mem_alloc(size);
+	SELF_TEST_ASSERT(p1 != NULL);
+	mem_free(p1);
+	p1 = mem_create(int);
+	SELF_TEST_ASSERT(p1 != NULL);
+	mem_init();
+	mem_thread_statistics(&statistics, 0);
+	SELF_TEST_ASSERT(statistics.live_bytes == 0);
+	SELF_TEST_ASSERT(statistics.peak_bytes >= size);
+	mem_uninit(NULL, NULL);
+	mem_free(p1);
+	mem_uninit(NULL, NULL);
+
+	// Test the profile of a site: its blocks are counted as they are
+	// allocated and freed, and its peak is kept
+
+	data.leak_count = 0;
+	data.line = 0;
+
+	mem_init();
+	p1 = mem_create(int); p2 = mem_create(int); profile.line = __LINE__;
+	SELF_TEST_ASSERT(p1 != NULL && p2 != NULL);
+	mem_free(p1);
+	memset(&profile.site, 0, sizeof(profile.site));
+	SELF_TEST_ASSERT(mem_profile(mem_profile_self_test, &profile));
+	SELF_TEST_ASSERT(profile.site.allocations >= 2);
+	SELF_TEST_ASSERT(profile.site.bytes >= 2 * sizeof(int));
+	SELF_TEST_ASSERT(profile.site.blocks == 1);
+	SELF_TEST_ASSERT(profile.site.live_bytes == sizeof(int));
+	SELF_TEST_ASSERT(profile.site.peak_bytes == 2 * sizeof(int));
+
+	// Test the text dump: a header, then the site with the same counters
+
+	dump = tmpfile();
+	SELF_TEST_ASSERT(dump != NULL);
+	SELF_TEST_ASSERT(profile_dump(dump, MEM_PROFILE_TEXT));
+	rewind(dump);
+	SELF_TEST_ASSERT(fgets(text, sizeof(text), dump) != NULL);
+	SELF_TEST_ASSERT(strstr(text, "live bytes") != NULL);
+	SELF_TEST_ASSERT(strstr(text, "allocations  site\n") != NULL);
+	snprintf(site, sizeof(site), "%s:%d", __FILE__, profile.line);
+	memset(&dumped, 0, sizeof(dumped));
+	while (dumped.blocks == 0 && fgets(text, sizeof(text), dump) != NULL)
+	{
+		line = 0;
+		if (sscanf(text, "%zu %zu %zu %zu %zu %n", &dumped.live_bytes,
+			&dumped.blocks, &dumped.peak_bytes, &dumped.bytes,
+			&dumped.allocations, &line) != 5 || line == 0 ||
+			strncmp(text + line, site, strlen(site)) != 0 ||
+			text[line + strlen(site)] != '\n')
+			dumped.blocks = 0;
+	}
+	SELF_TEST_ASSERT(dumped.blocks == 1);
+	SELF_TEST_ASSERT(dumped.live_bytes == profile.site.live_bytes);
+	SELF_TEST_ASSERT(dumped.peak_bytes == profile.site.peak_bytes);
+	SELF_TEST_ASSERT(dumped.bytes == profile.site.bytes);
+	SELF_TEST_ASSERT(dumped.allocations == profile.site.allocations);
+
+	mem_free(p2);
+	mem_uninit(mem_report_self_test, &data);
+	SELF_TEST_ASSERT(data.leak_count == 0);
+
 	rc = 1;
 
 failure:
+	if (dump != NULL)
+		fclose(dump);
 	mem_uninit(NULL, NULL);
 	return rc;
 }
+
+////////////////////////////////////////////////////////////////////////
+//
+// Memory Subsystem Benchmarks
+//
+////////////////////////////////////////////////////////////////////////
+
+// Compare the allocator with the standard one for blocks the size of a
+// list node
+
+#define MEM_BENCH_SIZE (2 * sizeof(void *))
+
+SELF_BENCH(mem_alloc_free, SELF_TEST_LEVEL_1)
+{
+	size_t i;
+	void *p;
+
+	mem_init();
+
+	for (i = 0; i < self_bench_iterations; ++i)
+	{
+		p = mem_alloc(MEM_BENCH_SIZE);
+		SELF_BENCH_KEEP(p);
+		mem_free(p);
+	}
+
+	return mem_uninit(NULL, NULL);
+}
+
+SELF_BENCH(malloc_free, SELF_TEST_LEVEL_1)
+{
+	size_t i;
+	void *p;
+
+	for (i = 0; i < self_bench_iterations; ++i)
+	{
+		p = malloc(MEM_BENCH_SIZE);
+		SELF_BENCH_KEEP(p);
+		free(p);
+	}
+
+	return 1;
+}
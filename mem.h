@@ -30,26 +30,151 @@ SOFTWARE.
 
 typedef void (*mem_report_pf)(const char *file, int line, void *data);
 
-// Initialize the memory subsystem
+// Define the function called for each block walked by mem_blocks
+
+typedef void (*mem_block_pf)(const char *file, int line, size_t size,
+	size_t serial, void *data);
+
+// Statistics of the heap
+
+struct mem_statistics
+{
+	size_t	allocations;	// Allocations made since the program started
+	size_t	bytes;			// Bytes allocated since the program started
+	size_t	blocks;			// Outstanding allocations
+	size_t	live_bytes;		// Bytes of the outstanding allocations
+	size_t	peak_bytes;		// Highest live_bytes since the last reset
+	size_t	serial;			// Lowest number of the allocations to come
+};
+
+// The memory subsystem may be used from any number of threads, each of
+// which allocates from a heap of its own.  A block may be freed by any
+// thread.  Do not allocate from the report and block functions.
+
+// Initialize the memory subsystem, forgetting the blocks of the calling
+// thread and of the threads that exited.  It stays initialized until each
+// call has been matched by a call to mem_uninit.
 
 extern void mem_init(void);
 
 // Uninitialize the memory subsystem and report leaks.
-// The report function is used to report the leaks.  
+// The report function is used to report the leaks of the calling thread
+// and of the threads that exited; those of running threads are left alone.
 // The data value is passed to the report function unmodified to inject 
 // a dependency such as a file handle.
 
 extern int mem_uninit(mem_report_pf report, void *data);
 
-// Macros to allocate and release memory
+// Count the outstanding allocations of the calling thread and of the
+// threads that exited
+
+extern size_t mem_allocations(void);
+
+// Copy the heap statistics, optionally starting the peak over; mem_init
+// leaves the peak alone
+
+extern void mem_statistics(struct mem_statistics *statistics, int reset_peak);
+
+// Copy the heap statistics of the calling thread alone
+
+extern void mem_thread_statistics(struct mem_statistics *statistics,
+	int reset_peak);
+
+// Walk the outstanding allocations numbered first or later, such as
+// the allocations made since the statistics gave first as their serial,
+// of the calling thread and of the threads that exited
+
+extern void mem_blocks(size_t first, mem_block_pf block, void *data);
+
+// Walk the outstanding allocations numbered first or later of the calling
+// thread alone
+
+extern void mem_thread_blocks(size_t first, mem_block_pf block, void *data);
+
+// Counters of the allocations made at one site
+
+struct mem_site_profile
+{
+	const char	*file;			// NULL for allocations whose site was lost
+	int			line;
+	size_t		allocations;	// Allocations made since the program started
+	size_t		bytes;			// Bytes allocated since the program started
+	size_t		blocks;			// Outstanding allocations
+	size_t		live_bytes;		// Bytes of the outstanding allocations
+	size_t		peak_bytes;		// Highest live_bytes since mem_init
+};
+
+// Define the function called for each site walked by mem_profile
+
+typedef void (*mem_profile_pf)(const struct mem_site_profile *site,
+	void *data);
+
+enum {
+	MEM_PROFILE_TEXT = 0,			// One site per line, largest live first
+	MEM_PROFILE_PPROF = 1			// Uncompressed profile.proto for pprof
+};
+
+// Walk the sites that allocated, largest live bytes first; 0 when out of
+// memory.  The profile function may allocate.
+
+extern int mem_profile(mem_profile_pf profile, void *data);
+
+// Write the allocation profile to a file, or to the standard output when
+// path is NULL, in a MEM_PROFILE_* format; 0 on failure.  The file names of
+// the sites are copied, so the sites of an unloaded object keep them.
+
+extern int mem_profile_dump(const char *path, int format);
+
+// Arenas hand out blocks that are only released all at once, when the
+// arena is reset or destroyed.  An arena is used by one thread at a time.
+// Its chunks are tracked blocks made at the site that created it, so a
+// leaked arena is reported there, once for each chunk it holds.
+
+struct mem_arena;
+
+#define mem_arena_create() mem_arena_create_internal(__FILE__, __LINE__)
+
+// Allocate a block from an arena; NULL when out of memory
+
+extern void *mem_arena_alloc(struct mem_arena *arena, size_t size);
+
+// Release every block of an arena at once, keeping the arena for reuse
+
+extern void mem_arena_reset(struct mem_arena *arena);
+
+// Release every block of an arena and the arena itself
+
+extern void mem_arena_destroy(struct mem_arena *arena);
+
+// Call site of mem_alloc, numbered the first time it allocates
+
+struct mem_call_site
+{
+	const char		*file;
+	int				line;
+	unsigned int	site;			// Zero until numbered
+};
+
+// Macros to allocate and release memory.  With the GNU tool chain each
+// use of mem_alloc keeps its call site in a static, so that the site is
+// looked up once rather than at every allocation.
 
+#if defined(__GNUC__)
+#define mem_alloc(s) __extension__ ({ \
+	static struct mem_call_site mem_call_site_ = { __FILE__, __LINE__, 0 }; \
+	mem_alloc_site((s), &mem_call_site_); })
+#else
 #define mem_alloc(s) mem_alloc_internal((s), __FILE__, __LINE__)
+#endif
 #define mem_free(p) mem_free_internal(p)
 #define mem_create(s) (s *)mem_alloc(sizeof(s))
 
 // Do not call these internal functions directly
 
 extern void *mem_alloc_internal(size_t size, const char *file, int line);
+extern void *mem_alloc_site(size_t size, struct mem_call_site *call);
 extern void mem_free_internal(void *ptr);
+extern struct mem_arena *mem_arena_create_internal(const char *file,
+	int line);
 
 #endif /* MEM_H */
@@ -21,12 +21,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 
 */
+#include <stdio.h>
 #include "selftest.h"
 
 //
 // Platform-independent entry point for running self-tests.
 //
 
+struct self_test_options self_test_options = { 0 };
+
 static const char SELF_TEST_RO self_test_msg_start[] =
 	"self-test: info: starting self test...";
 
@@ -36,6 +39,25 @@ static const char SELF_TEST_RO self_test_msg_end[] =
 static const char SELF_TEST_RO self_test_msg_failed[] =
 	"self-test: error: self test failed";
 
+static const char SELF_TEST_RO self_test_msg_modules[] =
+	"self-test: info: starting self test of loaded modules...";
+
+static int self_test_verdict(self_test_report_pf report, int passed)
+{
+	if (passed)
+	{
+		report(self_test_msg_end, NULL, 0);
+		sys_self_test_flush();
+		return 1;
+	}
+	else
+	{
+		report(self_test_msg_failed, NULL, 0);
+		sys_self_test_flush();
+		return 0;
+	}
+}
+
 int self_test_run(self_test_report_pf report, unsigned flags)
 {
 	if (report == NULL) 
@@ -43,14 +65,96 @@ int self_test_run(self_test_report_pf report, unsigned flags)
 	
 	report(self_test_msg_start, NULL, 0);
 
-	if (sys_self_test_run(report, flags))
+	return self_test_verdict(report, sys_self_test_run(report, flags));
+}
+
+int self_test_run_modules(self_test_report_pf report, unsigned flags)
+{
+	if (report == NULL)
+		report = sys_self_test_report;
+
+	report(self_test_msg_modules, NULL, 0);
+
+	return self_test_verdict(report, sys_self_test_run_modules(report, flags));
+}
+
+//
+// Platform-independent entry points for running self-tests asynchronously.
+//
+
+int self_test_start_async(self_test_report_pf report, unsigned flags)
+{
+	if (report == NULL)
+		report = sys_self_test_report;
+
+	return sys_self_test_start_async(report, flags);
+}
+
+int self_test_wait(void)
+{
+	return sys_self_test_wait();
+}
+
+//
+// Platform-independent entry point for releasing the self-test pages.
+//
+
+static const char SELF_TEST_RO self_test_msg_released[] =
+	"self-test: info: released %zu bytes of self-test pages";
+
+size_t self_test_release(self_test_report_pf report)
+{
+	char buffer[80];
+	size_t bytes;
+
+	if (report == NULL)
+		report = sys_self_test_report;
+
+	bytes = sys_self_test_release();
+
+	snprintf(buffer, sizeof(buffer), self_test_msg_released, bytes);
+	report(buffer, NULL, 0);
+
+	return bytes;
+}
+
+//
+// Platform-independent entry point for listing self-tests.
+//
+
+size_t self_test_catalog(self_test_catalog_pf visit, void *data)
+{
+	return sys_self_test_catalog(visit, data);
+}
+
+//
+// Platform-independent entry point for running benchmarks.
+//
+
+static const char SELF_TEST_RO self_bench_msg_start[] =
+	"self-bench: info: starting benchmarks...";
+
+static const char SELF_TEST_RO self_bench_msg_end[] =
+	"self-bench: info: benchmarks complete";
+
+static const char SELF_TEST_RO self_bench_msg_failed[] =
+	"self-bench: error: benchmarks failed";
+
+int self_bench_run(self_test_report_pf report, unsigned flags)
+{
+	if (report == NULL)
+		report = sys_self_test_report;
+
+	report(self_bench_msg_start, NULL, 0);
+
+	if (sys_self_bench_run(report, flags))
 	{
-		report(self_test_msg_end, NULL, 0);
+		report(self_bench_msg_end, NULL, 0);
 		return 1;
 	}
 	else
 	{
-		report(self_test_msg_failed, NULL, 0);
+		report(self_bench_msg_failed, NULL, 0);
 		return 0;
 	}
 }
@@ -49,6 +49,98 @@ typedef int (SELF_TEST_DECL *self_test_pf)(
 	self_test_report_pf report	// Pointer to function that reports errors
 );
 
+//
+// Definition of function that runs the measured code of a benchmark for
+// the specified number of iterations and reports errors using the
+// specified reporting function.
+//
+typedef int (SELF_TEST_DECL *self_bench_pf)(
+	self_test_report_pf report,	// Pointer to function that reports errors
+	size_t iterations			// Number of times to run the measured code
+);
+
+//
+// Function called when a self test deferred by the time budget fails.
+//
+// The name is that given to SELF_TEST(), or NULL when the deferred run
+// ended without naming a failed test, for instance because it crashed.
+// The function is called from a background thread.
+//
+typedef void (SELF_TEST_DECL *self_test_deferred_pf)(const char *name);
+
+//
+// Heap statistics of the program.
+//
+// When self_test_options.heap is set, it is called before and after each
+// test to tell how much the test allocated, its peak and what it left
+// behind.  The figures are only meaningful when no other code allocates
+// while the test runs.  When self_test_options.thread_heap is set as
+// well, it gives the same figures for the allocations of the calling
+// thread alone, and is used in place of the former while tests run on
+// several threads.
+//
+
+struct self_test_heap
+{
+	size_t		allocations;	// Allocations made since the program started
+	size_t		bytes;			// Bytes allocated since the program started
+	size_t		blocks;			// Outstanding allocations
+	size_t		live_bytes;		// Bytes of the outstanding allocations
+	size_t		peak_bytes;		// Highest live_bytes since the last reset
+	size_t		serial;			// Lowest number of the allocations to come
+};
+
+//
+// Function filling in the heap statistics; the peak starts over from the
+// live bytes when reset_peak is set.
+//
+typedef void (SELF_TEST_DECL *self_test_heap_pf)(
+	struct self_test_heap *heap, int reset_peak
+);
+
+//
+// Functions walking the outstanding allocations made since a given one.
+//
+// When self_test_options.blocks is set, the allocations a test left
+// behind are reported by site.  Allocations are numbered in the order
+// they are made, and every allocation made after self_test_heap is
+// filled in is numbered at least its serial.  A program that numbers its
+// allocations from zero may use the count of allocations as the serial.
+//
+typedef void (SELF_TEST_DECL *self_test_block_pf)(
+	const char *file, int line, size_t size, size_t serial, void *data
+);
+
+typedef void (SELF_TEST_DECL *self_test_blocks_pf)(
+	size_t first, self_test_block_pf block, void *data
+);
+
+//
+// Functions setting up and tearing down a fixture, the state shared by the
+// self tests of a level.
+//
+// The setup function stores the state in *state and returns non-zero on
+// success.  The teardown function releases the state and returns zero
+// when it finds it damaged, for instance when memory leaked.
+//
+typedef int (SELF_TEST_DECL *self_test_setup_pf)(
+	self_test_report_pf report, void **state
+);
+
+typedef int (SELF_TEST_DECL *self_test_teardown_pf)(
+	self_test_report_pf report, void *state
+);
+
+//
+// Function called by self_test_catalog for each selected self test.
+//
+// The name is that given to SELF_TEST() and the level is numbered from 1,
+// or 0 where the level of a test cannot be told.
+//
+typedef void (SELF_TEST_DECL *self_test_catalog_pf)(
+	const char *name, unsigned level, void *data
+);
+
 //
 // Forward declarations for system-dependent support functions.
 //
@@ -57,10 +149,49 @@ extern void sys_self_test_report(
 	const char *message, const char *file, size_t line
 );
 
+extern void sys_self_test_report_buffered(
+	const char *message, const char *file, size_t line
+);
+
+extern void sys_self_test_flush(void);
+
 extern int sys_self_test_run(
 	self_test_report_pf report, unsigned flags
 );
 
+extern int sys_self_test_run_modules(
+	self_test_report_pf report, unsigned flags
+);
+
+extern int sys_self_bench_run(
+	self_test_report_pf report, unsigned flags
+);
+
+extern size_t sys_self_test_release(void);
+
+extern int sys_self_test_start_async(
+	self_test_report_pf report, unsigned flags
+);
+
+extern int sys_self_test_wait(void);
+
+struct self_test_fixture;
+
+extern void *sys_self_test_fixture(
+	const struct self_test_fixture *fixture, self_test_report_pf report
+);
+
+extern size_t sys_self_test_catalog(self_test_catalog_pf visit, void *data);
+
+struct self_test_perf;
+
+extern int sys_self_test_perf_next(struct self_test_perf *perf);
+
+extern int sys_self_test_perf_check(
+	struct self_test_perf *perf, self_test_report_pf report,
+	const char *file, size_t line
+);
+
 //
 // Self-test structure binding a name to a driver function.
 //
@@ -71,13 +202,142 @@ struct self_test
 	const char		*name;	// Name of the self test
 };
 
+//
+// Self-bench structure binding a name and a level to a benchmark function.
+// The level is the name of the level's section and only orders the
+// benchmarks.
+//
+
+struct self_bench
+{
+	self_bench_pf	func;	// Benchmark function
+	const char		*name;	// Name of the benchmark
+	const char		*level;	// Section name of the level
+};
+
+//
+// Self-test fixture binding a level to the functions that set up and tear
+// down the state its self tests share.  The level is the name of the
+// level's section.
+//
+
+struct self_test_fixture
+{
+	const char				*name;		// Name of the setup function
+	const char				*level;		// Section name of the level
+	self_test_setup_pf		setup;
+	self_test_teardown_pf	teardown;
+};
+
+//
+// Self-test memory budget binding the name of a test to the most bytes it
+// may have allocated at once.
+//
+
+struct self_test_budget
+{
+	const char		*name;		// Name of the self test
+	size_t			bytes;		// Peak of the live bytes allowed
+};
+
+//
+// State of a performance assertion while it measures its code.  It starts
+// zeroed but for the name and tolerance; SELF_TEST_PERF_ASSERT runs the
+// code perf.iterations times for as long as sys_self_test_perf_next
+// returns non-zero.
+//
+
+#define SELF_TEST_PERF_SAMPLES 15
+
+struct self_test_perf
+{
+	const char		*name;		// Name of the baseline
+	double			tolerance;	// Slowdown allowed, in percent
+	size_t			iterations;	// Runs of the code in one sample
+	int				phase;		// Calibration, warm-up or sampling
+	int				samples;	// Samples taken in the phase
+	unsigned long long	start_ns;	// Start of the sample in progress
+	double			sample[SELF_TEST_PERF_SAMPLES];	// Nanoseconds per run
+};
+
+//
+// Self-test dependency binding the name of a test to the names of the
+// tests it needs, separated by commas.
+//
+
+struct self_test_depends
+{
+	const char		*name;		// Name of the dependent self test
+	const char		*depends;	// Names of the self tests it needs
+};
+
 enum {
 	SELF_TEST_FLAG_NONE = 0,				// No flag
-	SELF_TEST_FLAG_STOP_ON_FAILURE = 1		// Stop self test on error
+	SELF_TEST_FLAG_STOP_ON_FAILURE = 1,		// Stop self test on error
+	SELF_TEST_FLAG_PARALLEL = 2,			// Run each level's tests concurrently
+	SELF_TEST_FLAG_TIMING = 4,				// Report the time taken by each test
+	SELF_TEST_FLAG_ISOLATE = 8,				// Run each test in a worker process
+	SELF_TEST_FLAG_FORCE = 16,				// Run tests found passed in the cache
+	SELF_TEST_FLAG_COUNTERS = 32,			// Report performance counters
+	SELF_TEST_FLAG_RECORD_BASELINE = 64		// Record performance baselines
 };
 
+enum {
+	SELF_TEST_OUTPUT_TEXT = 0,				// Messages only
+	SELF_TEST_OUTPUT_JSON = 1,				// Also a JSON Lines record per test
+	SELF_TEST_OUTPUT_TAP = 2				// Also a TAP result per test
+};
+
+//
+// Settings of the self-test runners.
+//
+// Set the fields before calling self_test_run; a field left to zero
+// selects the default value of its setting.
+//
+
+struct self_test_options
+{
+	unsigned		timeout_ms;		// Time limit of an isolated test
+	const char		*cache_path;	// File of the result cache; NULL for none
+	unsigned		budget_us;		// Time budget of the run; 0 for none
+	self_test_deferred_pf	deferred_failure;	// Called on deferred failure
+	int				output_format;	// SELF_TEST_OUTPUT_*
+	const char		*output_path;	// File of the records; NULL for stdout
+	self_test_heap_pf	heap;			// Heap statistics; NULL for none
+	self_test_blocks_pf	blocks;			// Walks the allocations; NULL for none
+	self_test_heap_pf	thread_heap;	// Heap statistics of the calling thread
+	self_test_blocks_pf	thread_blocks;	// Walks its allocations
+	unsigned		shard_index;	// Shard to run, from 0 to shard_count - 1
+	unsigned		shard_count;	// Number of shards; 0 or 1 runs every test
+	const char		*include;		// Globs of the tests to run; NULL for all
+	const char		*exclude;		// Globs of the tests to leave out
+	const char		*baseline_path;	// File of the performance baselines
+	const char		*companion_path;	// Self tests of a stripped build
+};
+
+extern struct self_test_options self_test_options;
+
 #define SELF_TEST_SYSTEM_REPORT NULL
 
+//
+// Buffered reporting function.
+//
+// Pass SELF_TEST_BUFFERED_REPORT to self_test_run in place of a report
+// function to queue messages instead of writing them as they are reported.
+// Reporting threads only wait on the output when the queue is full, as no
+// message is ever dropped; a background thread writes the messages in
+// batches, grouped by test in the order the tests are defined, so the
+// output of a parallel run reads like a serial one.  Each message starts
+// with the time it was reported at, in seconds on the monotonic clock, as
+// the grouping leaves it out of order.  self_test_run writes out
+// everything queued before it returns, and the background thread then
+// stops until the next message.
+//
+// Where threads are not supported, the messages are written directly.
+//
+
+#define SELF_TEST_BUFFERED_REPORT sys_self_test_report_buffered
+
 //
 // Main driver function that runs all defined self tests.
 //
@@ -87,8 +347,179 @@ enum {
 // The report parameter is optional. When NULL, this function uses
 // the default platform-specific reporting function sys_self_test_report.
 //
+// With SELF_TEST_FLAG_PARALLEL, the tests within a level run at the same
+// time on a pool of threads and each level completes before the next one
+// starts. The report function must then be safe to call from several
+// threads at once. The flag is ignored where threads are not supported.
+//
+// When tests declare their dependencies with SELF_TEST_DEPENDS, the tests
+// run in dependency order instead: a test starts as soon as the tests it
+// names have passed, and the other tests still wait for the levels below
+// their own.  A test whose dependency failed is skipped, and the tests of
+// a dependency cycle fail.  Tests are taken in the order they are defined
+// among those ready.  Once the time budget is spent, only the tests of the
+// first level start, and the tests that did not start are deferred.
+// Dependencies are ignored where they are not supported.
+//
+// With SELF_TEST_FLAG_TIMING, the wall and CPU time of each test are
+// reported after the test, followed by the totals of each level and a
+// list of the slowest tests once all tests have run. All of it goes
+// through the report function like any other message.
+//
+// With SELF_TEST_FLAG_ISOLATE, each test runs in a worker process, so a
+// test that crashes, or runs longer than self_test_options.timeout_ms
+// (10 seconds by default), fails without taking down the run. The messages
+// of each test are reported together once it completes. Combine it with
+// SELF_TEST_FLAG_PARALLEL to run the tests of a level on several workers.
+// The flag is ignored where processes cannot be forked.
+//
+// With SELF_TEST_FLAG_COUNTERS, the instructions, cycles, cache misses,
+// branch misses and page faults of each test are reported after the test.
+// Where the hardware counters cannot be read, the page faults and context
+// switches are reported instead.  The flag is ignored where counters are
+// not supported.
+//
+// When self_test_options.output_format is SELF_TEST_OUTPUT_JSON or
+// SELF_TEST_OUTPUT_TAP, a record is written to self_test_options.output_path
+// as each test finishes, in addition to the messages.  Records hold the
+// name, level, status and duration of the test, the location of its failed
+// assertion, and its heap figures when self_test_options.heap is set.  A
+// TAP stream covers every run of the process, with one header and a plan
+// written as the process exits.  Without a path the records go to standard
+// output, flushing its stdio buffer first, and the plan follows whatever
+// the program wrote there; give a path to keep the stream apart.  Names
+// and files too long for a record are cut short.  The setting is ignored
+// where it is not supported.
+//
+// When self_test_options.heap is set, the allocations, bytes and peak
+// bytes of each test are measured, and a test that leaves allocations
+// behind or peaks over the budget declared by SELF_TEST_MEMORY_BUDGET
+// fails.  With self_test_options.blocks, each leaked allocation is
+// reported at the file and line that made it.  With SELF_TEST_FLAG_TIMING
+// the figures are reported after each test.  The statistics cover the
+// whole heap, so with SELF_TEST_FLAG_PARALLEL each thread checks its tests
+// against self_test_options.thread_heap and thread_blocks, which leave
+// out the allocations of the threads a test starts.  Without them, the
+// tests run one at a time.  SELF_TEST_FLAG_ISOLATE needs neither, as each
+// worker process runs one test at a time.  Heap accounting is ignored
+// where it is not supported.
+//
+// When self_test_options.include holds a list of glob patterns separated
+// by commas, such as "list,mem*", only the tests whose name matches one of
+// them are run; the tests matching self_test_options.exclude are left out.
+// The patterns are ignored where they are not supported.
+//
+// When self_test_options.shard_count is above one, only the tests whose
+// name hashes to self_test_options.shard_index are run, level by level as
+// usual.  Running every shard, in any number of processes or machines,
+// runs every test exactly once.  The JSON records of the shards can be
+// combined by the selftest_merge tool.  The setting is ignored where it is
+// not supported.
+//
+// When self_test_options.cache_path names a file, the tests that passed on
+// an earlier run of the same build on the same host are reported as cached
+// instead of being run.  SELF_TEST_FLAG_FORCE runs them all and refreshes
+// the file.  The cache is ignored where it is not supported.
+//
+// When self_test_options.baseline_path names a file of baselines, each
+// SELF_TEST_PERF_ASSERT measures its code and fails the test when one run
+// of it takes longer than its baseline by more than the tolerance.  An
+// assertion without a baseline passes without measuring anything.  With
+// SELF_TEST_FLAG_RECORD_BASELINE, the assertions record their measurement
+// in the file instead, and every test runs whatever the cache holds.
+// Performance assertions pass where they are not supported.
+//
+// When self_test_options.budget_us is set, the levels run in order until
+// the budget is spent, and the verdict covers those levels only.  The
+// levels left over run in the background at low priority; a failure among
+// them is passed to self_test_options.deferred_failure, or reported when
+// no function is set.  Every level runs up front where this is not
+// supported.
+//
 extern int self_test_run(self_test_report_pf report, unsigned flags);
 
+//
+// Driver function that runs the self tests of the shared objects loaded
+// since the last run.
+//
+// Under Linux, self_test_run finds the tests of every shared object loaded
+// with dlopen() at the time, as well as those of the program, and reports
+// the results of each object at the end.  Call self_test_run_modules after
+// loading plugins to run the tests of the objects that have not run yet,
+// with the same flags and return value as self_test_run.  A shared object
+// whose tests use fixtures or performance assertions needs the program to
+// export the runner, for instance by linking it with -rdynamic.
+//
+// Where shared objects are not supported, this function reports so and
+// returns non-zero.
+//
+extern int self_test_run_modules(self_test_report_pf report, unsigned flags);
+
+//
+// Asynchronous driver functions that run all defined self tests while the
+// application keeps initializing.
+//
+// self_test_start_async starts what self_test_run would do and returns at
+// once; self_test_wait waits for it to finish and returns its verdict with
+// the same meaning as the return value of self_test_run. Start the self
+// tests as early as possible and wait for them right before the first real
+// work, so that the latency of the self tests overlaps initialization.
+//
+// Under Linux the self tests run in a child process. Tests that reset
+// global state, such as the mem subsystem, then cannot disturb the state
+// the application is building up meanwhile, and a test that crashes
+// fails the verdict instead of taking the application down. Where this
+// is not supported, the self tests run synchronously in
+// self_test_start_async.
+//
+// self_test_start_async returns zero if the self tests could not be
+// started. self_test_wait returns zero when no self tests were started.
+//
+extern int self_test_start_async(self_test_report_pf report, unsigned flags);
+extern int self_test_wait(void);
+
+//
+// Release the memory pages of the self-test code and data.
+//
+// Call this once self_test_run has returned to stop paying for the
+// self-test code and data in the resident set of a long-running process.
+// The number of bytes reclaimed is reported using the report function,
+// which is optional as for self_test_run, and returned. Self tests and
+// benchmarks cannot run anymore once their pages have been released, but
+// self_test_run_modules still runs the self tests of the shared objects
+// loaded afterwards, whose pages are their own.
+//
+// Where pages cannot be released this function does nothing and
+// returns zero.
+//
+extern size_t self_test_release(self_test_report_pf report);
+
+//
+// List the self tests without running them.
+//
+// The visit function is called for each self test selected by the include,
+// exclude and shard settings of self_test_options, in order of name.  The
+// number of tests listed is returned.  Where the settings are not
+// supported, every self test is listed in the order it is found.  Nothing
+// is listed once the self-test pages have been released.
+//
+extern size_t self_test_catalog(self_test_catalog_pf visit, void *data);
+
+//
+// Main driver function that runs all defined benchmarks.
+//
+// Benchmarks run one at a time in level order. The iteration count of each
+// benchmark is doubled until one sample takes long enough to be measured
+// reliably, then a few warm-up samples are discarded and the minimum,
+// median and 99th percentile time per iteration of the remaining samples
+// are reported using the report function.
+//
+// The report parameter is optional, as for self_test_run. The flags are
+// the self-test flags; SELF_TEST_FLAG_STOP_ON_FAILURE stops at the first
+// benchmark that reports a failure.
+//
+extern int self_bench_run(self_test_report_pf report, unsigned flags);
+
 //
 // CREATING A SELF-TEST
 //
@@ -99,6 +530,14 @@ extern int self_test_run(self_test_report_pf report, unsigned flags);
 // SELF_TEST_ASSERT(x) - Jump to local label 'failure' when 'x' is not true
 // SELT_TEST_RO - Variable decoration needed to install the variable into
 //                the read-only self-test section
+// SELF_BENCH(n,l) - Define a benchmark function 'n' ordered at level 'l';
+//                   the body runs its measured code self_bench_iterations
+//                   times
+// SELF_BENCH_KEEP(x) - Keep the compiler from optimizing away the
+//                      computation of 'x' inside a benchmark
+// SELF_TEST_PERF_ASSERT(x,n,t) - Jump to local label 'failure' when one
+//                                evaluation of 'x' takes more than 't'
+//                                percent longer than its baseline 'n'
 //
 // EXAMPLE
 //
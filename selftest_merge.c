@@ -0,0 +1,359 @@
+/*
+
+Copyright (c) 2020 Ethan D. Frolich
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/*
+
+Merge the JSON Lines records of a sharded self-test run.
+
+	selftest_merge shard0.jsonl shard1.jsonl ...
+
+Each file holds the records written by one shard with the JSON output
+format.  The records are combined into a single verdict and a timing
+report on standard output: the tests of each level, the time each shard
+spent and the slowest tests.  A test found in more than one file is
+reported, since every test belongs to exactly one shard.
+
+Tests skipped because a dependency failed are counted apart from those
+that passed.  The exit status is zero when no test failed, one when a
+test failed and two when the files could not be read.
+
+The tool only depends on the standard C library.  Build it on its own:
+
+	cc -o selftest_merge selftest_merge.c
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LEVEL_COUNT 10
+#define SLOWEST_COUNT 10
+
+struct test
+{
+	char			name[128];
+	char			file[128];		// Location of the failed assertion
+	long			line;
+	int				level;			// From 1 to LEVEL_COUNT
+	int				failed;
+	int				cached;
+	int				skipped;		// A dependency failed or was skipped
+	double			duration_ms;
+	size_t			shard;			// Index of the file
+};
+
+static struct test *s_test;
+static size_t s_tests;
+static size_t s_capacity;
+
+// Parse a JSON string into buffer; return the character after it, or NULL
+
+static const char *parse_string(const char *p, char *buffer, size_t size)
+{
+	size_t used = 0;
+	unsigned code;
+	char c;
+
+	if (*p++ != '"')
+		return NULL;
+
+	while (*p != '"')
+	{
+		if (*p == '\0')
+			return NULL;
+
+		c = *p++;
+		if (c == '\\')
+		{
+			c = *p++;
+			switch (c)
+			{
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'u':
+				if (sscanf(p, "%4x", &code) != 1)
+					return NULL;
+				p += 4;
+				c = code < 0x80 ? (char)code : '?';
+				break;
+			case '\0':
+				return NULL;
+			}
+		}
+
+		if (used + 1 < size)
+			buffer[used++] = c;
+	}
+
+	buffer[used] = '\0';
+	return p + 1;
+}
+
+static const char *skip_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		++p;
+	return p;
+}
+
+// Parse one record; only the fields used by the report are kept
+
+static int parse_record(const char *p, struct test *test)
+{
+	char key[32], value[128];
+	char *end;
+	double number;
+
+	memset(test, 0, sizeof(*test));
+
+	p = skip_space(p);
+	if (*p++ != '{')
+		return 0;
+
+	for (;;)
+	{
+		p = skip_space(p);
+		if (*p == '}')
+			break;
+
+		p = parse_string(p, key, sizeof(key));
+		if (p == NULL)
+			return 0;
+
+		p = skip_space(p);
+		if (*p++ != ':')
+			return 0;
+		p = skip_space(p);
+
+		if (*p == '"')
+		{
+			p = parse_string(p, value, sizeof(value));
+			if (p == NULL)
+				return 0;
+
+			if (strcmp(key, "name") == 0)
+				strcpy(test->name, value);
+			else if (strcmp(key, "file") == 0)
+				strcpy(test->file, value);
+			else if (strcmp(key, "status") == 0)
+			{
+				test->failed = strcmp(value, "fail") == 0;
+				test->cached = strcmp(value, "cached") == 0;
+				test->skipped = strcmp(value, "skip") == 0;
+			}
+		}
+		else
+		{
+			number = strtod(p, &end);
+			if (end == p)
+				return 0;
+			p = end;
+
+			if (strcmp(key, "level") == 0)
+				test->level = (int)number;
+			else if (strcmp(key, "line") == 0)
+				test->line = (long)number;
+			else if (strcmp(key, "duration_ms") == 0)
+				test->duration_ms = number;
+		}
+
+		p = skip_space(p);
+		if (*p == ',')
+			++p;
+		else if (*p != '}')
+			return 0;
+	}
+
+	return test->name[0] != '\0' && test->level >= 1 &&
+		test->level <= LEVEL_COUNT;
+}
+
+static int add_test(const struct test *test)
+{
+	struct test *grown;
+	size_t size;
+
+	if (s_tests == s_capacity)
+	{
+		size = s_capacity ? s_capacity * 2 : 64;
+		grown = (struct test *)realloc(s_test, size * sizeof(*grown));
+		if (grown == NULL)
+			return 0;
+		s_test = grown;
+		s_capacity = size;
+	}
+
+	s_test[s_tests++] = *test;
+	return 1;
+}
+
+static int read_shard(const char *path, size_t shard)
+{
+	struct test test;
+	char line[4096];
+	size_t number = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+	{
+		fprintf(stderr, "selftest_merge: error: cannot open %s\n", path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		++number;
+		if (*skip_space(line) == '\0')
+			continue;
+
+		if (!parse_record(line, &test))
+		{
+			fprintf(stderr, "%s:%zu: warning: record ignored\n", path, number);
+			continue;
+		}
+
+		test.shard = shard;
+		if (!add_test(&test))
+		{
+			fclose(file);
+			fprintf(stderr, "selftest_merge: error: out of memory\n");
+			return 0;
+		}
+	}
+
+	fclose(file);
+	return 1;
+}
+
+static int compare_name(const void *a, const void *b)
+{
+	const struct test *ta = (const struct test *)a;
+	const struct test *tb = (const struct test *)b;
+
+	return strcmp(ta->name, tb->name);
+}
+
+static int compare_slowest(const void *a, const void *b)
+{
+	const struct test *ta = (const struct test *)a;
+	const struct test *tb = (const struct test *)b;
+
+	if (ta->duration_ms != tb->duration_ms)
+		return ta->duration_ms < tb->duration_ms ? 1 : -1;
+	return strcmp(ta->name, tb->name);
+}
+
+int main(int argc, char **argv)
+{
+	size_t count[LEVEL_COUNT] = { 0 };
+	double total[LEVEL_COUNT] = { 0 };
+	double longest[LEVEL_COUNT] = { 0 };
+	size_t passed = 0, failed = 0, cached = 0, skipped = 0, shards, i, j;
+	double shard_ms;
+	int level;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: selftest_merge shard.jsonl...\n");
+		return 2;
+	}
+
+	shards = (size_t)argc - 1;
+	for (i = 0; i < shards; ++i)
+		if (!read_shard(argv[i + 1], i))
+			return 2;
+
+	// A test found twice means the shards did not split the same suite
+
+	qsort(s_test, s_tests, sizeof(*s_test), compare_name);
+	for (i = 1; i < s_tests; ++i)
+		if (strcmp(s_test[i - 1].name, s_test[i].name) == 0)
+			printf("self-test: warning: test %s found in %s and %s\n",
+				s_test[i].name, argv[s_test[i - 1].shard + 1],
+				argv[s_test[i].shard + 1]);
+
+	for (i = 0; i < s_tests; ++i)
+	{
+		level = s_test[i].level - 1;
+		++count[level];
+		total[level] += s_test[i].duration_ms;
+		if (s_test[i].duration_ms > longest[level])
+			longest[level] = s_test[i].duration_ms;
+
+		if (s_test[i].failed)
+		{
+			++failed;
+			if (s_test[i].file[0] != '\0')
+				printf("%s:%ld: error: test %s failed\n", s_test[i].file,
+					s_test[i].line, s_test[i].name);
+			else
+				printf("self-test: error: test %s failed\n", s_test[i].name);
+		}
+		else if (s_test[i].cached)
+			++cached;
+		else if (s_test[i].skipped)
+			++skipped;
+		else
+			++passed;
+	}
+
+	for (level = 0; level < LEVEL_COUNT; ++level)
+		if (count[level] != 0)
+			printf("self-test: info: level %d: %zu tests, total %.3f ms, "
+				"longest %.3f ms\n", level + 1, count[level], total[level],
+				longest[level]);
+
+	for (i = 0; i < shards; ++i)
+	{
+		for (shard_ms = 0, j = 0; j < s_tests; ++j)
+			if (s_test[j].shard == i)
+				shard_ms += s_test[j].duration_ms;
+		printf("self-test: info: shard %s: %.3f ms\n", argv[i + 1], shard_ms);
+	}
+
+	qsort(s_test, s_tests, sizeof(*s_test), compare_slowest);
+	if (s_tests != 0)
+		printf("self-test: info: slowest tests:\n");
+	for (i = 0; i < s_tests && i < SLOWEST_COUNT; ++i)
+		printf("self-test: info: %3zu. %s: %.3f ms\n", i + 1, s_test[i].name,
+			s_test[i].duration_ms);
+
+	printf("self-test: info: %zu tests from %zu shards: %zu passed, "
+		"%zu failed, %zu cached, %zu skipped\n", s_tests, shards, passed,
+		failed, cached, skipped);
+
+	if (failed != 0)
+	{
+		printf("self-test: error: self test failed\n");
+		return 1;
+	}
+
+	printf("self-test: info: self test complete\n");
+	return 0;
+}
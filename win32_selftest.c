@@ -26,6 +26,7 @@ SOFTWARE.
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <stdio.h>
+#include <string.h>
 #include <crtdbg.h>
 
 /*
@@ -84,9 +85,81 @@ void sys_self_test_report(
 	OutputDebugStringA(buffer);
 }
 
+// Messages are not queued under Windows; the debugger output is written
+// as each message is reported
+
+void sys_self_test_report_buffered(
+	const char *message, const char *file, size_t line)
+{
+	sys_self_test_report(message, file, line);
+}
+
+void sys_self_test_flush(void)
+{
+}
+
+// Fixtures set up by the running test; they are torn down when it returns
+
+#define WIN32_FIXTURE_COUNT 16
+
+static struct
+{
+	const struct self_test_fixture	*fixture;
+	void							*state;
+} s_fixture[WIN32_FIXTURE_COUNT];
+
+static size_t s_fixtures = 0;
+
+void *sys_self_test_fixture(const struct self_test_fixture *fixture,
+	self_test_report_pf report)
+{
+	static const char SELF_TEST_RO msg_setup[] =
+		"self-test: error: fixture setup failed";
+
+	void *state = NULL;
+	size_t i;
+
+	for (i = 0; i < s_fixtures; ++i)
+		if (s_fixture[i].fixture == fixture)
+			return s_fixture[i].state;
+
+	if (s_fixtures == WIN32_FIXTURE_COUNT || !fixture->setup(report, &state))
+	{
+		report(msg_setup, NULL, 0);
+		return NULL;
+	}
+
+	s_fixture[s_fixtures].fixture = fixture;
+	s_fixture[s_fixtures].state = state;
+	++s_fixtures;
+	return state;
+}
+
+static int fixture_leave(self_test_report_pf report)
+{
+	static const char SELF_TEST_RO msg_teardown[] =
+		"self-test: error: fixture teardown failed";
+
+	int rc = 1;
+
+	while (s_fixtures > 0)
+	{
+		--s_fixtures;
+		if (!s_fixture[s_fixtures].fixture->teardown(report,
+			s_fixture[s_fixtures].state))
+		{
+			report(msg_teardown, NULL, 0);
+			rc = 0;
+		}
+	}
+
+	return rc;
+}
+
 int sys_self_test_run(self_test_report_pf report, unsigned flags)
 {
 	const struct self_test **test;
+	int passed;
 	int rc;
 
 	test = &win32_self_test_start;
@@ -99,7 +172,13 @@ int sys_self_test_run(self_test_report_pf report, unsigned flags)
 			if ((*test)->name != NULL) 
 				report((*test)->name, NULL, 0);
 
-			if (!(*test)->func(report)) 
+			// The fixtures of a test are torn down as soon as it returns
+
+			passed = (*test)->func(report);
+			if (!fixture_leave(report))
+				passed = 0;
+
+			if (!passed)
 			{
 				if (flags & SELF_TEST_FLAG_STOP_ON_FAILURE) 
 					return 0;
@@ -116,4 +195,87 @@ int sys_self_test_run(self_test_report_pf report, unsigned flags)
 
 	return rc;
 }
+
+// Verdict of the self tests started by sys_self_test_start_async; the
+// tests run synchronously on this platform
+
+static int s_async_verdict = 0;
+
+int sys_self_test_start_async(self_test_report_pf report, unsigned flags)
+{
+	s_async_verdict = self_test_run(report, flags);
+	return 1;
+}
+
+int sys_self_test_wait(void)
+{
+	int verdict = s_async_verdict;
+
+	s_async_verdict = 0;
+	return verdict;
+}
+
+// The level of a test cannot be told from the scan of the descriptor
+// pointers, and the selection settings are not supported; list every test
+
+size_t sys_self_test_catalog(self_test_catalog_pf visit, void *data)
+{
+	static const char SELF_TEST_RO prefix[] = "self-test: info: test ";
+
+	const struct self_test **test;
+	const char *name;
+	size_t count = 0;
+
+	for (test = &win32_self_test_start + 1; test < &win32_self_test_end;
+		++test)
+	{
+		if ((*test) == NULL || (*test)->name == NULL)
+			continue;
+
+		name = (*test)->name;
+		if (strncmp(name, prefix, sizeof(prefix) - 1) == 0)
+			name += sizeof(prefix) - 1;
+
+		visit(name, 0, data);
+		++count;
+	}
+
+	return count;
+}
+
+int sys_self_test_perf_next(struct self_test_perf *perf)
+{
+	return 0;
+}
+
+int sys_self_test_perf_check(struct self_test_perf *perf,
+	self_test_report_pf report, const char *file, size_t line)
+{
+	return 1;
+}
+
+size_t sys_self_test_release(void)
+{
+	// Releasing the self-test pages is not implemented under Windows
+
+	return 0;
+}
+
+int sys_self_test_run_modules(self_test_report_pf report, unsigned flags)
+{
+	static const char SELF_TEST_RO msg_unsupported[] =
+		"self-test: warning: loaded modules are not tested on this platform";
+
+	report(msg_unsupported, NULL, 0);
+	return 1;
+}
+
+int sys_self_bench_run(self_test_report_pf report, unsigned flags)
+{
+	static const char SELF_TEST_RO msg_unsupported[] =
+		"self-bench: warning: benchmarks are not supported on this platform";
+
+	report(msg_unsupported, NULL, 0);
+	return 1;
+}
 #endif /* WIN32_SELFTEST_H */
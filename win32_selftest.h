@@ -76,6 +76,59 @@ SOFTWARE.
 		&self_test_desc_##n; \
 	int SELF_TEST_FUNC self_test_##n(self_test_report_pf self_test_report)
 
+// Benchmarks are not registered under the Microsoft tool chain; the
+// function is still compiled into the self-test code section so the
+// benchmark keeps building.
+
+#define SELF_BENCH(n,l) \
+	int SELF_TEST_FUNC self_bench_##n(self_test_report_pf self_test_report, \
+		size_t self_bench_iterations)
+
+#define SELF_BENCH_KEEP(x) \
+	do { volatile size_t keep = (size_t)(x); (void)keep; } while(0)
+
+// Dependencies are not registered under the Microsoft tool chain, where
+// the tests run level by level; the declaration is kept as a string.
+
+#define SELF_TEST_DEPENDS(n,...) \
+	static const char SELF_TEST_RO self_test_dep_list_##n[] = # __VA_ARGS__
+
+// Fixtures are not registered under the Microsoft tool chain; the
+// descriptor is found through SELF_TEST_FIXTURE_STATE(), which sets the
+// fixture up for the running test only.
+
+#define SELF_TEST_FIXTURE(l,s,t) \
+	static const char SELF_TEST_RO self_test_fixture_name_##s[] = # s; \
+	static const char SELF_TEST_RO self_test_fixture_level_##s[] = l; \
+	static const struct self_test_fixture SELF_TEST_RO \
+		self_test_fixture_desc_##s = \
+		{ self_test_fixture_name_##s, self_test_fixture_level_##s, s, t }
+
+#define SELF_TEST_FIXTURE_STATE(s) \
+	sys_self_test_fixture(&self_test_fixture_desc_##s, self_test_report)
+
+// Memory budgets are only enforced under Linux; the budget is kept so
+// that the declaration still compiles.
+
+#define SELF_TEST_MEMORY_BUDGET(n,b) \
+	static const size_t SELF_TEST_RO self_test_budget_##n = (b)
+
+// Performance baselines are not checked under the Microsoft tool chain;
+// the measured code still compiles but sys_self_test_perf_next never runs
+// it.
+
+#define SELF_TEST_PERF_ASSERT(x,n,t) \
+	do { \
+		struct self_test_perf perf = { .name = # n, .tolerance = (t) }; \
+		size_t i; \
+		while (sys_self_test_perf_next(&perf)) \
+			for (i = perf.iterations; i != 0; --i) \
+				SELF_BENCH_KEEP(x); \
+		if (!sys_self_test_perf_check(&perf, self_test_report, __FILE__, \
+			__LINE__)) \
+			goto failure; \
+	} while(0)
+
 #define SELF_TEST_ASSERT(x) \
 	do { \
 		if (!(x)) { \